@@ -0,0 +1,112 @@
+/*
+ * cam_regs.h - camera register tables and DMA driven i2C register sequencer
+ *
+ *  Created on: Jan 12, 2026
+ *      Author: finazzi
+ */
+
+#ifndef __CAM_REGS_H__
+#define __CAM_REGS_H__
+
+#include "main.h"
+#include <stdint.h>
+
+#define NUM_CAMERAS						 (2U)
+#define CAM_TABLE_MAX_OPS				 (32U)								// ops per camera table, END included
+
+// Sensor registers - TODO: confirm against sensor datasheet. Not in the
+// default profiles until they are: ground uploads (CAMERA_TABLE_WRITE) set
+// the output format
+#define CAM_REG_RESET					 (0x000DU)							// soft reset, self clearing after write of 0
+#define CAM_REG_INTEGRATION_TIME		 (0x0009U)							// shutter width, in lines
+#define CAM_REG_GLOBAL_GAIN				 (0x0035U)
+#define CAM_REG_OUTPUT_FORMAT			 (0x0097U)
+#define CAM_OUTPUT_YCBCR422				 (0x0000U)							// YCbCr 4:2:2, 8b output, Y Cb Y Cr order:
+																			// [Y0, Cb, Y1, Cr] in memory, as every codec reads it
+
+// ----------------------- Register table format -----------------------
+typedef enum {
+	CAM_OP_END = 0,					  // end of table
+	CAM_OP_WRITE,					  // write val to reg, checked by readback once the table is done
+	CAM_OP_WRITE_NOVERIFY,			  // write val to reg (self clearing / write only registers)
+	CAM_OP_DELAY,					  // wait val ms before the next op
+	CAM_NUM_OPS
+} cam_op_t;
+
+typedef struct {
+	uint8_t  op;					  // cam_op_t
+	uint16_t reg;					  // 16b register address (unused for DELAY / END)
+	uint16_t val;					  // value to write, or delay in ms
+} cam_reg_op_t;
+
+typedef struct {
+	uint32_t ready_ms;				  // power-on to verified configuration, last power-on
+	uint16_t ops_written;			  // register writes sent in the last configuration
+	uint8_t  verify_errors;			  // registers that did not read back as written
+	uint8_t  from_fram;				  // 1 if the table was loaded from FRAM, 0 if default profile
+	uint8_t  configured;			  // 1 once the table was applied and verified since power-on
+} cam_config_status_t;
+
+// ----------------------------- FRAM Memory ---------------------------
+// One record per camera: magic byte followed by CAM_TABLE_MAX_OPS packed ops
+// [op, reg MSB, reg LSB, val MSB, val LSB]. Written only by ground uploads
+#define CAM_TABLE_FRAM_MAGIC			 (0xCAU)
+#define CAM_OP_PACKED_SIZE				 (5U)
+#define CAM_TABLE_FRAM_SIZE				 (1U + (CAM_TABLE_MAX_OPS * CAM_OP_PACKED_SIZE))
+#define CAM_TABLES_FRAM_SIZE			 (NUM_CAMERAS * CAM_TABLE_FRAM_SIZE)
+
+extern const cam_reg_op_t cam_profile_A[];		// compile-time defaults
+extern const cam_reg_op_t cam_profile_B[];
+extern cam_reg_op_t cam_tables[NUM_CAMERAS][CAM_TABLE_MAX_OPS];	// working copies, applied on power-on
+extern volatile cam_config_status_t cam_config_status[NUM_CAMERAS];
+
+/**********************************************************
+ * Loads the register table of each camera from FRAM. If a
+ * camera has no valid table saved, its compile-time
+ * profile is used instead. Call once after SPI2 is up.
+ **********************************************************/
+void CamRegs_Load(void);
+
+/**********************************************************
+ * Streams the register table of a camera over i2C2 with
+ * DMA, one register per transfer, chained from the
+ * transfer complete interrupt. DELAY ops are waited on
+ * here. Blocks until the table is done or an error or
+ * timeout stops it.
+ **********************************************************/
+HAL_StatusTypeDef CamRegs_Apply(uint8_t camera);
+
+/**********************************************************
+ * Reads back every CAM_OP_WRITE register of a camera
+ * table. Mismatches are counted in cam_config_status
+ * and make the function return HAL_ERROR.
+ **********************************************************/
+HAL_StatusTypeDef CamRegs_Verify(uint8_t camera);
+
+/**********************************************************
+ * Changes one op of a camera table (ground upload) and
+ * saves the whole table to FRAM, so it is used from the
+ * next power-on and survives resets. field 0 sets op and
+ * register address, field 1 sets the value.
+ **********************************************************/
+HAL_StatusTypeDef CamRegs_SetOp(uint8_t camera, uint8_t index, uint8_t field, uint8_t op, uint16_t word);
+
+/**********************************************************
+ * Goes back to the compile-time profile of a camera and
+ * invalidates its table in FRAM
+ **********************************************************/
+void CamRegs_RestoreDefault(uint8_t camera);
+
+/**********************************************************
+ * Returns the first WRITE op of a camera table that sets
+ * reg, or NULL if the table doesn't touch it
+ **********************************************************/
+cam_reg_op_t* CamRegs_Find(uint8_t camera, uint16_t reg);
+
+/**********************************************************
+ * Callbacks for the DMA i2C2 transfers of the sequencer
+ **********************************************************/
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c);
+
+#endif /* __CAM_REGS_H__ */
@@ -13,7 +13,7 @@
 #include <stdint.h>
 #include "ls_comms.h"
 
-#define NUM_COMMANDS 	  (13U)		// this needs to be changed to reflect exact number of istructions or risk an illegal memory access - TODO
+#define NUM_COMMANDS 	  (29U)		// this needs to be changed to reflect exact number of istructions or risk an illegal memory access - TODO
 
 // Handler type for all commands
 typedef HAL_StatusTypeDef (*command_handler_t)(uint8_t*);
@@ -50,12 +50,288 @@ void FillTxBufferWithZeroes(void);
  * memory.
  *
  * opcode:
- * 1st Byte: camera number (0 or 1, 1b), buffer number (0, 1, 2, 2b) - [X, X, X, X, X, buffer_number[1], buffer_number[0], camera_number]
- * 2nd Byte: tries to attempt (1-15, 4b), compression (0, 1, 2, 3, 2b)  - [X, X, compression[1], compression[0], tries[3], tries[2], tries[1], tries[0]]
+ * 1st Byte: camera number (0 or 1, 1b), buffer number (0, 1, 2, 2b), crop preset (0 = full frame, 1-3, 2b),
+ *           preview filtering (1b), QT slot (2b) - [slot[1], slot[0], preview, crop[1], crop[0], buffer_number[1], buffer_number[0], camera_number]
+ *           With preview filtering, black filtering runs on a reduced resolution frame in internal
+ *           RAM (DCMICapturePreview) and the full frame is only captured once a preview passes.
+ *           QT slot 1-3: JPEG codecs use the quantization tables uploaded with JPEG_TABLE_WRITE instead
+ *           of compression and size budget (fails if the slot is empty). 0 = built-in tables.
+ * 2nd Byte: tries to attempt (1-15, 4b), compression (0, 1, 2, 3, 2b), codec (2b)  - [codec[1], codec[0], compression[1], compression[0], tries[3], tries[2], tries[1], tries[0]]
+ *           codec 0: JPEG, 1: wavelet (CCSDS 122.0 style, Y only, compression 0 lossless, 1-3 poor to good,
+ *           decoded by Tools/wavelet_decode.py). The size budget cuts every strip of a wavelet image.
+ *           codec 2: lossless (CCSDS 121.0 style Rice, whole YCbCr frame, Tools/rice_decode.py), compression
+ *           and size budget are ignored. codec 3: grayscale JPEG, Y only, same compression and budget as codec 0.
  * 3rd Byte: black filtering (1b), black_treshold (7b) - [thr[7], thr[6], thr[5], thr[4], thr[3], thr[2], thr[1], thr[0], filtering]
+ * 4th Byte: compressed size budget in KB (8b), 0 = jpeg_config default (SET_JPEG_CONFIG). With a budget,
+ *           rate control picks the IJG quality and compression is ignored. Compression 0 uses the IJG
+ *           quality of jpeg_config, 1-3 are the fixed presets.
+ *
+ * Every frame rejected by black filtering runs one auto
+ * exposure step (AutoExposureUpdate) before the next try.
+ * Response (also used by TAKE_PICTURE_DELAYED):
+ * tx_buffer[2]: tries rejected, [3]: exposure updates, [4]: mean Y of last rejected frame,
+ * [5-6]: integration time, [7-8]: gain (LSB first), [9]: exposure limit reached,
+ * [10]: JPEG quality used, [11-14]: compressed size (LSB first), [15]: JPEG format flags (JPEG_FORMAT_*),
+ * [16]: compressed image index, [17]: index of its thumbnail (0xFF = none), [18-19]: thumbnail size (LSB first).
+ * The thumbnail is an 80x60 JPEG (1/8 scale), downloaded like any other image with TRANSMIT_FRAME_COMPRESSED,
+ * or the 320x240 quick look when SET_JPEG_QUICKLOOK is on (format JPEG_FORMAT_HALF).
+ * [20]: changed 64x64 tiles (SET_CHANGE_DETECT, 0xFF = not scored). With eviction on, a full frame with
+ * fewer than min_tiles changed tiles is not compressed: tx_buffer[1] = UNCHANGED_SCENE_ERR,
+ * [20]: changed tiles, [21]: recent image matched (1 = newest)
  **********************************************************/
 HAL_StatusTypeDef CMD_TakePicture(uint8_t *opcode);
 
+/**********************************************************
+ * Takes one picture with each camera, pipelining capture
+ * and compression: the second camera's frame is captured
+ * through DCMI + DMA while the CPU compresses the first.
+ *
+ * opcode:
+ * 1st Byte: first camera (1b), first buffer (2b), second buffer (2b) - [X, X, X, buf2[1], buf2[0], buf1[1], buf1[0], camera_number]
+ * 2nd Byte: compression (2b), codec (2b) - [codec[1], codec[0], compression[1], compression[0], X, X, X, X]
+ * 3rd Byte: QT slot (2b, as TAKE_PICTURE) - [X, X, X, X, X, X, slot[1], slot[0]]
+ **********************************************************/
+HAL_StatusTypeDef CMD_TakePicturePair(uint8_t *opcode);
+
+/**********************************************************
+ * Takes a stacked picture for low light scenes: 2 or 4
+ * frames of one camera are averaged into one before it is
+ * compressed (CaptureStacked), which cuts the noise by
+ * sqrt(frames) and the bytes it costs. Each frame is
+ * captured while the previous ones are merged. Uses all
+ * the raw buffers: the other two are left free.
+ *
+ * opcode:
+ * 1st Byte: camera number (1b), buffer number (2b), crop preset (2b), 4 frames (1b, 0 = 2 frames),
+ *           registration (1b) - [X, registration, four, crop[1], crop[0], buffer_number[1], buffer_number[0], camera_number]
+ *           With registration every frame is shifted onto the first one (whole pixel pairs and lines,
+ *           up to 8 each way) before it is averaged, for pointing drift between frames.
+ * 2nd Byte: QT slot (2b), compression (2b), codec (2b) - [codec[1], codec[0], compression[1], compression[0], X, X, slot[1], slot[0]]
+ *           as TAKE_PICTURE
+ * 4th Byte: compressed size budget in KB (8b), 0 = jpeg_config default
+ * Response: [2]: frames averaged, [3-8]: shift in pixels and lines (int8) of each merge
+ * ([dx, dy] of 1+2, 3+4, then both), [10-19]: as TAKE_PICTURE
+ **********************************************************/
+HAL_StatusTypeDef CMD_TakePictureStacked(uint8_t *opcode);
+
+/**********************************************************
+ * Takes an HDR picture for high contrast scenes (bright
+ * clouds over a dark sea): an exposure bracket around the
+ * current integration time, fused into one frame before
+ * it is compressed (CaptureHDR). Uses all the raw
+ * buffers: the other two are left free.
+ *
+ * opcode:
+ * 1st Byte: camera number (1b), buffer number (2b), crop preset (2b), bracket step (2b, 1-4 stops)
+ *           - [X, ev[1], ev[0], crop[1], crop[0], buffer_number[1], buffer_number[0], camera_number]
+ * 2nd Byte: QT slot (2b), compression (2b), codec (2b) as TAKE_PICTURE_STACKED
+ * 4th Byte: compressed size budget in KB (8b), 0 = jpeg_config default
+ * Response: [2-7]: integration time of the short, mid and long frames (LSB first),
+ * [8]: % of the image from the short frame, [9]: from the long frame, [10-19]: as TAKE_PICTURE
+ **********************************************************/
+HAL_StatusTypeDef CMD_TakePictureHDR(uint8_t *opcode);
+
+/**********************************************************
+ * Sets the region of interest of one of the crop presets
+ * selected by TAKE_PICTURE. Values are in CROP_UNIT (8 px)
+ * units so that the window is aligned to JPEG blocks.
+ *
+ * opcode:
+ * 1st Byte: preset (1-3, 2b), y0 (6b) - [y0[5], ..., y0[0], preset[1], preset[0]]
+ * 2nd Byte: x0 (7b)
+ * 3rd Byte: width (7b)
+ * 4th Byte: height (7b)
+ **********************************************************/
+HAL_StatusTypeDef CMD_SetCropPreset(uint8_t *opcode);
+
+/**********************************************************
+ * Sets the JPEG compression configuration used by
+ * compression 0 and by commands without a size budget
+ * field (TAKE_PICTURE_DELAYED, TAKE_PICTURE_PAIR).
+ *
+ * opcode:
+ * 1st Byte: IJG quality (1-100)
+ * 2nd-3rd Byte: default size budget in KB (LSB first), 0 = no rate control
+ * 4th Byte: restart interval in MCU rows (6b, 0 = none), optimized Huffman tables (1b), progressive JPEG (1b)
+ *           [rows[5], rows[4], rows[3], rows[2], rows[1], rows[0], progressive, huffman].
+ *           Apply to every compression. Huffman takes about twice the encode time if the coefficients
+ *           don't fit the free SRAM, progressive falls back to baseline (format in the metadata).
+ *           A progressive image sent with TRANSMIT_FRAME_COMPRESSED gives a preview of the whole
+ *           image from its first frames (DC scan)
+ **********************************************************/
+HAL_StatusTypeDef CMD_SetJpegConfig(uint8_t *opcode);
+
+/**********************************************************
+ * Sets the half resolution quick look. With a quality,
+ * every JPEG is stored with a 320x240 JPEG of itself
+ * instead of the 80x60 thumbnail: the encoder averages
+ * 2x2 pixels while it reads the frame and encodes both
+ * images at once. Only for one pass baseline encodes (no
+ * size budget, optimized Huffman or progressive), others
+ * keep the thumbnail.
+ *
+ * opcode:
+ * 1st Byte: IJG quality of the quick look (1-100), 0 = off
+ **********************************************************/
+HAL_StatusTypeDef CMD_SetJpegQuicklook(uint8_t *opcode);
+
+/**********************************************************
+ * Sets tiled JPEGs: with a tile size, baseline images
+ * whose width is a whole number of tiles get one restart
+ * interval per tile and MCU row instead of the restart
+ * interval of SET_JPEG_CONFIG. The image is still one
+ * JPEG, and any tile can be downloaded alone with
+ * TRANSMIT_TILE. 2-4% larger (RST markers, padding).
+ *
+ * opcode:
+ * 1st Byte: tile size in MCUs (8 px), 16 (128x128) up to 80, 0 = off
+ **********************************************************/
+HAL_StatusTypeDef CMD_SetJpegTiles(uint8_t *opcode);
+
+/**********************************************************
+ * Uploads a custom JPEG quantization table slot, 3
+ * quantizers per command, then commits it. The slot is
+ * saved to FRAM and its encoder tables (DQT and the DCT
+ * reciprocals) are built once at commit and at boot, so
+ * images that pick it cost no more than the built-in
+ * tables. The slot can't be used from the first write
+ * until the commit.
+ *
+ * opcode:
+ * 1st Byte: slot (1-3, 2b), table (1b, 0 luma, 1 chroma), chunk (5b)
+ *           - [chunk[4], ..., chunk[0], table, slot[1], slot[0]]
+ *           chunk 0-21: quantizers 3 * chunk to 3 * chunk + 2 of the table, natural (row by row)
+ *           order, 1-255. Chunk 31 commits the slot (table ignored): fails if a quantizer is 0.
+ * 2nd-4th Byte: quantizers
+ **********************************************************/
+HAL_StatusTypeDef CMD_JpegTableWrite(uint8_t *opcode);
+
+/**********************************************************
+ * Sets change detection (change_config_t). When enabled,
+ * every full frame compressed is scored against the
+ * signatures of the recent images that changed, kept in
+ * FRAM: per 64x64 tile, after the best global shift and
+ * exposure offset. An image with fewer than min_tiles
+ * changed tiles is unchanged: it is low priority and its
+ * signature is not kept. The changed tiles of every image
+ * are in its metadata and GET_CHANGE_MASK.
+ *
+ * opcode:
+ * 1st Byte: enabled (1b), evict (1b), clear (1b) - [X, X, X, X, X, clear, evict, enabled]
+ *           evict: TAKE_PICTURE and TAKE_PICTURE_DELAYED drop unchanged frames before compression.
+ *           clear: forgets the recent images, the next frame is all new.
+ * 2nd Byte: threshold, mean Y difference of a changed tile (8b), 0 = default (12)
+ * 3rd Byte: min_tiles (8b, up to 80), 0 = default (2)
+ **********************************************************/
+HAL_StatusTypeDef CMD_SetChangeDetect(uint8_t *opcode);
+
+/**********************************************************
+ * Transmits the change detection result of a compressed
+ * image. With the restart index, the intervals covering
+ * the changed tiles can be downloaded alone.
+ *
+ * opcode:
+ * 1st Byte: compressed image index
+ * Response: [1]: changed tiles (0xFF = not scored, nothing else sent), [2]: tile columns (10),
+ * [3]: tile rows (8, the last one 64x32), [4]: recent image matched (1 = newest, 0 = none: all new),
+ * [5-6]: shift of that image in 16 pixel cells (int8, x then y),
+ * [7-16]: changed tiles, bit t of byte t / 8 for tile t in raster order
+ **********************************************************/
+HAL_StatusTypeDef CMD_GetChangeMask(uint8_t *opcode);
+
+/**********************************************************
+ * Uploads one op of a camera register table (cam_regs.h).
+ * The table is saved to FRAM and applied from the next
+ * time the camera is turned on. An op is sent in two
+ * commands: field 0 (op + register), field 1 (value).
+ * Writing an END op at an index truncates the table.
+ *
+ * opcode:
+ * 1st Byte: camera (1b), field (1b), index (0-30, 5b), restore default (1b)
+ *           - [restore, index[4], ..., index[0], field, camera_number]
+ * 2nd Byte: op (END 0, WRITE 1, WRITE_NOVERIFY 2, DELAY 3), field 0 only
+ * 3rd Byte: register / value LSB
+ * 4th Byte: register / value MSB
+ **********************************************************/
+HAL_StatusTypeDef CMD_CameraTableWrite(uint8_t *opcode);
+
+/**********************************************************
+ * Reports the result of the last configuration of each
+ * camera. For camera A in bytes 1-9 and camera B in
+ * bytes 10-18:
+ * time to ready in ms (4B, LSB first), register writes
+ * (2B, LSB first), verify errors, table from FRAM,
+ * configured
+ **********************************************************/
+HAL_StatusTypeDef CMD_CameraConfigStatus(uint8_t *opcode);
+
+/**********************************************************
+ * Transmits the restart index of a compressed image: the
+ * byte offset in the JPEG file of the entropy coded data
+ * of each restart interval. Every interval decodes on its
+ * own, so a lost TRANSMIT_FRAME_COMPRESSED frame damages
+ * only the intervals it overlaps, and only the frames
+ * covering them need to be sent again.
+ *
+ * opcode:
+ * 1st Byte: compressed image index
+ * 2nd-3rd Byte: first interval to send (LSB first)
+ * Response: [1-2]: number of intervals, [3-4]: first interval,
+ * [5..100]: up to 24 offsets (4B each, LSB first)
+ **********************************************************/
+#define RESTART_OFFSETS_PER_FRAME	(24U)
+HAL_StatusTypeDef CMD_GetRestartIndex(uint8_t *opcode);
+
+/**********************************************************
+ * Transmits one tile of a tiled JPEG (SET_JPEG_TILES) as a
+ * JPEG file of the tile alone: the header of the image
+ * with the tile size, then the restart intervals of the
+ * tile. Nothing is stored, the file is put together from
+ * the image frame by frame. Tiles are numbered in raster
+ * order, the last row is cut at the bottom of the image.
+ *
+ * opcode:
+ * 1st Byte: compressed image index
+ * 2nd Byte: tile
+ * 3rd-4th Byte: frame number (LSB first)
+ * Response: [0]: index, [1]: tile, [2-3]: tile width, [4-5]: tile height,
+ * [6-9]: size of the tile JPEG, [10-11]: frame number, [12]: tile columns,
+ * [13]: tile rows, [14]: bytes in this frame (0 past the end),
+ * [19..98]: bytes frame * 80 on of the tile JPEG
+ **********************************************************/
+#define TILE_FRAME_BYTES			(80U)
+HAL_StatusTypeDef CMD_TransmitTile(uint8_t *opcode);
+
+/**********************************************************
+ * Starts a background JPEG compression of a captured raw
+ * buffer (CompressToJPEG_Start) and answers at once. The
+ * image is encoded a slice of MCU rows at a time while no
+ * command is pending, checkpointed to FRAM after every
+ * slice: a reset resumes it. Baseline only, see
+ * SET_JPEG_CONFIG for the quality and restart interval.
+ * No other image can be compressed until it is done.
+ *
+ * opcode:
+ * 1st Byte: buffer (2b), compression (2b), grayscale (1b) - [X, X, X, gray, comp[1], comp[0], buf[1], buf[0]]
+ * 2nd Byte: MCU rows (8 lines) per slice, 0 = JPEG_JOB_DEFAULT_ROWS
+ * Response: [1]: compressed index the image will get (thumbnail next)
+ **********************************************************/
+HAL_StatusTypeDef CMD_CompressStart(uint8_t *opcode);
+
+/**********************************************************
+ * Reports the background JPEG compression:
+ * [1]: state (0 idle, 1 running, 2 done, 3 failed),
+ * [2]: resumed after a reset, [3]: raw buffer,
+ * [4]: compressed index, [5-6]: MCU rows done,
+ * [7-8]: MCU rows of the image, [9-12]: bytes written,
+ * the image size once done (LSB first),
+ * [13-16]: CPU cycles per 8x8 MCU of the last JPEG,
+ * background or not (LSB first),
+ * [17-20]: blocks of the last JPEG coded DC only, without
+ * a DCT, because they were flat (LSB first)
+ **********************************************************/
+HAL_StatusTypeDef CMD_CompressStatus(uint8_t *opcode);
+
 
 // high level command functions - TODO
 HAL_StatusTypeDef CMD_TakePictureForced(uint8_t *opcode);
@@ -36,6 +36,8 @@ extern DCMI_HandleTypeDef hdcmi;
 
 /* USER CODE BEGIN Private defines */
 
+extern DMA_HandleTypeDef hdma_dcmi;
+
 /* USER CODE END Private defines */
 
 void MX_DCMI_Init(void);
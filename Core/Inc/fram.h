@@ -22,11 +22,7 @@
 typedef struct {
 	uint16_t photos_taken;
 	uint32_t total_frames_sent;
-	uint32_t time_on;
-	uint8_t camera_regs_A[20];		// Camera registers to write
-	uint8_t camera_reg_B[20];
-	uint8_t camera_params_A[20];	// Parameters to write them with
-	uint8_t camera_params_B[20];
+	uint32_t time_on;				// camera register tables are kept apart, see cam_regs.h
 } status_t;
 
 /* ============================================================
@@ -115,11 +115,17 @@ extern "C"
 //                          2: Very good quality. About 1/2 the size of 3.
 //                          1: Noticeable. About 1/6 the size of 3, or 1/3 the size of 2.
 //      width, height:      image size in pixels
-//      num_components:     Must be 3 for YUV422 input (already handled internally)
+//      num_components:     3 for YUV422 input (already handled internally). 1 encodes
+//                          only the Y of the same input: grayscale, one block per MCU
 //      src_data:           pointer to YUV422 pixel data [Y0,Cb,Y1,Cr,...]
 //
+//  The JPEG is written straight into memory_buffer, checked against its end
+//  once per write.
+//
 //  RETURN:
-//      0 on error. 1 on success.
+//      0 on error, also if the image doesn't fit buffer_size: nothing is
+//      written past it and bytes_written is the size the image needs.
+//      1 on success.
 
 int tje_encode_to_memory(uint8_t* memory_buffer,
                          uint32_t buffer_size,
@@ -148,6 +154,288 @@ int tje_encode_with_func(tje_write_func* func,
                          const int num_components,
                          const unsigned char* src_data);
 
+// - tje_encode_to_memory_ijg -
+//
+// Usage:
+//  Same as tje_encode_to_memory, with the 1-100 quality scale of the IJG
+//  library (libjpeg -quality): the K.1 spec tables are scaled by 5000/quality
+//  below 50 and by 200 - 2*quality above it. 50 gives the spec tables, 100
+//  all ones.
+
+int tje_encode_to_memory_ijg(uint8_t* memory_buffer,
+                             uint32_t buffer_size,
+                             uint32_t* bytes_written,
+                             const int quality,
+                             const int width,
+                             const int height,
+                             const int num_components,
+                             const unsigned char* src_data);
+
+// - tje_encode_to_memory_target -
+//
+// Usage:
+//  Rate controlled encode. Picks the highest IJG quality whose estimated size
+//  fits target_size, then encodes the image. The estimate encodes only 1 out
+//  of TJE_RC_SAMPLE_STEP x TJE_RC_SAMPLE_STEP MCUs, without output, for each
+//  quality of a binary search over 1-100 (7 estimates, about half the cost of
+//  a full encode). If the real size still exceeds the target, the search is
+//  redone once with the target corrected by the measured error.
+//
+//  PARAMETERS
+//      target_size:        size budget in bytes
+//      quality_used:       receives the IJG quality of the written image
+//
+//  RETURN:
+//      0 on error. 1 on success, even if no quality fits the target (the
+//      image is then written at quality 1).
+
+int tje_encode_to_memory_target(uint8_t* memory_buffer,
+                                uint32_t buffer_size,
+                                uint32_t* bytes_written,
+                                const uint32_t target_size,
+                                int* quality_used,
+                                const int width,
+                                const int height,
+                                const int num_components,
+                                const unsigned char* src_data);
+
+// - tje_encode_to_memory_opt -
+//
+// Usage:
+//  Encodes with every option of the functions above, plus per image optimized
+//  Huffman tables. With optimize_huffman the image is encoded twice: pass 1
+//  runs the DCT and only counts the symbols, the optimal code lengths are
+//  built from the counts (JPEG spec K.2, limited to 16 bits) and pass 2 writes
+//  the image with its own DHT segments. Pass 1 caches its symbols in the
+//  scratch buffer after the TJEHuffWork tables (about 3 bytes per nonzero
+//  coefficient); if the cache fills up, pass 2 runs the DCT again instead.
+//
+//  With progressive, the cached coefficients are written as 10 scans (DC
+//  first, then low frequency AC, then refinements, libjpeg's simple
+//  progression), each with optimized tables, so the first few percent of the
+//  file already decode to a preview of the whole image. It needs the whole
+//  symbol cache: if it overflows, the image is written baseline.
+//
+//  PARAMETERS
+//      options->quality:           1-3: flash presets. 0: ijg_quality
+//      options->ijg_quality:       1-100. Receives the quality picked by rate control
+//      options->target_size:       size budget in bytes, 0 = no rate control
+//      options->optimize_huffman:  1: two pass encode with optimized tables
+//      options->progressive:       1: progressive JPEG (SOF2), see below. Cleared
+//                                  if the image was written baseline instead
+//      options->scratch:           4 byte aligned work area, at least
+//                                  sizeof(TJEHuffWork). Default tables are
+//                                  used if it is missing or too small
+//      options->restart_interval:  MCUs per restart interval (DRI/RSTn), 0 = none.
+//                                  Baseline only, ignored with progressive
+//      options->restart_offsets:   receives the file offset of the entropy coded
+//                                  data of each interval, up to restart_max
+//      options->restart_count:     receives the number of intervals
+//      options->thumbnail:         receives the 1/8 scale image, NULL = none. See below
+//      options->wrap_start, wrap_end:  ring buffer around memory_buffer, NULL =
+//                                  none. The output reaching wrap_end goes on at
+//                                  wrap_start, buffer_size is capped to the ring
+//      options->flat_blocks:       receives the number of 8x8 blocks coded DC
+//                                  only, without a DCT: blocks so flat that
+//                                  every AC coefficient quantizes to zero
+//      options->tables:            custom quantization tables, NULL = none.
+//                                  They replace quality, ijg_quality and rate
+//                                  control (target_size is ignored)
+//
+//  The thumbnail costs no extra pass over the source: the MCU loop that feeds
+//  the DCT also averages each 8x8 block into one pixel (the DC of the block).
+//  It is written YCbCr 4:2:2 like the source, TJE_THUMB_WIDTH x
+//  TJE_THUMB_HEIGHT, ready to be encoded as a JPEG of its own.
+//
+//  The output is written straight to memory_buffer, without staging copies.
+//
+//  RETURN:
+//      0 on error, also if the image doesn't fit buffer_size: bytes_written is
+//      then the size it needs. 1 on success.
+
+// Thumbnail of a width x height image: one pixel per 8x8 block, the width
+// rounded up to even for 4:2:2 (last pixel repeated)
+#define TJE_THUMB_WIDTH(w)  (((w) + 15) / 16 * 2)
+#define TJE_THUMB_HEIGHT(h) (((h) + 7) / 8)
+
+// Quantization tables: the DQT segments and the reciprocals the DCT
+// multiplies by. Built once per quality (or per uploaded table), used as is
+// by every encode that points at them
+typedef struct
+{
+    uint8_t qt_luma[64];            // DQT, zig-zag order
+    uint8_t qt_chroma[64];
+    float   pqt_luma[64];           // AAN scaled reciprocals, natural order
+    float   pqt_chroma[64];
+} TJEQuantTables;
+
+// - tje_build_quant_tables -
+//
+// Usage:
+//  Builds the tables of options->tables from a luma and a chroma table of 64
+//  quantizers each (1-255), in natural (row by row) order like the tables of
+//  JPEG spec Annex K.
+//
+//  RETURN:
+//      0 if a quantizer is 0. 1 on success.
+
+int tje_build_quant_tables(TJEQuantTables* tables, const uint8_t* luma, const uint8_t* chroma);
+
+// Per image Huffman tables, at the start of the scratch buffer
+typedef struct
+{
+    uint32_t freq[4][257];          // symbol counts of pass 1, [256] reserved (K.2)
+    uint8_t  bits[4][16];           // DHT: number of codes of each length
+    uint8_t  vals[4][256];          // DHT: symbols by increasing code length
+    uint8_t  ehuffsize[4][256];     // code length of each symbol, 0 if unused
+    uint16_t ehuffcode[4][256];
+} TJEHuffWork;
+
+typedef struct
+{
+    int       quality;
+    int       ijg_quality;
+    uint32_t  target_size;
+    int       optimize_huffman;
+    int       progressive;
+    uint8_t*  scratch;
+    uint32_t  scratch_size;
+    uint32_t  restart_interval;
+    uint32_t* restart_offsets;
+    uint32_t  restart_max;
+    uint32_t  restart_count;
+    uint8_t*  thumbnail;
+    uint8_t*  wrap_start;
+    uint8_t*  wrap_end;
+    uint32_t  flat_blocks;
+    const TJEQuantTables* tables;
+} TJEOptions;
+
+int tje_encode_to_memory_opt(uint8_t* memory_buffer,
+                             uint32_t buffer_size,
+                             uint32_t* bytes_written,
+                             TJEOptions* options,
+                             const int width,
+                             const int height,
+                             const int num_components,
+                             const unsigned char* src_data);
+
+// - tje_encode_begin / tje_encode_step -
+//
+// Usage:
+//  Resumable encode to memory, for callers that can't block for a whole
+//  frame. tje_encode_begin checks the options and writes the headers, then
+//  every tje_encode_step encodes up to mcu_rows rows of MCUs (8 lines each)
+//  straight to memory_buffer and returns; the last one writes EOI. The file is
+//  byte for byte the one tje_encode_to_memory_opt writes with the same options.
+//
+//  Between steps the whole encoder is the TJEEncoder: the configuration and
+//  the TJEResume point of the next row (DC predictors, bits not written yet,
+//  output offset, restart interval state). Nothing points at the stack, so
+//  the struct can be copied out (e.g. to non volatile memory) and a copy
+//  stepped again after a reset, as long as the source, the output written so
+//  far and the restart_offsets, thumbnail and tables arrays are still in place.
+//
+//  Only quality, ijg_quality, tables, restart_*, thumbnail and wrap_* of the
+//  options are used: rate control, optimized Huffman tables and progressive need the whole
+//  image before the first byte is final. The result is in resume:
+//  bytes_written is the file size once done, restart_count the intervals,
+//  flat_blocks the blocks coded DC only.
+//
+//  RETURN:
+//      tje_encode_begin:   0 on error. 1 on success.
+//      tje_encode_step:    TJE_STEP_MORE, TJE_STEP_DONE (also once done), or
+//                          TJE_STEP_ERROR if the image doesn't fit buffer_size.
+
+#define TJE_STEP_ERROR  0
+#define TJE_STEP_MORE   1
+#define TJE_STEP_DONE   2
+
+typedef struct
+{
+    uint32_t  mcu_row;              // next row of MCUs
+    uint32_t  bytes_written;        // file offset of the next byte
+    uint32_t  bitbuffer;            // bits not written yet, MSB first
+    uint32_t  location;             // number of them, < 8
+    int32_t   pred[3];              // DC predictors: Y, Cb, Cr
+    uint32_t  restart_mcus;
+    uint32_t  restart_marker;
+    uint32_t  restart_count;
+    uint32_t  flat_blocks;
+} TJEResume;
+
+typedef struct
+{
+    uint8_t*             memory_buffer;
+    uint32_t             buffer_size;
+    const unsigned char* src_data;
+    uint16_t             width;
+    uint16_t             height;
+    uint8_t              num_components;    // 1 or 3
+    uint8_t              quality;           // 1-3 presets, 0 = ijg_quality
+    uint8_t              ijg_quality;
+    const TJEQuantTables* tables;           // custom tables, NULL = quality
+    uint32_t             restart_interval;
+    uint32_t*            restart_offsets;
+    uint32_t             restart_max;
+    uint8_t*             thumbnail;
+    uint8_t*             wrap_start;
+    uint8_t*             wrap_end;
+    TJEResume            resume;
+} TJEEncoder;
+
+int tje_encode_begin(TJEEncoder* enc,
+                     uint8_t* memory_buffer,
+                     uint32_t buffer_size,
+                     const TJEOptions* options,
+                     const int width,
+                     const int height,
+                     const int num_components,
+                     const unsigned char* src_data);
+
+int tje_encode_step(TJEEncoder* enc, const uint32_t mcu_rows);
+
+// - tje_encode_to_memory_dual -
+//
+// Usage:
+//  Encodes the image and a half resolution copy of it from one read of the
+//  source. The MCU loop of the image also sums every 2x2 pixels of the block
+//  into a strip of 8 lines of the half image; once two rows of MCUs have
+//  filled the strip, it is encoded as one row of MCUs of the half image. The
+//  half image is TJE_HALF_WIDTH x TJE_HALF_HEIGHT (320x240 for 640x480); with
+//  a width that is not a multiple of 8 its last pixels repeat the edge.
+//
+//  Both are baseline, one pass, like tje_encode_begin: only quality,
+//  ijg_quality, tables, restart_*, wrap_* and (image only) thumbnail of the
+//  options are used. restart_count and flat_blocks are returned in each.
+//
+//  PARAMETERS
+//      half_buffer, half_buffer_size, half_bytes_written:
+//                          output of the half resolution image
+//      half_options:       its options
+//      strip:              TJE_HALF_STRIP_SIZE(width) bytes of work area
+//
+//  RETURN:
+//      0 on error, also if either image doesn't fit its buffer. 1 on success.
+
+#define TJE_HALF_WIDTH(w)       (((w) + 7) / 8 * 4)
+#define TJE_HALF_HEIGHT(h)      (((h) + 1) / 2)
+#define TJE_HALF_STRIP_SIZE(w)  (TJE_HALF_WIDTH(w) * 2 * 8)
+
+int tje_encode_to_memory_dual(uint8_t* memory_buffer,
+                              uint32_t buffer_size,
+                              uint32_t* bytes_written,
+                              TJEOptions* options,
+                              uint8_t* half_buffer,
+                              uint32_t half_buffer_size,
+                              uint32_t* half_bytes_written,
+                              TJEOptions* half_options,
+                              uint8_t* strip,
+                              const int width,
+                              const int height,
+                              const int num_components,
+                              const unsigned char* src_data);
+
 #endif // TJE_HEADER_GUARD
 
 
@@ -168,8 +456,10 @@ int tje_encode_with_func(tje_write_func* func,
 #if defined(_MSC_VER)
 #define TJEI_FORCE_INLINE __forceinline
 // #define TJEI_FORCE_INLINE __declspec(noinline)  // For profiling
+#elif defined(__GNUC__) || defined(__clang__)
+#define TJEI_FORCE_INLINE static inline __attribute__((always_inline))
 #else
-#define TJEI_FORCE_INLINE static // TODO: equivalent for gcc & clang
+#define TJEI_FORCE_INLINE static
 #endif
 
 // Only use zero for debugging and/or inspection.
@@ -196,43 +486,115 @@ static inline float ceilf_custom(float x) {
 
 #define TJEI_BUFFER_SIZE 1024
 
+// Rate control: 1 out of STEP x STEP MCUs is encoded by the size estimate
+#define TJE_RC_SAMPLE_STEP 4
+
 // Sin logging en embedded (o puede redirigirse a UART si se necesita)
 #define tje_log(msg) ((void)0)
 
 
-// Contexto para escritura en memoria
+// Output sink. Bytes go straight to [ptr, end), checked against end once per
+// write (once per word in the entropy coder). A memory sink points at the
+// destination itself: at end the output continues at wrap_start if the
+// destination is a ring, or the image doesn't fit. A function sink stages
+// the bytes in a buffer and hands it to func every time it fills up.
 typedef struct
 {
-    uint8_t* memory_ptr;      // Puntero actual de escritura
-    uint8_t* memory_start;    // Inicio del buffer de memoria
-    uint32_t memory_size;     // Tamaño total disponible
-    uint32_t bytes_written;   // Bytes escritos hasta ahora
-} TJEMemoryContext;
+    uint8_t*        ptr;            // next byte
+    uint8_t*        end;            // end of the current chunk
+    uint8_t*        base;           // start of the current chunk, file offset bytes_flushed
 
-typedef struct
-{
-    void*           context;
+    // Memory sink
+    uint8_t*        wrap_start;     // ring the output wraps around in, NULL = linear
+    uint8_t*        wrap_end;
+    uint32_t        wrap_left;      // bytes allowed after wrapping
+    int             overflow;       // 1 once the output didn't fit
+
+    // Function sink, NULL for a memory sink
     tje_write_func* func;
+    void*           context;
 } TJEWriteContext;
 
+// Staging buffer of the internal function sinks: pass 1 of the optimized
+// Huffman mode, size estimates, and the rest of an image that overflowed
+#define TJEI_SPILL_SIZE 64
+
+// Optimized Huffman mode: pass 1 gathers statistics, pass 2 writes the image
+// either from the symbols cached by pass 1 or by running the DCT again
+enum {
+    TJEI_PASS_WRITE,                // single pass, or pass 2 without cache
+    TJEI_PASS_GATHER,
+    TJEI_PASS_REPLAY,
+};
+
+// Tables are constant (jpeg_tables.h) or built once per image
+// (TJEQuantTables, TJEHuffWork), so the state only points at them and holds
+// the bit writer and the DC predictors
 typedef struct
 {
-    // Huffman data.
-    uint8_t         ehuffsize[4][257];
-    uint16_t        ehuffcode[4][256];
-    uint8_t const * ht_bits[4];
-    uint8_t const * ht_vals[4];
+    // Cuantization tables of the selected quality.
+    uint8_t const * qt_luma;        // DQT, as written to the file
+    uint8_t const * qt_chroma;
+    float const *   pqt_luma;       // AAN scaled reciprocals
+    float const *   pqt_chroma;
+
+    // Flat blocks: sample energy below which every AC coefficient quantizes
+    // to zero, see tjei_set_flat_limits
+    uint32_t        flat_luma;
+    uint32_t        flat_chroma;
+    uint32_t        flat_blocks;    // blocks coded DC only, without a DCT
+
+    // Huffman tables, [LUMA_DC, LUMA_AC, CHROMA_DC, CHROMA_AC]
+    uint8_t const *  ht_bits[4];    // DHT, as written to the file
+    uint8_t const *  ht_vals[4];
+    uint8_t const *  ehuffsize[4];
+    uint16_t const * ehuffcode[4];
+
+    // Restart intervals: every interval starts byte aligned after an RSTn
+    // marker with the DC predictors reset, so it decodes on its own
+    uint32_t        restart_interval;   // MCUs, 0 = no DRI
+    uint32_t        restart_mcus;       // MCUs left in the current interval
+    uint32_t        restart_marker;     // n of the next RSTn, 0-7
+    uint32_t*       restart_offsets;
+    uint32_t        restart_max;
+    uint32_t        restart_count;
+    uint32_t        bytes_flushed;      // file offset of write_context.base
+
+    // Optimized Huffman mode
+    uint32_t        pass;           // TJEI_PASS_*
+    TJEHuffWork*    huff_work;
+    uint8_t*        cache_ptr;      // symbol cache, written by pass 1, read by pass 2
+    uint8_t*        cache_end;
+    int             cache_valid;    // 0 once the cache has overflowed
+
+    // Output
+    TJEWriteContext write_context;
 
-    // Cuantization tables.
-    uint8_t         qt_luma[64];
-    uint8_t         qt_chroma[64];
+    // Bit stack
+    uint32_t        bitbuffer;
+    uint32_t        location;
 
-    // Contexto de escritura
-    TJEWriteContext write_context;
+    // Previous DC coefficients
+    int             pred_y;
+    int             pred_b;
+    int             pred_r;
+
+    // Size estimate: encode 1 out of sample_step x sample_step MCUs
+    uint32_t        sample_step;
+    uint32_t        scan_start;     // header bytes, before entropy coded data
+
+    // Components encoded: 3 (YCbCr) or 1 (Y only, grayscale)
+    int             num_components;
+
+    // Block averages, YCbCr 4:2:2 TJE_THUMB_WIDTH x TJE_THUMB_HEIGHT, NULL = none
+    uint8_t*        thumbnail;
+
+    // 8 lines of the half resolution image, filled with the 2x2 averages of
+    // two rows of MCUs, NULL = none. See tje_encode_to_memory_dual
+    uint8_t*        half_strip;
+    uint32_t        half_pitch;     // bytes per line
 
-    // Buffered output.
-    uint32_t        output_buffer_count;
-    uint8_t         output_buffer[TJEI_BUFFER_SIZE];
+    uint8_t         spill[TJEI_SPILL_SIZE];
 } TJEState;
 
 // ============================================================
@@ -241,16 +603,17 @@ typedef struct
 // The spec defines tjei_default reasonably good quantization matrices and huffman
 // specification tables.
 //
-//
-// Instead of hard-coding the final huffman table, we only hard-code the table
-// spec suggested by the specification, and then derive the full table from
-// there.  This is only for didactic purposes but it might be useful if there
-// ever is the case that we need to swap huffman tables from various sources.
+// Only the huffman table spec is kept here, for the DHT segments. The
+// extended huffman tables and the per quality quantization tables are built
+// by Tools/jpeg_tables_gen.py into jpeg_tables.h, so nothing is derived at
+// encode time.
 // ============================================================
 
+#include "jpeg_tables.h"
 
-// K.1 - suggested luminance QT
-static const uint8_t tjei_default_qt_luma_from_spec[] =
+// K.1 - suggested luminance and chrominance QT, base of the IJG quality scale
+// (natural order)
+static const uint8_t tjei_ijg_qt_luma[64] =
 {
    16,11,10,16, 24, 40, 51, 61,
    12,12,14,19, 26, 58, 60, 55,
@@ -262,11 +625,8 @@ static const uint8_t tjei_default_qt_luma_from_spec[] =
    72,92,95,98,112,100,103, 99,
 };
 
-// Unused
-#if 0
-static const uint8_t tjei_default_qt_chroma_from_spec[] =
+static const uint8_t tjei_ijg_qt_chroma[64] =
 {
-    // K.1 - suggested chrominance QT
    17,18,24,47,99,99,99,99,
    18,21,26,66,99,99,99,99,
    24,26,56,99,99,99,99,99,
@@ -276,22 +636,6 @@ static const uint8_t tjei_default_qt_chroma_from_spec[] =
    99,99,99,99,99,99,99,99,
    99,99,99,99,99,99,99,99,
 };
-#endif
-
-static const uint8_t tjei_default_qt_chroma_from_paper[] =
-{
-    // Example QT from JPEG paper
-    16,  12, 14,  14, 18, 24,  49,  72,
-    11,  10, 16,  24, 40, 51,  61,  12,
-    13,  17, 22,  35, 64, 92,  14,  16,
-    22,  37, 55,  78, 95, 19,  24,  29,
-    56,  64, 87,  98, 26, 40,  51,  68,
-    81, 103, 112, 58, 57, 87,  109, 104,
-    121,100, 60,  69, 80, 103, 113, 120,
-    103, 55, 56,  62, 77, 92,  101, 99,
-};
-
-// == Procedure to 'deflate' the huffman tree: JPEG spec, C.2
 
 // Number of 16 bit values for every code length. (K.3.3.1)
 static const uint8_t tjei_default_ht_luma_dc_len[16] =
@@ -354,6 +698,41 @@ static const uint8_t tjei_default_ht_chroma_ac[] =
     0xF9, 0xFA
 };
 
+enum {
+    TJEI_LUMA_DC,
+    TJEI_LUMA_AC,
+    TJEI_CHROMA_DC,
+    TJEI_CHROMA_AC,
+};
+
+// Points the state at the spec Huffman tables (K.3.3)
+static void tjei_use_default_huffman(TJEState* state)
+{
+    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
+    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
+    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
+    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
+    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
+    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
+    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
+    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+    for ( int i = 0; i < 4; ++i ) {
+        state->ehuffsize[i] = tjei_ehuffsize[i];
+        state->ehuffcode[i] = tjei_ehuffcode[i];
+    }
+}
+
+// Points the state at the per image tables of the optimized Huffman mode
+static void tjei_use_work_huffman(TJEState* state, TJEHuffWork* work)
+{
+    for ( int i = 0; i < 4; ++i ) {
+        state->ht_bits[i]   = work->bits[i];
+        state->ht_vals[i]   = work->vals[i];
+        state->ehuffsize[i] = work->ehuffsize[i];
+        state->ehuffcode[i] = work->ehuffcode[i];
+    }
+}
+
 
 // ============================================================
 // Code
@@ -435,7 +814,7 @@ typedef struct
     uint8_t          precision;             // Sample precision (bits per sample).
     uint16_t         height;
     uint16_t         width;
-    uint8_t          num_components;        // For this implementation, will be equal to 3.
+    uint8_t          num_components;        // 3, or 1 for grayscale. Only as many specs are written
     TJEComponentSpec component_spec[3];
 } TJEFrameHeader;
 
@@ -449,7 +828,7 @@ typedef struct
 {
     uint16_t              SOS;
     uint16_t              len;
-    uint8_t               num_components;  // 3.
+    uint8_t               num_components;  // 3, or 1 for grayscale. Only as many specs are written
     TJEFrameComponentSpec component_spec[3];
     uint8_t               first;  // 0
     uint8_t               last;  // 63
@@ -458,27 +837,114 @@ typedef struct
 #pragma pack(pop)
 
 
-static void tjei_write(TJEState* state, const void* data, uint32_t num_bytes, uint32_t num_elements)
+// Bytes written so far: the file offset of the next one
+static uint32_t tjei_file_offset(const TJEState* state)
 {
-    uint32_t to_write = num_bytes * num_elements;
+    return state->bytes_flushed + (uint32_t)(state->write_context.ptr - state->write_context.base);
+}
+
+// The current chunk is over: a function sink hands it to func
+static void tjei_flush_output(TJEState* state)
+{
+    TJEWriteContext* wc = &state->write_context;
+    state->bytes_flushed += (uint32_t)(wc->ptr - wc->base);
+    if ( wc->func ) {
+        if ( wc->ptr != wc->base ) {
+            wc->func(wc->context, wc->base, (int)(wc->ptr - wc->base));
+        }
+        wc->ptr = wc->base;
+    } else {
+        wc->base = wc->ptr;
+    }
+}
 
-    // Cap to the buffer available size and copy memory.
-    uint32_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
+static void tjei_discard_func(void* context, void* data, int size)
+{
+    (void)context;
+    (void)data;
+    (void)size;
+}
 
-    memcpy(state->output_buffer + state->output_buffer_count, data, capped_count);
-    state->output_buffer_count += capped_count;
+// Function sink staging in buffer. bytes_flushed counts from the switch
+static void tjei_set_func_sink(TJEState* state, tje_write_func* func, void* context,
+                               uint8_t* buffer, uint32_t buffer_size)
+{
+    TJEWriteContext* wc = &state->write_context;
+    memset(wc, 0, sizeof(TJEWriteContext));
+    wc->func    = func;
+    wc->context = context;
+    wc->ptr     = buffer;
+    wc->base    = buffer;
+    wc->end     = buffer + buffer_size;
+    state->bytes_flushed = 0;
+}
 
-    assert (state->output_buffer_count <= TJEI_BUFFER_SIZE - 1);
+// Memory sink writing size bytes at memory. With a ring [wrap_start,
+// wrap_end) around memory, the output continues at wrap_start when it
+// reaches wrap_end; size is capped to the ring so the image never overwrites
+// its own start. bytes_flushed is the file offset of memory
+static void tjei_set_memory_sink(TJEState* state, uint8_t* memory, uint32_t size,
+                                 uint8_t* wrap_start, uint8_t* wrap_end, uint32_t offset)
+{
+    TJEWriteContext* wc = &state->write_context;
+    memset(wc, 0, sizeof(TJEWriteContext));
+    wc->ptr  = memory;
+    wc->base = memory;
+    if ( wrap_start && wrap_start <= memory && memory < wrap_end ) {
+        uint32_t ring  = (uint32_t)(wrap_end - wrap_start);
+        uint32_t first = (uint32_t)(wrap_end - memory);
+        if ( size > ring ) {
+            size = ring;
+        }
+        if ( size > first ) {
+            wc->wrap_start = wrap_start;
+            wc->wrap_end   = wrap_end;
+            wc->wrap_left  = size - first;
+            size = first;
+        }
+    }
+    wc->end = memory + size;
+    state->bytes_flushed = offset;
+}
 
-    // Flush the buffer.
-    if ( state->output_buffer_count == TJEI_BUFFER_SIZE - 1 ) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+// ptr reached end: next chunk of a ring, or of the staging buffer. Past the
+// end of a memory sink the bytes are only counted, and the encode fails
+static void tjei_next_chunk(TJEState* state)
+{
+    TJEWriteContext* wc = &state->write_context;
+    tjei_flush_output(state);
+    if ( wc->func ) {
+        return;
+    }
+    if ( wc->wrap_left ) {
+        wc->ptr  = wc->wrap_start;
+        wc->base = wc->wrap_start;
+        wc->end  = wc->wrap_start + wc->wrap_left;
+        wc->wrap_left = 0;
+        return;
     }
+    wc->overflow = 1;
+    wc->func = tjei_discard_func;
+    wc->ptr  = state->spill;
+    wc->base = state->spill;
+    wc->end  = state->spill + TJEI_SPILL_SIZE;
+}
+
+static void tjei_write(TJEState* state, const void* data, uint32_t num_bytes, uint32_t num_elements)
+{
+    TJEWriteContext* wc = &state->write_context;
+    const uint8_t* src = (const uint8_t*)data;
+    uint32_t to_write = num_bytes * num_elements;
 
-    // Recursively calling ourselves with the rest of the buffer.
-    if (capped_count < to_write) {
-        tjei_write(state, (uint8_t*)data+capped_count, to_write - capped_count, 1);
+    while ( to_write ) {
+        if ( wc->ptr == wc->end ) {
+            tjei_next_chunk(state);
+        }
+        uint32_t count = tjei_min(to_write, (uint32_t)(wc->end - wc->ptr));
+        memcpy(wc->ptr, src, count);
+        wc->ptr  += count;
+        src      += count;
+        to_write -= count;
     }
 }
 
@@ -526,62 +992,45 @@ static void tjei_write_DHT(TJEState* state,
     tjei_write(state, matrix_val, sizeof(uint8_t), (size_t)num_values);
 }
 // ============================================================
-//  Huffman deflation code.
-// ============================================================
 
-// Returns all code sizes from the BITS specification (JPEG C.3)
-static uint8_t* tjei_huff_get_code_lengths(uint8_t huffsize[/*256*/], uint8_t const * bits)
+// Number of bits of a nonzero magnitude: CLZ on Cortex-M3
+#if defined(__GNUC__) || defined(__clang__)
+#define tjei_bit_length(v) ((uint16_t)(32 - __builtin_clz((uint32_t)(v))))
+#else
+static uint16_t tjei_bit_length(uint32_t v)
 {
-    int k = 0;
-    for ( int i = 0; i < 16; ++i ) {
-        for ( int j = 0; j < bits[i]; ++j ) {
-            huffsize[k++] = (uint8_t)(i + 1);
-        }
-        huffsize[k] = 0;
+    uint16_t n = 0;
+    while ( v ) {
+        v >>= 1;
+        ++n;
     }
-    return huffsize;
+    return n;
 }
+#endif
 
-// Fills out the prefixes for each code.
-static uint16_t* tjei_huff_get_codes(uint16_t codes[], uint8_t* huffsize, int64_t count)
-{
-    uint16_t code = 0;
-    int k = 0;
-    uint8_t sz = huffsize[0];
-    for(;;) {
-        do {
-            assert(k < count);
-            codes[k++] = code++;
-        } while (huffsize[k] == sz);
-        if (huffsize[k] == 0) {
-            return codes;
-        }
-        do {
-            code = (uint16_t)(code << 1);
-            ++sz;
-        } while( huffsize[k] != sz );
-    }
-}
+// Nonzero mask of a block: bit 63 - k is set iff du[k] != 0, so the leading
+// zeros of the mask give the next nonzero coefficient in zig-zag order
+#define TJEI_MASK_BIT(k) ((uint64_t)1 << (63 - (k)))
 
-static void tjei_huff_get_extended(uint8_t* out_ehuffsize,
-                                   uint16_t* out_ehuffcode,
-                                   uint8_t const * huffval,
-                                   uint8_t* huffsize,
-                                   uint16_t* huffcode, int64_t count)
+// Leading zeros of a nonzero mask: two CLZ on Cortex-M3
+#if defined(__GNUC__) || defined(__clang__)
+#define tjei_clz64(m) ((int)__builtin_clzll(m))
+#else
+static int tjei_clz64(uint64_t m)
 {
-    int k = 0;
-    do {
-        uint8_t val = huffval[k];
-        out_ehuffcode[val] = huffcode[k];
-        out_ehuffsize[val] = huffsize[k];
-        k++;
-    } while ( k < count );
+    int n = 0;
+    while ( !(m & TJEI_MASK_BIT(0)) ) {
+        m <<= 1;
+        ++n;
+    }
+    return n;
 }
-// ============================================================
+#endif
 
 // Returns:
 //  out[1] : number of bits
 //  out[0] : bits
+// value must not be 0 (its category has no bits)
 TJEI_FORCE_INLINE void tjei_calculate_variable_length_int(int value, uint16_t out[2])
 {
     int abs_val = value;
@@ -589,16 +1038,47 @@ TJEI_FORCE_INLINE void tjei_calculate_variable_length_int(int value, uint16_t ou
         abs_val = -abs_val;
         --value;
     }
-    out[1] = 1;
-    while( abs_val >>= 1 ) {
-        ++out[1];
-    }
+    out[1] = tjei_bit_length(abs_val);
     out[0] = (uint16_t)(value & ((1 << out[1]) - 1));
 }
 
+// Four bytes of entropy coded data, MSB first. Every 0xFF byte is followed
+// by a stuffed zero so it doesn't read as a marker (F.1.2.3). The test for
+// one covers the whole word: a byte is 0xFF iff it is 0 in ~word. One bounds
+// check for up to 8 bytes, written in place; the last few bytes before the
+// end of a chunk go through tjei_write
+TJEI_FORCE_INLINE void tjei_put_word(TJEState* state, uint32_t word)
+{
+    TJEWriteContext* wc = &state->write_context;
+    if ( wc->end - wc->ptr < 8 ) {
+        for ( int shift = 24; shift >= 0; shift -= 8 ) {
+            uint8_t c[2] = { (uint8_t)(word >> shift), 0 };
+            tjei_write(state, c, (c[0] == 0xff) ? 2 : 1, 1);
+        }
+        return;
+    }
+    uint8_t* out = wc->ptr;
+
+    if ( ((~word - 0x01010101u) & word & 0x80808080u) == 0 ) {
+        out[0] = (uint8_t)(word >> 24);
+        out[1] = (uint8_t)(word >> 16);
+        out[2] = (uint8_t)(word >> 8);
+        out[3] = (uint8_t)word;
+        wc->ptr = out + 4;
+        return;
+    }
+    for ( int shift = 24; shift >= 0; shift -= 8 ) {
+        uint8_t c = (uint8_t)(word >> shift);
+        *out++ = c;
+        if ( c == 0xff ) {
+            *out++ = 0;
+        }
+    }
+    wc->ptr = out;
+}
+
 // Write bits to file.
 TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state,
-                                       uint32_t* bitbuffer, uint32_t* location,
                                        uint16_t num_bits, uint16_t bits)
 {
     //   v-- location
@@ -606,27 +1086,44 @@ TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state,
     // 32                     0
     //
     // This call pushes to the bitbuffer and saves the location. Data is pushed
-    // from most significant to less significant.
-    // When we can write a full byte, we write a byte and shift.
-
-    // Push the stack.
-    uint32_t nloc = *location + num_bits;
-    *bitbuffer |= (uint32_t)(bits << (32 - nloc));
-    *location = nloc;
-    while ( *location >= 8 ) {
-        // Grab the most significant byte.
-        uint8_t c = (uint8_t)((*bitbuffer) >> 24);
-        // Write it to file.
-        tjei_write(state, &c, 1, 1);
-        if ( c == 0xff )  {
-            // Special case: tell JPEG this is not a marker.
-            char z = 0;
-            tjei_write(state, &z, 1, 1);
-        }
-        // Pop the stack.
-        *bitbuffer <<= 8;
-        *location -= 8;
+    // from most significant to less significant. The buffer is written out a
+    // word at a time, when it is full: up to 31 bits wait in it between calls.
+    // num_bits <= 16, bits above num_bits must be 0.
+    uint32_t free_bits = 32 - state->location;
+    if ( num_bits < free_bits ) {
+        state->bitbuffer |= (uint32_t)bits << (free_bits - num_bits);
+        state->location += num_bits;
+        return;
+    }
+
+    // The top free_bits of bits complete the word
+    uint32_t rest = num_bits - free_bits;
+    tjei_put_word(state, state->bitbuffer | ((uint32_t)bits >> rest));
+    state->bitbuffer = rest ? (uint32_t)bits << (32 - rest) : 0;
+    state->location  = rest;
+}
+
+// Writes the whole bytes waiting in the bit buffer, leaves location < 8
+static void tjei_flush_bits(TJEState* state)
+{
+    while ( state->location >= 8 ) {
+        // 0xFF is followed by a zero: tell JPEG this is not a marker.
+        uint8_t c[2] = { (uint8_t)(state->bitbuffer >> 24), 0 };
+        tjei_write(state, c, (c[0] == 0xff) ? 2 : 1, 1);
+        state->bitbuffer <<= 8;
+        state->location -= 8;
+    }
+}
+
+// End of an entropy coded segment: pads the last byte with ones or zeros and
+// writes every bit, so a marker can follow
+static void tjei_byte_align(TJEState* state, int fill_ones)
+{
+    uint16_t pad = (uint16_t)((8 - (state->location & 7)) & 7);
+    if ( pad ) {
+        tjei_write_bits(state, pad, fill_ones ? (uint16_t)((1u << pad) - 1) : 0);
     }
+    tjei_flush_bits(state);
 }
 
 // DCT implementation by Thomas G. Lane.
@@ -640,7 +1137,24 @@ TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state,
 //  JPEG textbook (see REFERENCES section in file README).  The following code
 //  is based directly on figure 4-8 in P&M.
 //
-static void tjei_fdct (float * data)
+// Quantization is folded into the last stage of the column pass: each output
+// is scaled by its AAN reciprocal and rounded straight into du (zig-zag
+// order), building the nonzero mask of the block. data is overwritten.
+
+// Quantized coefficient i (natural order) of the block
+TJEI_FORCE_INLINE void tjei_quantize_coef(float value, float const * qt, int i, int* du, uint64_t* mask)
+{
+    value *= qt[i];
+    value = floorf(value + 1024 + 0.5f);
+    value -= 1024;
+    int val = (int)value;
+    du[tjei_zig_zag[i]] = val;
+    if ( val ) {
+        *mask |= TJEI_MASK_BIT(tjei_zig_zag[i]);
+    }
+}
+
+static uint64_t tjei_fdct (float * data, float const * qt, int* du)
 {
     float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
     float tmp10, tmp11, tmp12, tmp13;
@@ -700,8 +1214,9 @@ static void tjei_fdct (float * data)
 
     /* Pass 2: process columns. */
 
+    uint64_t mask = 0;
     dataptr = data;
-    for ( ctr = 8-1; ctr >= 0; ctr-- ) {
+    for ( ctr = 0; ctr < 8; ctr++ ) {
         tmp0 = dataptr[8*0] + dataptr[8*7];
         tmp7 = dataptr[8*0] - dataptr[8*7];
         tmp1 = dataptr[8*1] + dataptr[8*6];
@@ -718,12 +1233,12 @@ static void tjei_fdct (float * data)
         tmp11 = tmp1 + tmp2;
         tmp12 = tmp1 - tmp2;
 
-        dataptr[8*0] = tmp10 + tmp11; /* phase 3 */
-        dataptr[8*4] = tmp10 - tmp11;
+        tjei_quantize_coef(tmp10 + tmp11, qt, 8*0 + ctr, du, &mask); /* phase 3 */
+        tjei_quantize_coef(tmp10 - tmp11, qt, 8*4 + ctr, du, &mask);
 
         z1 = (tmp12 + tmp13) * ((float) 0.707106781); /* c4 */
-        dataptr[8*2] = tmp13 + z1; /* phase 5 */
-        dataptr[8*6] = tmp13 - z1;
+        tjei_quantize_coef(tmp13 + z1, qt, 8*2 + ctr, du, &mask); /* phase 5 */
+        tjei_quantize_coef(tmp13 - z1, qt, 8*6 + ctr, du, &mask);
 
         /* Odd part */
 
@@ -740,13 +1255,14 @@ static void tjei_fdct (float * data)
         z11 = tmp7 + z3;        /* phase 5 */
         z13 = tmp7 - z3;
 
-        dataptr[8*5] = z13 + z2; /* phase 6 */
-        dataptr[8*3] = z13 - z2;
-        dataptr[8*1] = z11 + z4;
-        dataptr[8*7] = z11 - z4;
+        tjei_quantize_coef(z13 + z2, qt, 8*5 + ctr, du, &mask); /* phase 6 */
+        tjei_quantize_coef(z13 - z2, qt, 8*3 + ctr, du, &mask);
+        tjei_quantize_coef(z11 + z4, qt, 8*1 + ctr, du, &mask);
+        tjei_quantize_coef(z11 - z4, qt, 8*7 + ctr, du, &mask);
 
         dataptr++;          /* advance pointer to next column */
     }
+    return mask;
 }
 #if !TJE_USE_FAST_DCT
 static float slow_fdct(int u, int v, float* data)
@@ -770,39 +1286,22 @@ static float slow_fdct(int u, int v, float* data)
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
-static void tjei_encode_and_write_MCU(TJEState* state,
-                                      float* mcu,
+// DCT and quantization of one block, du in zig-zag order. Returns the
+// nonzero mask of du. mcu is overwritten
+static uint64_t tjei_quantize_MCU(float* mcu,
 #if TJE_USE_FAST_DCT
-                                      float* qt,  // Pre-processed quantization matrix.
+                              float const * qt,  // Pre-processed quantization matrix.
 #else
-                                      uint8_t* qt,
+                              uint8_t const * qt,
 #endif
-                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
-                                      int* pred,  // Previous DC coefficient
-                                      uint32_t* bitbuffer,  // Bitstack.
-                                      uint32_t* location)
+                              int* du)
 {
-    int du[64];  // Data unit in zig-zag order
-
-    float dct_mcu[64];
-    memcpy(dct_mcu, mcu, 64 * sizeof(float));
-
 #if TJE_USE_FAST_DCT
-    tjei_fdct(dct_mcu);
-    for ( int i = 0; i < 64; ++i ) {
-        float fval = dct_mcu[i];
-        fval *= qt[i];
-#if 0
-        fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
-#else
-        fval = floorf(fval + 1024 + 0.5f);
-        fval -= 1024;
-#endif
-        int val = (int)fval;
-        du[tjei_zig_zag[i]] = val;
-    }
+    return tjei_fdct(mcu, qt, du);
 #else
+    float dct_mcu[64];
+    uint64_t mask = 0;
+
     for ( int v = 0; v < 8; ++v ) {
         for ( int u = 0; u < 8; ++u ) {
             dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
@@ -812,9 +1311,21 @@ static void tjei_encode_and_write_MCU(TJEState* state,
         float fval = dct_mcu[i] / (qt[i]);
         int val = (int)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
         du[tjei_zig_zag[i]] = val;
+        if ( val ) {
+            mask |= TJEI_MASK_BIT(tjei_zig_zag[i]);
+        }
     }
+    return mask;
 #endif
+}
 
+static void tjei_write_MCU(TJEState* state,
+                           int const * du,  // Data unit in zig-zag order
+                           uint64_t mask,   // Nonzero mask of du
+                           uint8_t const * huff_dc_len, uint16_t const * huff_dc_code, // Huffman tables
+                           uint8_t const * huff_ac_len, uint16_t const * huff_ac_code,
+                           int* pred)  // Previous DC coefficient
+{
     uint16_t vli[2];
 
     // Encode DC coefficient.
@@ -823,35 +1334,28 @@ static void tjei_encode_and_write_MCU(TJEState* state,
     if ( diff != 0 ) {
         tjei_calculate_variable_length_int(diff, vli);
         // Write number of bits with Huffman coding
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
+        tjei_write_bits(state, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
         // Write the bits.
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
+        tjei_write_bits(state, vli[1], vli[0]);
     } else {
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[0], huff_dc_code[0]);
+        tjei_write_bits(state, huff_dc_len[0], huff_dc_code[0]);
     }
 
     // ==== Encode AC coefficients ====
 
+    // Straight from one nonzero coefficient to the next, zeros are never read
+    uint64_t ac = mask & ~TJEI_MASK_BIT(0);
     int last_non_zero_i = 0;
-    // Find the last non-zero element.
-    for ( int i = 63; i > 0; --i ) {
-        if (du[i] != 0) {
-            last_non_zero_i = i;
-            break;
-        }
-    }
-
-    for ( int i = 1; i <= last_non_zero_i; ++i ) {
-        // If zero, increase count. If >=15, encode (FF,00)
-        int zero_count = 0;
-        while ( du[i] == 0 ) {
-            ++zero_count;
-            ++i;
-            if (zero_count == 16) {
-                // encode (ff,00) == 0xf0
-                tjei_write_bits(state, bitbuffer, location, huff_ac_len[0xf0], huff_ac_code[0xf0]);
-                zero_count = 0;
-            }
+    while ( ac ) {
+        int i = tjei_clz64(ac);
+        ac &= ~TJEI_MASK_BIT(i);
+
+        // Runs of 16 zeros or more: encode (F,0) for each 16
+        int zero_count = i - last_non_zero_i - 1;
+        last_non_zero_i = i;
+        while ( zero_count >= 16 ) {
+            tjei_write_bits(state, huff_ac_len[0xf0], huff_ac_code[0xf0]);
+            zero_count -= 16;
         }
         tjei_calculate_variable_length_int(du[i], vli);
 
@@ -863,117 +1367,422 @@ static void tjei_encode_and_write_MCU(TJEState* state,
         assert(huff_ac_len[sym1] != 0);
 
         // Write symbol 1  --- (RUNLENGTH, SIZE)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
+        tjei_write_bits(state, huff_ac_len[sym1], huff_ac_code[sym1]);
         // Write symbol 2  --- (AMPLITUDE)
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
+        tjei_write_bits(state, vli[1], vli[0]);
     }
 
     if (last_non_zero_i != 63) {
         // write EOB HUFF(00,00)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
+        tjei_write_bits(state, huff_ac_len[0], huff_ac_code[0]);
     }
     return;
 }
 
-enum {
-    TJEI_LUMA_DC,
-    TJEI_LUMA_AC,
-    TJEI_CHROMA_DC,
-    TJEI_CHROMA_AC,
-};
-
-#if TJE_USE_FAST_DCT
-struct TJEProcessedQT
+// Symbol cache of the optimized Huffman mode: the symbol, followed by its
+// amplitude bits (MSB first) when the symbol has a size (low nibble)
+TJEI_FORCE_INLINE void tjei_cache_symbol(TJEState* state, uint8_t symbol, uint16_t bits)
 {
-    float chroma[64];
-    float luma[64];
-};
-#endif
+    if ( !state->cache_valid ) {
+        return;
+    }
+    if ( state->cache_end - state->cache_ptr < 3 ) {
+        state->cache_valid = 0;     // pass 2 runs the DCT again
+        return;
+    }
+    *state->cache_ptr++ = symbol;
+    if ( symbol & 0x0f ) {
+        *state->cache_ptr++ = (uint8_t)(bits >> 8);
+        *state->cache_ptr++ = (uint8_t)bits;
+    }
+}
 
-// Set up huffman tables in state.
-static void tjei_huff_expand(TJEState* state)
+// Pass 1 of the optimized Huffman mode: same symbols as tjei_write_MCU,
+// counted instead of written
+static void tjei_gather_MCU(TJEState* state,
+                            int const * du,
+                            uint64_t mask,
+                            uint32_t* freq_dc, uint32_t* freq_ac,
+                            int* pred)
 {
-    assert(state);
-
-    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
-    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
-    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
-    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
-
-    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
-    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
-    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
-    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+    uint16_t vli[2] = { 0, 0 };
 
-    // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
-    int32_t spec_tables_len[4] = { 0 };
+    int diff = du[0] - *pred;
+    *pred = du[0];
+    if ( diff != 0 ) {
+        tjei_calculate_variable_length_int(diff, vli);
+    }
+    freq_dc[vli[1]]++;
+    tjei_cache_symbol(state, (uint8_t)vli[1], vli[0]);
 
-    for ( int i = 0; i < 4; ++i ) {
-        for ( int k = 0; k < 16; ++k ) {
-            spec_tables_len[i] += state->ht_bits[i][k];
+    uint64_t ac = mask & ~TJEI_MASK_BIT(0);
+    int last_non_zero_i = 0;
+    while ( ac ) {
+        int i = tjei_clz64(ac);
+        ac &= ~TJEI_MASK_BIT(i);
+
+        int zero_count = i - last_non_zero_i - 1;
+        last_non_zero_i = i;
+        while ( zero_count >= 16 ) {
+            freq_ac[0xf0]++;
+            tjei_cache_symbol(state, 0xf0, 0);
+            zero_count -= 16;
         }
+        tjei_calculate_variable_length_int(du[i], vli);
+        uint8_t sym1 = (uint8_t)((zero_count << 4) | vli[1]);
+        freq_ac[sym1]++;
+        tjei_cache_symbol(state, sym1, vli[0]);
     }
 
-    // Fill out the extended tables..
-    uint8_t huffsize[4][257];
-    uint16_t huffcode[4][256];
-    for ( int i = 0; i < 4; ++i ) {
-        assert (256 >= spec_tables_len[i]);
-        tjei_huff_get_code_lengths(huffsize[i], state->ht_bits[i]);
-        tjei_huff_get_codes(huffcode[i], huffsize[i], spec_tables_len[i]);
-    }
-    for ( int i = 0; i < 4; ++i ) {
-        int64_t count = spec_tables_len[i];
-        tjei_huff_get_extended(state->ehuffsize[i],
-                               state->ehuffcode[i],
-                               state->ht_vals[i],
-                               &huffsize[i][0],
-                               &huffcode[i][0], count);
+    if (last_non_zero_i != 63) {
+        freq_ac[0]++;
+        tjei_cache_symbol(state, 0x00, 0);
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
-                            const int width,
-                            const int height,
-                            const int src_num_components)
+// Pass 2 from the cache: one block, written with the optimized tables
+static void tjei_replay_MCU(TJEState* state, int dc, int ac)
 {
-    if (src_num_components != 3 && src_num_components != 4) {
-        return 0;
+    const uint8_t* c = state->cache_ptr;
+
+    uint8_t s = *c++;
+    tjei_write_bits(state, state->ehuffsize[dc][s], state->ehuffcode[dc][s]);
+    if ( s ) {
+        tjei_write_bits(state, s, (uint16_t)((c[0] << 8) | c[1]));
+        c += 2;
     }
 
-    if (width > 0xffff || height > 0xffff) {
-        return 0;
+    for ( int k = 1; k < 64; ) {
+        uint8_t rs = *c++;
+        tjei_write_bits(state, state->ehuffsize[ac][rs], state->ehuffcode[ac][rs]);
+        if ( rs == 0x00 ) {         // EOB
+            break;
+        }
+        if ( rs == 0xf0 ) {         // ZRL
+            k += 16;
+            continue;
+        }
+        tjei_write_bits(state, rs & 0x0f, (uint16_t)((c[0] << 8) | c[1]));
+        c += 2;
+        k += (rs >> 4) + 1;
     }
 
-#if TJE_USE_FAST_DCT
-    struct TJEProcessedQT pqt;
-    // Again, taken from classic japanese implementation.
-    //
-    /* For float AA&N IDCT method, divisors are equal to quantization
-     * coefficients scaled by scalefactor[row]*scalefactor[col], where
-     *   scalefactor[0] = 1
-     *   scalefactor[k] = cos(k*PI/16) * sqrt(2)    for k=1..7
-     * We apply a further scale factor of 8.
-     * What's actually stored is 1/divisor so that the inner loop can
-     * use a multiplication rather than a division.
-     */
-    static const float aan_scales[] = {
-        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
-        1.0f, 0.785694958f, 0.541196100f, 0.275899379f
-    };
+    state->cache_ptr = (uint8_t*)c;
+}
 
-    // build (de)quantization tables
-    for(int y=0; y<8; y++) {
-        for(int x=0; x<8; x++) {
-            int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
+// Flat blocks. The DCT is orthonormal, so the AC coefficients of a block
+// share its energy around the mean, E / 64 with E = 64 * sum(p^2) - sum(p)^2.
+// Below (q / 2)^2, q the smallest AC step of the table, every AC coefficient
+// quantizes to zero and the block is its DC alone: no DCT is needed. The
+// limit keeps a margin (15 q^2 instead of 16 q^2) for the rounding of the
+// float DCT, so the shortcut never changes the output.
+static void tjei_set_flat_limits(TJEState* state)
+{
+    uint32_t q_luma = 255;
+    uint32_t q_chroma = 255;
+    for ( int i = 1; i < 64; ++i ) {
+        if ( state->qt_luma[i] < q_luma ) {
+            q_luma = state->qt_luma[i];
+        }
+        if ( state->qt_chroma[i] < q_chroma ) {
+            q_chroma = state->qt_chroma[i];
         }
     }
+    state->flat_luma   = 15 * q_luma * q_luma;
+    state->flat_chroma = 15 * q_chroma * q_chroma;
+}
+
+static void tjei_encode_and_write_MCU(TJEState* state,
+                                      float* mcu,
+#if TJE_USE_FAST_DCT
+                                      float const * qt,  // Pre-processed quantization matrix.
+#else
+                                      uint8_t const * qt,
 #endif
+                                      int dc, int ac,    // Huffman tables
+                                      int sum,           // Sum of the samples of mcu
+                                      uint32_t energy,   // E of the samples, see above
+                                      int* pred)  // Previous DC coefficient
+{
+    int du[64];  // Data unit in zig-zag order, only du[0] and the nonzero ones are set
+    uint64_t mask;
 
-    { // Write header
+#if TJE_USE_FAST_DCT
+    if ( energy < ((dc == TJEI_LUMA_DC) ? state->flat_luma : state->flat_chroma) ) {
+        // DC only: the DC output of the DCT is the sum of the samples
+        mask = 0;
+        tjei_quantize_coef((float)sum, qt, 0, du, &mask);
+        state->flat_blocks++;
+    } else
+#endif
+    {
+        mask = tjei_quantize_MCU(mcu, qt, du);
+    }
+    if ( state->pass == TJEI_PASS_GATHER ) {
+        tjei_gather_MCU(state, du, mask, state->huff_work->freq[dc], state->huff_work->freq[ac], pred);
+    } else {
+        tjei_write_MCU(state, du, mask,
+                       state->ehuffsize[dc], state->ehuffcode[dc],
+                       state->ehuffsize[ac], state->ehuffcode[ac],
+                       pred);
+    }
+}
+
+// Restart interval bookkeeping, before every MCU of a baseline scan. Closes
+// the running interval with RSTn (bits padded with ones, as at the end of a
+// scan) and records the file offset of the next one.
+static void tjei_restart_MCU(TJEState* state)
+{
+    if ( !state->restart_interval ) {
+        return;
+    }
+    if ( state->restart_mcus == 0 ) {
+        if ( state->restart_count > 0 ) {
+            tjei_byte_align(state, 1);
+            uint16_t RST = tjei_be_word((uint16_t)(0xffd0 + state->restart_marker));
+            tjei_write(state, &RST, sizeof(uint16_t), 1);
+            state->restart_marker = (state->restart_marker + 1) & 7;
+
+            state->pred_y = 0;
+            state->pred_b = 0;
+            state->pred_r = 0;
+            state->bitbuffer = 0;
+            state->location = 0;
+        }
+        if ( state->restart_count < state->restart_max ) {
+            state->restart_offsets[state->restart_count] = tjei_file_offset(state);
+        }
+        state->restart_count++;
+        state->restart_mcus = state->restart_interval;
+    }
+    state->restart_mcus--;
+}
+
+// Thumbnail pixel of the MCU at block (bx, by): the average of each
+// component. Pixel pairs share the average of their chroma, as in the source.
+// Grayscale images get neutral chroma
+static void tjei_thumbnail_MCU(TJEState* state,
+                               float const * du_y, float const * du_b, float const * du_r,
+                               const int bx, const int by, const int width)
+{
+    float sum_y = 0, sum_b = 0, sum_r = 0;
+    for ( int i = 0; i < 64; ++i ) {
+        sum_y += du_y[i];
+    }
+    if ( state->num_components == 3 ) {
+        for ( int i = 0; i < 64; ++i ) {
+            sum_b += du_b[i];
+            sum_r += du_r[i];
+        }
+    }
+    // Samples are level shifted to [-128, 127], so the averages stay in range
+    uint8_t Y  = (uint8_t)(sum_y / 64.0f + 128.5f);
+    uint8_t Cb = (uint8_t)(sum_b / 64.0f + 128.5f);
+    uint8_t Cr = (uint8_t)(sum_r / 64.0f + 128.5f);
+
+    uint8_t* pair = state->thumbnail + (by * TJE_THUMB_WIDTH(width) + (bx & ~1)) * 2;
+    if ( (bx & 1) == 0 ) {
+        pair[0] = Y;
+        pair[1] = Cb;
+        pair[2] = Y;    // overwritten by the odd block, if the image has one
+        pair[3] = Cr;
+    } else {
+        pair[2] = Y;
+        pair[1] = (uint8_t)((pair[1] + Cb + 1) / 2);
+        pair[3] = (uint8_t)((pair[3] + Cr + 1) / 2);
+    }
+}
+
+// 2x2 averages of the MCU at (x, y) into the half resolution strip: a 4x4
+// patch, lines 0-3 for an even row of MCUs, 4-7 for an odd one. sum_y holds
+// the sums of 2x2 pixels, sum_b and sum_r of the 4x2 pixels of each pair
+static void tjei_half_MCU(TJEState* state,
+                          uint16_t const * sum_y, uint16_t const * sum_b, uint16_t const * sum_r,
+                          const int x, const int y)
+{
+    // Half pixel x / 2, 2 bytes a pixel
+    uint8_t* line = state->half_strip + (uint32_t)(((y / 8) & 1) * 4) * state->half_pitch + x;
+    for ( int l = 0; l < 4; ++l ) {
+        for ( int pair = 0; pair < 2; ++pair ) {
+            uint8_t* out = line + pair * 4;
+            out[0] = (uint8_t)((sum_y[l * 4 + pair * 2] + 2) >> 2);
+            out[1] = (uint8_t)((sum_b[l * 2 + pair] + 4) >> 3);
+            out[2] = (uint8_t)((sum_y[l * 4 + pair * 2 + 1] + 2) >> 2);
+            out[3] = (uint8_t)((sum_r[l * 2 + pair] + 4) >> 3);
+        }
+        line += state->half_pitch;
+    }
+}
+
+// DCT, quantization and Huffman coding of the MCUs of lines [y_begin, y_end)
+static void tjei_encode_rows(TJEState* state,
+                             const unsigned char* src_data,
+                             const int width,
+                             const int height,
+                             const int y_begin,
+                             const int y_end)
+{
+    float du_y[64];
+    float du_b[64];
+    float du_r[64];
+
+    const int mcu_step = 8 * (int)state->sample_step;
+    for ( int y = y_begin; y < y_end; y += mcu_step ) {
+        for ( int x = 0; x < width; x += mcu_step ) {
+            tjei_restart_MCU(state);
+
+            // Sums and sums of squares of the samples, for the flat test
+            int      sum_y = 0, sum_b = 0, sum_r = 0;
+            uint32_t sq_y = 0, sq_b = 0, sq_r = 0;
+
+            // 2x2 sums for the half resolution image
+            uint16_t half_y[16], half_b[8], half_r[8];
+            if ( state->half_strip ) {
+                memset(half_y, 0, sizeof(half_y));
+                memset(half_b, 0, sizeof(half_b));
+                memset(half_r, 0, sizeof(half_r));
+            }
+
+            // Fill MCU from YUV422 data
+            for ( int off_y = 0; off_y < 8; ++off_y ) {
+                for ( int off_x = 0; off_x < 8; ++off_x ) {
+                    int block_index = (off_y * 8 + off_x);
+                    int col = x + off_x;
+                    int row = y + off_y;
+
+                    // Handle boundaries
+                    if(row >= height) {
+                        row = height - 1;
+                    }
+                    if(col >= width) {
+                        col = width - 1;
+                    }
+
+                    // YUV422 format: [Y0, Cb, Y1, Cr] for every 2 pixels
+                    // Each row: width * 2 bytes
+                    int yuv_row_offset = row * width * 2;
+                    int yuv_col_pair = (col / 2) * 4;  // Each pair takes 4 bytes
+                    int yuv_index = yuv_row_offset + yuv_col_pair;
+
+                    // Even column: Y0, odd column: Y1. Both share Cb and Cr.
+                    // JPEG expects Y in [-128, 127], Cb/Cr in [-128, 127]
+                    int py = src_data[yuv_index + ((col % 2 == 0) ? 0 : 2)];
+                    int pb = 128;
+                    int pr = 128;
+                    du_y[block_index] = (float)py - 128.0f;
+                    sum_y += py;
+                    sq_y  += (uint32_t)(py * py);
+                    if ( state->num_components == 3 ) {
+                        pb = src_data[yuv_index + 1];
+                        pr = src_data[yuv_index + 3];
+                        du_b[block_index] = (float)pb - 128.0f;
+                        du_r[block_index] = (float)pr - 128.0f;
+                        sum_b += pb;
+                        sum_r += pr;
+                        sq_b  += (uint32_t)(pb * pb);
+                        sq_r  += (uint32_t)(pr * pr);
+                    }
+                    if ( state->half_strip ) {
+                        half_y[(off_y / 2) * 4 + off_x / 2] += (uint16_t)py;
+                        half_b[(off_y / 2) * 2 + off_x / 4] += (uint16_t)pb;
+                        half_r[(off_y / 2) * 2 + off_x / 4] += (uint16_t)pr;
+                    }
+                }
+            }
+
+            if ( state->thumbnail ) {
+                tjei_thumbnail_MCU(state, du_y, du_b, du_r, x / 8, y / 8, width);
+            }
+            if ( state->half_strip ) {
+                tjei_half_MCU(state, half_y, half_b, half_r, x, y);
+            }
+
+            tjei_encode_and_write_MCU(state, du_y,
+#if TJE_USE_FAST_DCT
+                                     state->pqt_luma,
+#else
+                                     state->qt_luma,
+#endif
+                                     TJEI_LUMA_DC, TJEI_LUMA_AC,
+                                     sum_y - 64 * 128, 64 * sq_y - (uint32_t)(sum_y * sum_y),
+                                     &state->pred_y);
+            if ( state->num_components == 1 ) {
+                continue;
+            }
+            tjei_encode_and_write_MCU(state, du_b,
+#if TJE_USE_FAST_DCT
+                                     state->pqt_chroma,
+#else
+                                     state->qt_chroma,
+#endif
+                                     TJEI_CHROMA_DC, TJEI_CHROMA_AC,
+                                     sum_b - 64 * 128, 64 * sq_b - (uint32_t)(sum_b * sum_b),
+                                     &state->pred_b);
+            tjei_encode_and_write_MCU(state, du_r,
+#if TJE_USE_FAST_DCT
+                                     state->pqt_chroma,
+#else
+                                     state->qt_chroma,
+#endif
+                                     TJEI_CHROMA_DC, TJEI_CHROMA_AC,
+                                     sum_r - 64 * 128, 64 * sq_r - (uint32_t)(sum_r * sum_r),
+                                     &state->pred_r);
+
+
+        }
+    }
+}
+
+// Entropy coded segment: every MCU of the image
+static void tjei_encode_scan(TJEState* state,
+                             const unsigned char* src_data,
+                             const int width,
+                             const int height)
+{
+    // Set diff to 0.
+    state->pred_y = 0;
+    state->pred_b = 0;
+    state->pred_r = 0;
+
+    // Bit stack
+    state->bitbuffer = 0;
+    state->location = 0;
+
+    state->restart_mcus = 0;
+    state->restart_marker = 0;
+    state->restart_count = 0;
+
+    tjei_encode_rows(state, src_data, width, height, 0, height);
+}
+
+// Entropy coded segment of pass 2, from the symbols cached by pass 1
+static void tjei_replay_scan(TJEState* state, const int width, const int height)
+{
+    state->pred_y = 0;
+    state->pred_b = 0;
+    state->pred_r = 0;
+    state->bitbuffer = 0;
+    state->location = 0;
+
+    state->restart_mcus = 0;
+    state->restart_marker = 0;
+    state->restart_count = 0;
+
+    const int num_mcus = ((width + 7) / 8) * ((height + 7) / 8);
+    for ( int i = 0; i < num_mcus; ++i ) {
+        tjei_restart_MCU(state);
+        tjei_replay_MCU(state, TJEI_LUMA_DC, TJEI_LUMA_AC);
+        if ( state->num_components == 3 ) {
+            tjei_replay_MCU(state, TJEI_CHROMA_DC, TJEI_CHROMA_AC);
+            tjei_replay_MCU(state, TJEI_CHROMA_DC, TJEI_CHROMA_AC);
+        }
+    }
+}
+
+// SOI, JFIF, comment, quantization tables and frame header (SOF0 or SOF2)
+static void tjei_write_frame_header(TJEState* state, uint16_t sof, const int width, const int height)
+{
+    { // Write header
         TJEJPEGHeader header;
         // JFIF header.
         header.SOI = tjei_be_word(0xffd8);  // Sequential DCT
@@ -1002,18 +1811,20 @@ static int tjei_encode_main(TJEState* state,
 
     // Write quantization tables.
     tjei_write_DQT(state, state->qt_luma, 0x00);
-    tjei_write_DQT(state, state->qt_chroma, 0x01);
+    if ( state->num_components == 3 ) {
+        tjei_write_DQT(state, state->qt_chroma, 0x01);
+    }
 
     {  // Write the frame marker.
         TJEFrameHeader header;
-        header.SOF = tjei_be_word(0xffc0);
-        header.len = tjei_be_word(8 + 3 * 3);
+        header.SOF = tjei_be_word(sof);
+        header.len = tjei_be_word((uint16_t)(8 + 3 * state->num_components));
         header.precision = 8;
         assert(width <= 0xffff);
         assert(height <= 0xffff);
         header.width = tjei_be_word((uint16_t)width);
         header.height = tjei_be_word((uint16_t)height);
-        header.num_components = 3;
+        header.num_components = (uint8_t)state->num_components;
         uint8_t tables[3] = {
             0,  // Luma component gets luma table (see tjei_write_DQT call above.)
             1,  // Chroma component gets chroma table
@@ -1027,28 +1838,43 @@ static int tjei_encode_main(TJEState* state,
 
             header.component_spec[i] = spec;
         }
-        // Write to file.
-        tjei_write(state, &header, sizeof(TJEFrameHeader), 1);
+        // Write to file, without the specs of missing components.
+        tjei_write(state, &header,
+                   sizeof(TJEFrameHeader) - sizeof(TJEComponentSpec) * (uint32_t)(3 - state->num_components), 1);
+    }
+}
+
+// Everything of a baseline file before the entropy coded data
+static void tjei_write_baseline_headers(TJEState* state, const int width, const int height)
+{
+    tjei_write_frame_header(state, 0xffc0, width, height);  // Baseline DCT
+
+    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC],   TJEI_DC, 0);
+    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC],   TJEI_AC, 0);
+    if ( state->num_components == 3 ) {
+        tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
+        tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
     }
 
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+    if (state->restart_interval) {
+        uint8_t DRI[6] = { 0xff, 0xdd, 0x00, 0x04,
+                           (uint8_t)(state->restart_interval >> 8), (uint8_t)state->restart_interval };
+        tjei_write(state, DRI, sizeof(DRI), 1);
+    }
 
     // Write start of scan
     {
         TJEScanHeader header;
         header.SOS = tjei_be_word(0xffda);
-        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
-        header.num_components = 3;
+        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * state->num_components)));
+        header.num_components = (uint8_t)state->num_components;
 
         uint8_t tables[3] = {
             0x00,
             0x11,
             0x11,
         };
-        for (int i = 0; i < 3; ++i) {
+        for (int i = 0; i < state->num_components; ++i) {
             TJEFrameComponentSpec cs;
             // Must be equal to component_id from frame header above.
             cs.component_id = (uint8_t)(i + 1);
@@ -1059,129 +1885,741 @@ static int tjei_encode_main(TJEState* state,
         header.first = 0;
         header.last  = 63;
         header.ah_al = 0;
-        tjei_write(state, &header, sizeof(TJEScanHeader), 1);
+        // Component specs in use, then spectral selection and approximation
+        tjei_write(state, &header, 5 + sizeof(TJEFrameComponentSpec) * (uint32_t)state->num_components, 1);
+        tjei_write(state, &header.first, 3, 1);
 
     }
+    state->scan_start = tjei_file_offset(state);
+}
+
+// Last bits of the scan and EOI
+static void tjei_finish_image(TJEState* state)
+{
+    tjei_byte_align(state, 0);
+    uint16_t EOI = tjei_be_word(0xffd9);
+    tjei_write(state, &EOI, sizeof(uint16_t), 1);
+
+    tjei_flush_output(state);
+}
+
+static int tjei_encode_main(TJEState* state,
+                            const unsigned char* src_data,
+                            const int width,
+                            const int height,
+                            const int src_num_components)
+{
+    if (src_num_components != 1 && src_num_components != 3 && src_num_components != 4) {
+        return 0;
+    }
+
+    if (width > 0xffff || height > 0xffff) {
+        return 0;
+    }
+
+    tjei_write_baseline_headers(state, width, height);
+
     // Write compressed data.
+    if ( state->pass == TJEI_PASS_REPLAY ) {
+        tjei_replay_scan(state, width, height);
+    } else {
+        tjei_encode_scan(state, src_data, width, height);
+    }
 
-    float du_y[64];
-    float du_b[64];
-    float du_r[64];
+    // Finish the image.
+    tjei_finish_image(state);
 
-    // Set diff to 0.
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
+    return 1;
+}
 
-    // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
+// Optimal code lengths from the counts of pass 1, limited to 16 bits, and the
+// DHT and code tables of the result (JPEG spec K.2, as libjpeg jchuff.c).
+// Symbol 256 gets a count of 1 so no real symbol is coded with all ones.
+static void tjei_build_optimal_huffman(TJEHuffWork* work, int table)
+{
+    uint32_t* freq = work->freq[table];
+    uint16_t  bits[33];
+    uint8_t   codesize[257];
+    int16_t   others[257];
+
+    memset(bits, 0, sizeof(bits));
+    memset(codesize, 0, sizeof(codesize));
+    for ( int i = 0; i < 257; ++i ) {
+        others[i] = -1;
+    }
+    freq[256] = 1;
+
+    // Huffman tree: merge the two least frequent nodes until one is left
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        uint32_t v = 0xffffffff;
+        for ( int i = 0; i <= 256; ++i ) {
+            if ( freq[i] && freq[i] <= v ) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = 0xffffffff;
+        for ( int i = 0; i <= 256; ++i ) {
+            if ( freq[i] && freq[i] <= v && i != c1 ) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if ( c2 < 0 ) {
+            break;
+        }
 
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while ( others[c1] >= 0 ) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = (int16_t)c2;
+        codesize[c2]++;
+        while ( others[c2] >= 0 ) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
 
-    for ( int y = 0; y < height; y += 8 ) {
-        for ( int x = 0; x < width; x += 8 ) {
-            // Fill MCU from YUV422 data
-            for ( int off_y = 0; off_y < 8; ++off_y ) {
-                for ( int off_x = 0; off_x < 8; ++off_x ) {
-                    int block_index = (off_y * 8 + off_x);
-                    int col = x + off_x;
-                    int row = y + off_y;
+    // Up to 32 bits for VGA counts (< 2^20 symbols per table)
+    for ( int i = 0; i <= 256; ++i ) {
+        if ( codesize[i] ) {
+            bits[codesize[i]]++;
+        }
+    }
 
-                    // Handle boundaries
-                    if(row >= height) {
-                        row = height - 1;
-                    }
-                    if(col >= width) {
-                        col = width - 1;
-                    }
+    // Limit to 16 bits: a pair of longest codes becomes one code a bit shorter
+    // and a shorter code is split in two
+    int len = 32;
+    for ( ; len > 16; --len ) {
+        while ( bits[len] > 0 ) {
+            int j = len - 2;
+            while ( bits[j] == 0 ) {
+                --j;
+            }
+            bits[len] -= 2;
+            bits[len - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    while ( len > 0 && bits[len] == 0 ) {
+        --len;
+    }
+    if ( len > 0 ) {
+        bits[len]--;                // drops the reserved symbol, always the longest code
+    }
 
-                    // YUV422 format: [Y0, Cb, Y1, Cr] for every 2 pixels
-                    // Each row: width * 2 bytes
-                    int yuv_row_offset = row * width * 2;
-                    int yuv_col_pair = (col / 2) * 4;  // Each pair takes 4 bytes
-                    int yuv_index = yuv_row_offset + yuv_col_pair;
+    int k = 0;
+    for ( int i = 1; i <= 32; ++i ) {
+        for ( int sym = 0; sym < 256; ++sym ) {
+            if ( codesize[sym] == i ) {
+                work->vals[table][k++] = (uint8_t)sym;
+            }
+        }
+    }
 
-                    uint8_t Y, Cb, Cr;
-                    
-                    if (col % 2 == 0) {
-                        // Even column: Y0, Cb, Cr
-                        Y  = src_data[yuv_index + 0];
-                        Cb = src_data[yuv_index + 1];
-                        Cr = src_data[yuv_index + 3];
-                    } else {
-                        // Odd column: Y1, Cb, Cr (shared chroma)
-                        Y  = src_data[yuv_index + 2];
-                        Cb = src_data[yuv_index + 1];
-                        Cr = src_data[yuv_index + 3];
-                    }
+    // Canonical codes (C.2), same assignment as the DHT decoder
+    memset(work->ehuffsize[table], 0, sizeof(work->ehuffsize[table]));
+    uint16_t code = 0;
+    k = 0;
+    for ( int i = 1; i <= 16; ++i ) {
+        work->bits[table][i - 1] = (uint8_t)bits[i];
+        for ( int n = 0; n < bits[i]; ++n ) {
+            uint8_t sym = work->vals[table][k++];
+            work->ehuffsize[table][sym] = (uint8_t)i;
+            work->ehuffcode[table][sym] = code++;
+        }
+        code <<= 1;
+    }
+}
 
-                    // JPEG expects Y in [-128, 127], Cb/Cr in [-128, 127]
-                    du_y[block_index] = (float)Y - 128.0f;
-                    du_b[block_index] = (float)Cb - 128.0f;
-                    du_r[block_index] = (float)Cr - 128.0f;
-                }
+// ============================================================
+// Progressive DCT (SOF2)
+//
+// Spectral selection and successive approximation (Annex G). The quantized
+// coefficients of the whole image are needed by every scan, so pass 1 stores
+// them run-length coded in the symbol cache of the optimized Huffman mode
+// (tjei_gather_MCU) and every scan decodes them back. Each scan gets its own
+// optimal Huffman tables, built by a statistics run over the cache, as the
+// EOBn symbols are not in the default tables.
+// ============================================================
+
+#define TJEI_MAX_CORR_BITS 1000     // correction bits buffered by AC refinement
+
+typedef struct
+{
+    uint8_t comp;                   // 0-2, 3 = every component (DC scans only)
+    uint8_t ss, se;                 // spectral selection, zig-zag indexes
+    uint8_t ah, al;                 // successive approximation
+} TJEScanSpec;
+
+// Same script as libjpeg jpeg_simple_progression() for YCbCr. The DC scan
+// alone is a 1/8 scale preview of the whole image, the next two add the low
+// frequencies of Y and the color.
+static const TJEScanSpec tjei_progressive_script[] =
+{
+    { 3, 0,  0, 0, 1 },
+    { 0, 1,  5, 0, 2 },
+    { 2, 1, 63, 0, 1 },
+    { 1, 1, 63, 0, 1 },
+    { 0, 6, 63, 0, 2 },
+    { 0, 1, 63, 2, 1 },
+    { 3, 0,  0, 1, 0 },
+    { 2, 1, 63, 1, 0 },
+    { 1, 1, 63, 1, 0 },
+    { 0, 1, 63, 1, 0 },
+};
+
+typedef struct
+{
+    TJEState*    state;
+    TJEHuffWork* work;
+    int          gather;            // 1: count symbols, 0: write them
+    int          last_dc[3];        // point transformed DC of the previous block
+    uint32_t     eobrun;
+    uint32_t     be;                // correction bits pending in corr_bits
+    uint8_t      corr_bits[(TJEI_MAX_CORR_BITS + 7) / 8];
+} TJEProgState;
+
+static void tjei_prog_symbol(TJEProgState* ps, int table, uint8_t symbol)
+{
+    if ( ps->gather ) {
+        ps->work->freq[table][symbol]++;
+    } else {
+        tjei_write_bits(ps->state, ps->work->ehuffsize[table][symbol], ps->work->ehuffcode[table][symbol]);
+    }
+}
+
+static void tjei_prog_bits(TJEProgState* ps, uint32_t bits, uint16_t num_bits)
+{
+    if ( !ps->gather && num_bits ) {
+        tjei_write_bits(ps->state, num_bits, (uint16_t)(bits & ((1u << num_bits) - 1)));
+    }
+}
+
+static void tjei_prog_corr_bits(TJEProgState* ps, uint32_t first, uint32_t count)
+{
+    for ( uint32_t i = first; i < first + count; ++i ) {
+        tjei_prog_bits(ps, (ps->corr_bits[i >> 3] >> (i & 7)) & 1, 1);
+    }
+}
+
+static void tjei_prog_eobrun(TJEProgState* ps, int table)
+{
+    if ( ps->eobrun == 0 ) {
+        return;
+    }
+    uint16_t nbits = (uint16_t)(tjei_bit_length(ps->eobrun) - 1);
+    tjei_prog_symbol(ps, table, (uint8_t)(nbits << 4));
+    tjei_prog_bits(ps, ps->eobrun, nbits);
+    ps->eobrun = 0;
+
+    tjei_prog_corr_bits(ps, 0, ps->be);
+    ps->be = 0;
+}
+
+// Magnitude category of a nonzero value
+static uint16_t tjei_prog_nbits(uint32_t value)
+{
+    return tjei_bit_length(value);
+}
+
+// G.1.2.1, first DC scan. Arithmetic right shift is the point transform
+static void tjei_prog_dc_first(TJEProgState* ps, const TJEScanSpec* scan, int const * du, int comp, int table)
+{
+    int value = du[0] >> scan->al;
+    int diff = value - ps->last_dc[comp];
+    ps->last_dc[comp] = value;
+
+    uint16_t vli[2] = { 0, 0 };
+    if ( diff != 0 ) {
+        tjei_calculate_variable_length_int(diff, vli);
+    }
+    tjei_prog_symbol(ps, table, (uint8_t)vli[1]);
+    tjei_prog_bits(ps, vli[0], vli[1]);
+}
+
+// G.1.2.2, first AC scan of a band
+static void tjei_prog_ac_first(TJEProgState* ps, const TJEScanSpec* scan, int const * du, int table)
+{
+    uint32_t r = 0;
+    for ( int k = scan->ss; k <= scan->se; ++k ) {
+        int value = du[k];
+        uint32_t mag = (uint32_t)(value < 0 ? -value : value) >> scan->al;
+        if ( mag == 0 ) {
+            ++r;
+            continue;
+        }
+        tjei_prog_eobrun(ps, table);
+        while ( r > 15 ) {
+            tjei_prog_symbol(ps, table, 0xf0);
+            r -= 16;
+        }
+        uint16_t nbits = tjei_prog_nbits(mag);
+        tjei_prog_symbol(ps, table, (uint8_t)((r << 4) + nbits));
+        tjei_prog_bits(ps, value < 0 ? ~mag : mag, nbits);
+        r = 0;
+    }
+    if ( r > 0 ) {
+        if ( ++ps->eobrun == 0x7fff ) {
+            tjei_prog_eobrun(ps, table);
+        }
+    }
+}
+
+// G.1.2.3, AC refinement: one more bit of every coefficient of the band.
+// Bits of coefficients that were already nonzero are buffered and follow the
+// next symbol, as in libjpeg jcphuff.c
+static void tjei_prog_ac_refine(TJEProgState* ps, const TJEScanSpec* scan, int const * du, int table)
+{
+    uint8_t absvalues[64];
+    int eob = 0;                    // last coefficient that becomes nonzero in this scan
+    for ( int k = scan->ss; k <= scan->se; ++k ) {
+        int value = du[k];
+        uint32_t mag = (uint32_t)(value < 0 ? -value : value) >> scan->al;
+        absvalues[k] = (uint8_t)(mag > 1 ? 2 + (mag & 1) : mag);
+        if ( mag == 1 ) {
+            eob = k;
+        }
+    }
+
+    uint32_t r = 0;
+    uint32_t br_first = ps->be;     // correction bits of this block start here
+    uint32_t br = 0;
+    for ( int k = scan->ss; k <= scan->se; ++k ) {
+        uint8_t mag = absvalues[k];
+        if ( mag == 0 ) {
+            ++r;
+            continue;
+        }
+        while ( r > 15 && k <= eob ) {
+            tjei_prog_eobrun(ps, table);
+            tjei_prog_symbol(ps, table, 0xf0);
+            r -= 16;
+            tjei_prog_corr_bits(ps, br_first, br);
+            br_first = 0;
+            br = 0;
+        }
+        if ( mag > 1 ) {
+            uint32_t i = br_first + br++;
+            if ( mag & 1 ) {
+                ps->corr_bits[i >> 3] |= (uint8_t)(1u << (i & 7));
+            } else {
+                ps->corr_bits[i >> 3] &= (uint8_t)~(1u << (i & 7));
             }
+            continue;
+        }
+        tjei_prog_eobrun(ps, table);
+        tjei_prog_symbol(ps, table, (uint8_t)((r << 4) + 1));
+        tjei_prog_bits(ps, du[k] < 0 ? 0 : 1, 1);
+        tjei_prog_corr_bits(ps, br_first, br);
+        br_first = 0;
+        br = 0;
+        r = 0;
+    }
+    if ( r > 0 || br > 0 ) {
+        ++ps->eobrun;
+        ps->be += br;
+        if ( ps->eobrun == 0x7fff || ps->be > TJEI_MAX_CORR_BITS - 64 + 1 ) {
+            tjei_prog_eobrun(ps, table);
+        }
+    }
+}
 
-            tjei_encode_and_write_MCU(state, du_y,
-#if TJE_USE_FAST_DCT
-                                     pqt.luma,
-#else
-                                     state->qt_luma,
-#endif
-                                     state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
-                                     state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                     &pred_y, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_b,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_b, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_r,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_r, &bitbuffer, &location);
+// Decodes one block of the symbol cache back to quantized coefficients
+static uint8_t* tjei_uncache_MCU(uint8_t* c, int* du, int* pred)
+{
+    memset(du, 0, 64 * sizeof(int));
 
+    uint8_t s = *c++;
+    if ( s ) {
+        uint16_t bits = (uint16_t)((c[0] << 8) | c[1]);
+        *pred += (bits & (1u << (s - 1))) ? bits : (int)bits - (1 << s) + 1;
+        c += 2;
+    }
+    du[0] = *pred;
+
+    for ( int k = 1; k < 64; ) {
+        uint8_t rs = *c++;
+        if ( rs == 0x00 ) {
+            break;
+        }
+        if ( rs == 0xf0 ) {
+            k += 16;
+            continue;
+        }
+        uint8_t  size = rs & 0x0f;
+        uint16_t bits = (uint16_t)((c[0] << 8) | c[1]);
+        c += 2;
+        k += rs >> 4;
+        du[k++] = (bits & (1u << (size - 1))) ? bits : (int)bits - (1 << size) + 1;
+    }
+    return c;
+}
 
+// One run over the cached coefficients for a scan, counting or writing
+static void tjei_prog_run(TJEProgState* ps, const TJEScanSpec* scan, uint8_t* cache, const int num_mcus)
+{
+    int du[64];
+    int pred[3] = { 0, 0, 0 };
+
+    ps->last_dc[0] = ps->last_dc[1] = ps->last_dc[2] = 0;
+    ps->eobrun = 0;
+    ps->be = 0;
+
+    for ( int i = 0; i < num_mcus; ++i ) {
+        for ( int comp = 0; comp < ps->state->num_components; ++comp ) {
+            cache = tjei_uncache_MCU(cache, du, &pred[comp]);
+            if ( scan->comp != 3 && scan->comp != comp ) {
+                continue;
+            }
+            if ( scan->ss == 0 ) {
+                if ( scan->ah == 0 ) {
+                    tjei_prog_dc_first(ps, scan, du, comp, comp ? TJEI_CHROMA_DC : TJEI_LUMA_DC);
+                } else {
+                    tjei_prog_bits(ps, (uint32_t)(du[0] >> scan->al), 1);
+                }
+            } else if ( scan->ah == 0 ) {
+                tjei_prog_ac_first(ps, scan, du, comp ? TJEI_CHROMA_AC : TJEI_LUMA_AC);
+            } else {
+                tjei_prog_ac_refine(ps, scan, du, comp ? TJEI_CHROMA_AC : TJEI_LUMA_AC);
+            }
         }
     }
+    tjei_prog_eobrun(ps, scan->comp ? TJEI_CHROMA_AC : TJEI_LUMA_AC);
+}
 
-    // Finish the image.
-    { // Flush
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
+static void tjei_prog_write_SOS(TJEState* state, const TJEScanSpec* scan)
+{
+    uint8_t num_components = (scan->comp == 3) ? (uint8_t)state->num_components : 1;
+    uint8_t header[4 + 1 + 2 * 3 + 3];
+    uint32_t n = 0;
+
+    header[n++] = 0xff;
+    header[n++] = 0xda;
+    header[n++] = 0;
+    header[n++] = (uint8_t)(6 + 2 * num_components);
+    header[n++] = num_components;
+    for ( uint8_t comp = 0; comp < state->num_components; ++comp ) {
+        if ( scan->comp != 3 && scan->comp != comp ) {
+            continue;
         }
+        header[n++] = (uint8_t)(comp + 1);              // component_id of the frame header
+        header[n++] = (scan->ss == 0) ? (uint8_t)(comp ? 0x10 : 0x00) : (uint8_t)(comp ? 0x01 : 0x00);
     }
+    header[n++] = scan->ss;
+    header[n++] = scan->se;
+    header[n++] = (uint8_t)((scan->ah << 4) | scan->al);
+    tjei_write(state, header, n, 1);
+}
+
+// Writes the progressive image from the coefficients cached by pass 1
+static void tjei_encode_progressive(TJEState* state, TJEHuffWork* work, uint8_t* cache,
+                                    const int width, const int height)
+{
+    const int num_mcus = ((width + 7) / 8) * ((height + 7) / 8);
+    TJEProgState ps = { 0 };
+    ps.state = state;
+    ps.work  = work;
+
+    tjei_write_frame_header(state, 0xffc2, width, height);  // Progressive DCT
+
+    for ( uint32_t i = 0; i < sizeof(tjei_progressive_script) / sizeof(TJEScanSpec); ++i ) {
+        const TJEScanSpec* scan = &tjei_progressive_script[i];
+        if ( scan->comp != 3 && scan->comp >= state->num_components ) {
+            continue;   // chroma scan of a grayscale image
+        }
+
+        // DC refinement is raw bits, every other scan gets its own tables
+        if ( !(scan->ss == 0 && scan->ah != 0) ) {
+            memset(work->freq, 0, sizeof(work->freq));
+            ps.gather = 1;
+            tjei_prog_run(&ps, scan, cache, num_mcus);
+
+            for ( int table = 0; table < 4; ++table ) {
+                int is_dc = (table == TJEI_LUMA_DC || table == TJEI_CHROMA_DC);
+                int is_luma = (table == TJEI_LUMA_DC || table == TJEI_LUMA_AC);
+                if ( is_dc != (scan->ss == 0) ) {
+                    continue;
+                }
+                if ( scan->comp != 3 && is_luma != (scan->comp == 0) ) {
+                    continue;
+                }
+                if ( !is_luma && state->num_components == 1 ) {
+                    continue;
+                }
+                tjei_build_optimal_huffman(work, table);
+                tjei_write_DHT(state, work->bits[table], work->vals[table],
+                               is_dc ? TJEI_DC : TJEI_AC, (uint8_t)(is_luma ? 0 : 1));
+            }
+        }
+
+        tjei_prog_write_SOS(state, scan);
+        ps.gather = 0;
+        state->bitbuffer = 0;
+        state->location = 0;
+        tjei_prog_run(&ps, scan, cache, num_mcus);
+
+        // Scans end on a byte boundary, padded with ones
+        tjei_byte_align(state, 1);
+    }
+
     uint16_t EOI = tjei_be_word(0xffd9);
     tjei_write(state, &EOI, sizeof(uint16_t), 1);
 
-    if (state->output_buffer_count) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+    tjei_flush_output(state);
+}
+
+static void tjei_set_sink(TJEState* state, tje_write_func* func, void* context,
+                          uint8_t* buffer, const uint32_t buffer_size, const TJEOptions* options)
+{
+    if (func) {
+        if (buffer) {
+            tjei_set_func_sink(state, func, context, buffer, buffer_size);
+        } else {
+            tjei_set_func_sink(state, func, context, state->spill, TJEI_SPILL_SIZE);
+        }
+    } else if (options) {
+        tjei_set_memory_sink(state, buffer, buffer_size, options->wrap_start, options->wrap_end, 0);
+    } else {
+        tjei_set_memory_sink(state, buffer, buffer_size, NULL, NULL, 0);
+    }
+}
+
+// Writes to buffer_size bytes at buffer if func is NULL, in the ring of
+// options->wrap_* if any, else stages the output for func in buffer (the
+// spill buffer if NULL). 0 if the image didn't fit; bytes_written (may be
+// NULL) is the size of the image in any case.
+// huff_work != NULL selects the optimized Huffman mode, with the symbol
+// cache of pass 1 in [cache, cache + cache_size). options (may be NULL)
+// selects SOF2 and restart intervals; progressive is cleared if the image
+// had to be written baseline
+static int tjei_encode_with_tables(tje_write_func* func,
+                                  void* context,
+                                  uint8_t* buffer, const uint32_t buffer_size,
+                                  uint32_t* bytes_written,
+                                  uint8_t const * qt_luma, uint8_t const * qt_chroma,
+                                  float const * pqt_luma, float const * pqt_chroma,
+                                  TJEHuffWork* huff_work,
+                                  uint8_t* cache, const uint32_t cache_size,
+                                  TJEOptions* options,
+                                  const uint32_t sample_step,
+                                  uint32_t* scan_start,
+                                  const int width,
+                                  const int height,
+                                  const int num_components,
+                                  const unsigned char* src_data)
+{
+    TJEState state = { 0 };
+
+    state.qt_luma    = qt_luma;
+    state.qt_chroma  = qt_chroma;
+    state.pqt_luma   = pqt_luma;
+    state.pqt_chroma = pqt_chroma;
+    state.sample_step = sample_step;
+    state.num_components = (num_components == 1) ? 1 : 3;
+    tjei_use_default_huffman(&state);
+    tjei_set_flat_limits(&state);
+
+    // Progressive scans have no restart intervals, and its baseline fallback
+    // must see the same DC predictors as pass 1
+    int progressive = options && options->progressive;
+    if (options && !progressive && options->restart_interval && sample_step == 1) {
+        state.restart_interval = (options->restart_interval > 0xffff) ? 0xffff : options->restart_interval;
+        state.restart_offsets  = options->restart_offsets;
+        state.restart_max      = options->restart_offsets ? options->restart_max : 0;
+    }
+
+    // Size estimates only see a sample of the MCUs
+    if (options && sample_step == 1) {
+        state.thumbnail = options->thumbnail;
+    }
+
+    if (huff_work) {
+        // Pass 1: symbol statistics, symbols cached for pass 2 while they fit
+        memset(huff_work->freq, 0, sizeof(huff_work->freq));
+        state.pass        = TJEI_PASS_GATHER;
+        state.huff_work   = huff_work;
+        state.cache_ptr   = cache;
+        state.cache_end   = cache + cache_size;
+        state.cache_valid = (cache != NULL);
+
+        tjei_set_func_sink(&state, tjei_discard_func, NULL, state.spill, TJEI_SPILL_SIZE);
+        if (!tjei_encode_main(&state, src_data, width, height, num_components)) {
+            return 0;
+        }
+
+        if (progressive && state.cache_valid) {
+            tjei_set_sink(&state, func, context, buffer, buffer_size, options);
+            tjei_encode_progressive(&state, huff_work, cache, width, height);
+            options->restart_count = 0;
+            options->flat_blocks   = state.flat_blocks;
+            if (bytes_written) {
+                *bytes_written = state.bytes_flushed;
+            }
+            return !state.write_context.overflow;
+        }
+
+        for ( int i = 0; i < 4; ++i ) {
+            tjei_build_optimal_huffman(huff_work, i);
+        }
+        tjei_use_work_huffman(&state, huff_work);
+
+        // Pass 2 writes the image. Without the cache it runs the DCT again
+        state.pass      = state.cache_valid ? TJEI_PASS_REPLAY : TJEI_PASS_WRITE;
+        state.cache_ptr = cache;
+        if (!state.cache_valid) {
+            state.flat_blocks = 0;
+        }
+    }
+
+    if (progressive) {
+        options->progressive = 0;   // coefficients don't fit the cache
+    }
+
+    tjei_set_sink(&state, func, context, buffer, buffer_size, options);
+
+    int result = tjei_encode_main(&state, src_data, width, height, num_components);
+
+    if (options) {
+        options->restart_count = state.restart_count;
+        options->flat_blocks   = state.flat_blocks;
+    }
+    if (scan_start) {
+        *scan_start = state.scan_start;
+    }
+    if (bytes_written) {
+        *bytes_written = state.bytes_flushed;
+    }
+    return result && !state.write_context.overflow;
+}
+
+int tje_encode_with_func(tje_write_func* func,
+                         void* context,
+                         const int quality,
+                         const int width,
+                         const int height,
+                         const int num_components,
+                         const unsigned char* src_data)
+{
+    if (quality < 1 || quality > 3) {
+        tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
+        return 0;
+    }
+
+    // Tables of each quality are precomputed in flash (jpeg_tables.h)
+    uint8_t buffer[TJEI_BUFFER_SIZE];
+    return tjei_encode_with_tables(func, context, buffer, TJEI_BUFFER_SIZE, NULL,
+                                   tjei_dqt_luma[quality - 1], tjei_dqt_chroma[quality - 1],
+                                   tjei_pqt_luma[quality - 1], tjei_pqt_chroma[quality - 1],
+                                   NULL, NULL, 0, NULL,
+                                   1, NULL, width, height, num_components, src_data);
+}
+
+// DQT entry and AAN scaled reciprocal of the coefficient at natural position
+// i, same arithmetic as Tools/jpeg_tables_gen.py
+static void tjei_set_quant(uint8_t* qt, float* pqt, const int i, const int value)
+{
+    static const float aan_scales[] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+    };
+    qt[tjei_zig_zag[i]] = (uint8_t)value;
+    pqt[i] = 1.0f / (8 * aan_scales[i % 8] * aan_scales[i / 8] * value);
+}
+
+// IJG quality scaling (jcparam.c) followed by the AAN reciprocals
+static void tjei_build_ijg_tables(TJEQuantTables* t, int quality)
+{
+    if (quality < 1)   quality = 1;
+    if (quality > 100) quality = 100;
+    int scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+
+    for ( int i = 0; i < 64; i++ ) {
+        int luma   = (tjei_ijg_qt_luma[i]   * scale + 50) / 100;
+        int chroma = (tjei_ijg_qt_chroma[i] * scale + 50) / 100;
+        luma   = (luma < 1)   ? 1 : (luma > 255)   ? 255 : luma;
+        chroma = (chroma < 1) ? 1 : (chroma > 255) ? 255 : chroma;
+        tjei_set_quant(t->qt_luma, t->pqt_luma, i, luma);
+        tjei_set_quant(t->qt_chroma, t->pqt_chroma, i, chroma);
     }
+}
 
+int tje_build_quant_tables(TJEQuantTables* tables, const uint8_t* luma, const uint8_t* chroma)
+{
+    if (!tables || !luma || !chroma) {
+        return 0;
+    }
+    for ( int i = 0; i < 64; i++ ) {
+        if (luma[i] == 0 || chroma[i] == 0) {
+            return 0;
+        }
+    }
+    for ( int i = 0; i < 64; i++ ) {
+        tjei_set_quant(tables->qt_luma, tables->pqt_luma, i, luma[i]);
+        tjei_set_quant(tables->qt_chroma, tables->pqt_chroma, i, chroma[i]);
+    }
     return 1;
 }
 
-// Función de escritura a memoria para STM32
-static void tjei_memory_func(void* context, void* data, int size)
+// One encode to memory with a flash preset (1-3), or the IJG quality if preset
+// is 0. options selects the custom tables, optimized Huffman and progressive
+// modes, and may be NULL.
+static int tjei_encode_to_memory_quality(uint8_t* memory_buffer,
+                                         uint32_t buffer_size,
+                                         uint32_t* bytes_written,
+                                         const int preset,
+                                         const int ijg_quality,
+                                         TJEOptions* options,
+                                         const int width,
+                                         const int height,
+                                         const int num_components,
+                                         const unsigned char* src_data)
 {
-    TJEMemoryContext* mem_ctx = (TJEMemoryContext*)context;
-    
-    // Verificar que no excedamos el buffer
-    if (mem_ctx->bytes_written + size <= mem_ctx->memory_size) {
-        memcpy(mem_ctx->memory_ptr, data, size);
-        mem_ctx->memory_ptr += size;
-        mem_ctx->bytes_written += size;
+    TJEQuantTables tables;
+    uint8_t const * qt_luma;
+    uint8_t const * qt_chroma;
+    float const *   pqt_luma;
+    float const *   pqt_chroma;
+
+    if (options && options->tables) {
+        qt_luma    = options->tables->qt_luma;
+        qt_chroma  = options->tables->qt_chroma;
+        pqt_luma   = options->tables->pqt_luma;
+        pqt_chroma = options->tables->pqt_chroma;
+    } else if (preset) {
+        qt_luma    = tjei_dqt_luma[preset - 1];
+        qt_chroma  = tjei_dqt_chroma[preset - 1];
+        pqt_luma   = tjei_pqt_luma[preset - 1];
+        pqt_chroma = tjei_pqt_chroma[preset - 1];
+    } else {
+        tjei_build_ijg_tables(&tables, ijg_quality);
+        qt_luma    = tables.qt_luma;
+        qt_chroma  = tables.qt_chroma;
+        pqt_luma   = tables.pqt_luma;
+        pqt_chroma = tables.pqt_chroma;
+    }
+
+    TJEHuffWork* huff_work = NULL;
+    uint8_t*     cache = NULL;
+    uint32_t     cache_size = 0;
+    if (options && (options->optimize_huffman || options->progressive) && options->scratch &&
+        options->scratch_size >= sizeof(TJEHuffWork)) {
+        huff_work  = (TJEHuffWork*)options->scratch;
+        cache      = options->scratch + sizeof(TJEHuffWork);
+        cache_size = options->scratch_size - sizeof(TJEHuffWork);
     }
+
+    return tjei_encode_with_tables(NULL, NULL, memory_buffer, buffer_size, bytes_written,
+                                   qt_luma, qt_chroma, pqt_luma, pqt_chroma,
+                                   huff_work, cache, cache_size,
+                                   options,
+                                   1, NULL, width, height, num_components, src_data);
 }
 
 // Función principal para encodear a memoria
@@ -1201,75 +2639,371 @@ int tje_encode_to_memory(uint8_t* memory_buffer,
         return 0;
     }
     
-    TJEMemoryContext mem_ctx;
-    mem_ctx.memory_ptr = memory_buffer;
-    mem_ctx.memory_start = memory_buffer;
-    mem_ctx.memory_size = buffer_size;
-    mem_ctx.bytes_written = 0;
-    
-    int result = tje_encode_with_func(tjei_memory_func, &mem_ctx,
-                                      quality, width, height, num_components, src_data);
-    
-    *bytes_written = mem_ctx.bytes_written;
-    
+    if (quality < 1 || quality > 3) {
+        return 0;
+    }
+
+    return tjei_encode_to_memory_quality(memory_buffer, buffer_size, bytes_written, quality, 0, NULL,
+                                         width, height, num_components, src_data);
+}
+
+int tje_encode_to_memory_ijg(uint8_t* memory_buffer,
+                             uint32_t buffer_size,
+                             uint32_t* bytes_written,
+                             const int quality,
+                             const int width,
+                             const int height,
+                             const int num_components,
+                             const unsigned char* src_data)
+{
+    if (!memory_buffer || !bytes_written || quality < 1 || quality > 100) {
+        return 0;
+    }
+
+    return tjei_encode_to_memory_quality(memory_buffer, buffer_size, bytes_written, 0, quality, NULL,
+                                         width, height, num_components, src_data);
+}
+
+// Encodes a subsampled set of MCUs and extrapolates the entropy coded part
+static uint32_t tjei_estimate_size(const int quality,
+                                   const int width,
+                                   const int height,
+                                   const int num_components,
+                                   const unsigned char* src_data)
+{
+    TJEQuantTables tables;
+    tjei_build_ijg_tables(&tables, quality);
+
+    uint32_t count = 0;
+    uint32_t header = 0;
+    tjei_encode_with_tables(tjei_discard_func, NULL, NULL, 0, &count,
+                            tables.qt_luma, tables.qt_chroma,
+                            tables.pqt_luma, tables.pqt_chroma,
+                            NULL, NULL, 0, NULL,
+                            TJE_RC_SAMPLE_STEP, &header, width, height, num_components, src_data);
+
+    // Sampled MCUs in each direction, rounded up like the encode loop
+    uint32_t mcus_x = ((uint32_t)width  + 7) / 8;
+    uint32_t mcus_y = ((uint32_t)height + 7) / 8;
+    uint32_t sampled = ((mcus_x + TJE_RC_SAMPLE_STEP - 1) / TJE_RC_SAMPLE_STEP) *
+                       ((mcus_y + TJE_RC_SAMPLE_STEP - 1) / TJE_RC_SAMPLE_STEP);
+
+    return header + (uint32_t)(((uint64_t)(count - header) * mcus_x * mcus_y) / sampled);
+}
+
+// Highest quality whose estimate fits target, 1 if none does
+static int tjei_search_quality(const uint32_t target,
+                               const int width,
+                               const int height,
+                               const int num_components,
+                               const unsigned char* src_data)
+{
+    int lo = 1, hi = 100, best = 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (tjei_estimate_size(mid, width, height, num_components, src_data) <= target) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return best;
+}
+
+int tje_encode_to_memory_target(uint8_t* memory_buffer,
+                                uint32_t buffer_size,
+                                uint32_t* bytes_written,
+                                const uint32_t target_size,
+                                int* quality_used,
+                                const int width,
+                                const int height,
+                                const int num_components,
+                                const unsigned char* src_data)
+{
+    if (!quality_used || target_size == 0) {
+        return 0;
+    }
+
+    TJEOptions options = { 0 };
+    options.target_size = target_size;
+
+    int result = tje_encode_to_memory_opt(memory_buffer, buffer_size, bytes_written, &options,
+                                          width, height, num_components, src_data);
+
+    *quality_used = options.ijg_quality;
     return result;
 }
 
-int tje_encode_with_func(tje_write_func* func,
-                         void* context,
-                         const int quality,
-                         const int width,
-                         const int height,
-                         const int num_components,
-                         const unsigned char* src_data)
+int tje_encode_to_memory_opt(uint8_t* memory_buffer,
+                             uint32_t buffer_size,
+                             uint32_t* bytes_written,
+                             TJEOptions* options,
+                             const int width,
+                             const int height,
+                             const int num_components,
+                             const unsigned char* src_data)
 {
-    if (quality < 1 || quality > 3) {
-        tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
+    if (!memory_buffer || !bytes_written || !options) {
         return 0;
     }
 
-    TJEState state = { 0 };
+    if (options->target_size == 0 || options->tables) {
+        if (!options->tables && (options->quality < 0 || options->quality > 3 ||
+            (options->quality == 0 && (options->ijg_quality < 1 || options->ijg_quality > 100)))) {
+            return 0;
+        }
+        return tjei_encode_to_memory_quality(memory_buffer, buffer_size, bytes_written,
+                                             options->quality, options->ijg_quality, options,
+                                             width, height, num_components, src_data);
+    }
 
-    uint8_t qt_factor = 1;
-    switch(quality) {
-    case 3:
-        for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = 1;
-            state.qt_chroma[i] = 1;
+    // Rate control. Estimates use the default Huffman tables, so with
+    // optimize_huffman the real size only comes out smaller
+    const uint32_t target_size = options->target_size;
+    int quality = tjei_search_quality(target_size, width, height, num_components, src_data);
+    int result = tjei_encode_to_memory_quality(memory_buffer, buffer_size, bytes_written, 0, quality, options,
+                                               width, height, num_components, src_data);
+
+    // Estimate was off: correct the target by the measured error and retry once
+    if (result && *bytes_written > target_size && quality > 1) {
+        uint32_t estimate  = tjei_estimate_size(quality, width, height, num_components, src_data);
+        uint32_t corrected = (uint32_t)(((uint64_t)target_size * estimate) / *bytes_written);
+        int retry = tjei_search_quality(corrected, width, height, num_components, src_data);
+        if (retry < quality) {
+            quality = retry;
+            result = tjei_encode_to_memory_quality(memory_buffer, buffer_size, bytes_written, 0, quality, options,
+                                                   width, height, num_components, src_data);
         }
-        break;
-    case 2:
-        qt_factor = 10;
-        // don't break. fall through.
-    case 1:
-        for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if (state.qt_luma[i] == 0) {
-                state.qt_luma[i] = 1;
-            }
-            state.qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if (state.qt_chroma[i] == 0) {
-                state.qt_chroma[i] = 1;
-            }
+    }
+
+    options->ijg_quality = quality;
+    return result;
+}
+
+// State of a resumable encode, rebuilt on every step: tables are selected
+// again (the IJG ones rebuilt into tables) and the memory sink points at the
+// next byte of the output
+static void tjei_encoder_load(const TJEEncoder* enc, TJEState* state, TJEQuantTables* tables)
+{
+    if (enc->tables) {
+        state->qt_luma    = enc->tables->qt_luma;
+        state->qt_chroma  = enc->tables->qt_chroma;
+        state->pqt_luma   = enc->tables->pqt_luma;
+        state->pqt_chroma = enc->tables->pqt_chroma;
+    } else if (enc->quality) {
+        state->qt_luma    = tjei_dqt_luma[enc->quality - 1];
+        state->qt_chroma  = tjei_dqt_chroma[enc->quality - 1];
+        state->pqt_luma   = tjei_pqt_luma[enc->quality - 1];
+        state->pqt_chroma = tjei_pqt_chroma[enc->quality - 1];
+    } else {
+        tjei_build_ijg_tables(tables, enc->ijg_quality);
+        state->qt_luma    = tables->qt_luma;
+        state->qt_chroma  = tables->qt_chroma;
+        state->pqt_luma   = tables->pqt_luma;
+        state->pqt_chroma = tables->pqt_chroma;
+    }
+    tjei_use_default_huffman(state);
+    tjei_set_flat_limits(state);
+    state->sample_step      = 1;
+    state->num_components   = enc->num_components;
+    state->restart_interval = enc->restart_interval;
+    state->restart_offsets  = enc->restart_offsets;
+    state->restart_max      = enc->restart_max;
+    state->thumbnail        = enc->thumbnail;
+
+    const TJEResume* r = &enc->resume;
+    uint8_t* next = enc->memory_buffer + r->bytes_written;
+    if (enc->wrap_start && next >= enc->wrap_end) {
+        next -= enc->wrap_end - enc->wrap_start;
+    }
+    tjei_set_memory_sink(state, next, enc->buffer_size - r->bytes_written,
+                         enc->wrap_start, enc->wrap_end, r->bytes_written);
+
+    state->bitbuffer      = r->bitbuffer;
+    state->location       = r->location;
+    state->pred_y         = r->pred[0];
+    state->pred_b         = r->pred[1];
+    state->pred_r         = r->pred[2];
+    state->restart_mcus   = r->restart_mcus;
+    state->restart_marker = r->restart_marker;
+    state->restart_count  = r->restart_count;
+    state->flat_blocks    = r->flat_blocks;
+}
+
+// Flushes the output and keeps the resume point. 0 if a write didn't fit
+static int tjei_encoder_save(TJEEncoder* enc, TJEState* state)
+{
+    tjei_flush_bits(state);
+    tjei_flush_output(state);
+    if (state->write_context.overflow) {
+        return 0;
+    }
+
+    TJEResume* r = &enc->resume;
+    r->bytes_written  = state->bytes_flushed;
+    r->bitbuffer      = state->bitbuffer;
+    r->location       = state->location;
+    r->pred[0]        = state->pred_y;
+    r->pred[1]        = state->pred_b;
+    r->pred[2]        = state->pred_r;
+    r->restart_mcus   = state->restart_mcus;
+    r->restart_marker = state->restart_marker;
+    r->restart_count  = state->restart_count;
+    r->flat_blocks    = state->flat_blocks;
+    return 1;
+}
+
+int tje_encode_begin(TJEEncoder* enc,
+                     uint8_t* memory_buffer,
+                     uint32_t buffer_size,
+                     const TJEOptions* options,
+                     const int width,
+                     const int height,
+                     const int num_components,
+                     const unsigned char* src_data)
+{
+    if (!enc || !memory_buffer || !options || !src_data ||
+        (!options->tables && (options->quality < 0 || options->quality > 3 ||
+         (options->quality == 0 && (options->ijg_quality < 1 || options->ijg_quality > 100)))) ||
+        (num_components != 1 && num_components != 3 && num_components != 4) ||
+        width < 1 || height < 1 || width > 0xffff || height > 0xffff) {
+        return 0;
+    }
+
+    memset(enc, 0, sizeof(TJEEncoder));
+    enc->memory_buffer  = memory_buffer;
+    enc->buffer_size    = buffer_size;
+    enc->src_data       = src_data;
+    enc->width          = (uint16_t)width;
+    enc->height         = (uint16_t)height;
+    enc->num_components = (uint8_t)((num_components == 1) ? 1 : 3);
+    enc->quality        = (uint8_t)options->quality;
+    enc->ijg_quality    = (uint8_t)options->ijg_quality;
+    enc->tables         = options->tables;
+    enc->thumbnail      = options->thumbnail;
+    if (options->wrap_start && options->wrap_start <= memory_buffer && memory_buffer < options->wrap_end) {
+        enc->wrap_start = options->wrap_start;
+        enc->wrap_end   = options->wrap_end;
+        if (enc->buffer_size > (uint32_t)(enc->wrap_end - enc->wrap_start)) {
+            enc->buffer_size = (uint32_t)(enc->wrap_end - enc->wrap_start);
         }
-        break;
-    default:
-        assert(!"invalid code path");
-        break;
+    }
+    if (options->restart_interval) {
+        enc->restart_interval = (options->restart_interval > 0xffff) ? 0xffff : options->restart_interval;
+        enc->restart_offsets  = options->restart_offsets;
+        enc->restart_max      = options->restart_offsets ? options->restart_max : 0;
     }
 
-    TJEWriteContext wc = { 0 };
+    TJEState       state = { 0 };
+    TJEQuantTables tables;
+    tjei_encoder_load(enc, &state, &tables);
+    tjei_write_baseline_headers(&state, width, height);
+
+    return tjei_encoder_save(enc, &state);
+}
+
+int tje_encode_step(TJEEncoder* enc, const uint32_t mcu_rows)
+{
+    if (!enc || !enc->memory_buffer) {
+        return TJE_STEP_ERROR;
+    }
+    const uint32_t total_rows = ((uint32_t)enc->height + 7) / 8;
+    if (enc->resume.mcu_row >= total_rows) {
+        return TJE_STEP_DONE;
+    }
 
-    wc.context = context;
-    wc.func = func;
+    uint32_t rows = total_rows - enc->resume.mcu_row;
+    if (mcu_rows && mcu_rows < rows) {
+        rows = mcu_rows;
+    }
 
-    state.write_context = wc;
+    TJEState       state = { 0 };
+    TJEQuantTables tables;
+    tjei_encoder_load(enc, &state, &tables);
 
+    const int y_begin = (int)(enc->resume.mcu_row * 8);
+    const int y_end   = (int)((enc->resume.mcu_row + rows) * 8);
+    tjei_encode_rows(&state, enc->src_data, enc->width, enc->height,
+                     y_begin, (y_end < enc->height) ? y_end : enc->height);
 
-    tjei_huff_expand(&state);
+    const int done = (enc->resume.mcu_row + rows == total_rows);
+    if (done) {
+        tjei_finish_image(&state);
+    }
+    if (!tjei_encoder_save(enc, &state)) {
+        return TJE_STEP_ERROR;
+    }
+    enc->resume.mcu_row += rows;
 
-    int result = tjei_encode_main(&state, src_data, width, height, num_components);
+    return done ? TJE_STEP_DONE : TJE_STEP_MORE;
+}
 
+int tje_encode_to_memory_dual(uint8_t* memory_buffer,
+                              uint32_t buffer_size,
+                              uint32_t* bytes_written,
+                              TJEOptions* options,
+                              uint8_t* half_buffer,
+                              uint32_t half_buffer_size,
+                              uint32_t* half_bytes_written,
+                              TJEOptions* half_options,
+                              uint8_t* strip,
+                              const int width,
+                              const int height,
+                              const int num_components,
+                              const unsigned char* src_data)
+{
+    if (!bytes_written || !half_bytes_written || !half_options || !strip) {
+        return 0;
+    }
+    const int half_width  = TJE_HALF_WIDTH(width);
+    const int half_height = TJE_HALF_HEIGHT(height);
+
+    // Headers of both images, then the two states are stepped side by side
+    TJEEncoder full, half;
+    if (!tje_encode_begin(&full, memory_buffer, buffer_size, options,
+                          width, height, num_components, src_data) ||
+        !tje_encode_begin(&half, half_buffer, half_buffer_size, half_options,
+                          half_width, half_height, num_components, strip)) {
+        return 0;
+    }
+    half.thumbnail = NULL;
+
+    TJEState       full_state = { 0 };
+    TJEState       half_state = { 0 };
+    TJEQuantTables full_tables;
+    TJEQuantTables half_tables;
+    tjei_encoder_load(&full, &full_state, &full_tables);
+    tjei_encoder_load(&half, &half_state, &half_tables);
+    full_state.half_strip = strip;
+    full_state.half_pitch = (uint32_t)half_width * 2;
+
+    const int rows = (height + 7) / 8;
+    for ( int row = 0; row < rows; ++row ) {
+        const int y = row * 8;
+        tjei_encode_rows(&full_state, src_data, width, height, y, (y + 8 < height) ? y + 8 : height);
+
+        // The strip is full after an odd row, or partly full after the last
+        if ( (row & 1) || row == rows - 1 ) {
+            int lines = half_height - (row / 2) * 8;
+            if ( lines > 8 ) {
+                lines = 8;
+            }
+            tjei_encode_rows(&half_state, strip, half_width, lines, 0, lines);
+        }
+    }
+    tjei_finish_image(&full_state);
+    tjei_finish_image(&half_state);
+
+    int result = tjei_encoder_save(&full, &full_state);
+    result = tjei_encoder_save(&half, &half_state) && result;
+
+    *bytes_written      = full.resume.bytes_written;
+    *half_bytes_written = half.resume.bytes_written;
+    options->restart_count      = full.resume.restart_count;
+    options->flat_blocks        = full.resume.flat_blocks;
+    half_options->restart_count = half.resume.restart_count;
+    half_options->flat_blocks   = half.resume.flat_blocks;
     return result;
 }
 // ============================================================
@@ -0,0 +1,357 @@
+/*
+ * jpeg_tables.h - constant tables for the JPEG encoder (jpeg.h)
+ *
+ * GENERATED by Tools/jpeg_tables_gen.py - do not edit by hand
+ */
+
+#ifndef __JPEG_TABLES_H__
+#define __JPEG_TABLES_H__
+
+#include <stdint.h>
+
+#define TJEI_NUM_QUALITY_PRESETS (3U)
+
+// Code length of every symbol, 0 if not in the table
+// [LUMA_DC, LUMA_AC, CHROMA_DC, CHROMA_AC][symbol]
+static const uint8_t tjei_ehuffsize[4][256] =
+{
+  { // LUMA_DC
+    2, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  },
+  { // LUMA_AC
+    4, 2, 2, 3, 4, 5, 7, 8, 10, 16, 16, 0, 0, 0, 0, 0,
+    0, 4, 5, 7, 9, 11, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 5, 8, 10, 12, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 6, 9, 12, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 6, 10, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 7, 11, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 7, 12, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 8, 12, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 15, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 10, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 10, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 11, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    11, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+  },
+  { // CHROMA_DC
+    2, 2, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  },
+  { // CHROMA_AC
+    2, 2, 3, 4, 5, 5, 6, 7, 9, 10, 12, 0, 0, 0, 0, 0,
+    0, 4, 6, 8, 9, 11, 12, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 5, 8, 10, 12, 15, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 5, 8, 10, 12, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 6, 9, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 6, 10, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 7, 11, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 7, 11, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 8, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 9, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 11, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    0, 14, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+    10, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16, 0, 0, 0, 0, 0,
+  },
+};
+
+// Code of every symbol, right aligned
+static const uint16_t tjei_ehuffcode[4][256] =
+{
+  { // LUMA_DC
+    0x0000, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x000e, 0x001e, 0x003e, 0x007e, 0x00fe, 0x01fe,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000,
+  },
+  { // LUMA_AC
+    0x000a, 0x0000, 0x0001, 0x0004, 0x000b, 0x001a, 0x0078, 0x00f8, 0x03f6, 0xff82, 0xff83, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x000c, 0x001b, 0x0079, 0x01f6, 0x07f6, 0xff84, 0xff85,
+    0xff86, 0xff87, 0xff88, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x001c, 0x00f9, 0x03f7,
+    0x0ff4, 0xff89, 0xff8a, 0xff8b, 0xff8c, 0xff8d, 0xff8e, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x003a, 0x01f7, 0x0ff5, 0xff8f, 0xff90, 0xff91, 0xff92, 0xff93, 0xff94, 0xff95, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x003b, 0x03f8, 0xff96, 0xff97, 0xff98, 0xff99, 0xff9a,
+    0xff9b, 0xff9c, 0xff9d, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x007a, 0x07f7, 0xff9e,
+    0xff9f, 0xffa0, 0xffa1, 0xffa2, 0xffa3, 0xffa4, 0xffa5, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x007b, 0x0ff6, 0xffa6, 0xffa7, 0xffa8, 0xffa9, 0xffaa, 0xffab, 0xffac, 0xffad, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x00fa, 0x0ff7, 0xffae, 0xffaf, 0xffb0, 0xffb1, 0xffb2,
+    0xffb3, 0xffb4, 0xffb5, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x01f8, 0x7fc0, 0xffb6,
+    0xffb7, 0xffb8, 0xffb9, 0xffba, 0xffbb, 0xffbc, 0xffbd, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x01f9, 0xffbe, 0xffbf, 0xffc0, 0xffc1, 0xffc2, 0xffc3, 0xffc4, 0xffc5, 0xffc6, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x01fa, 0xffc7, 0xffc8, 0xffc9, 0xffca, 0xffcb, 0xffcc,
+    0xffcd, 0xffce, 0xffcf, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x03f9, 0xffd0, 0xffd1,
+    0xffd2, 0xffd3, 0xffd4, 0xffd5, 0xffd6, 0xffd7, 0xffd8, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x03fa, 0xffd9, 0xffda, 0xffdb, 0xffdc, 0xffdd, 0xffde, 0xffdf, 0xffe0, 0xffe1, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x07f8, 0xffe2, 0xffe3, 0xffe4, 0xffe5, 0xffe6, 0xffe7,
+    0xffe8, 0xffe9, 0xffea, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xffeb, 0xffec, 0xffed,
+    0xffee, 0xffef, 0xfff0, 0xfff1, 0xfff2, 0xfff3, 0xfff4, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x07f9, 0xfff5, 0xfff6, 0xfff7, 0xfff8, 0xfff9, 0xfffa, 0xfffb, 0xfffc, 0xfffd, 0xfffe, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000,
+  },
+  { // CHROMA_DC
+    0x0000, 0x0001, 0x0002, 0x0006, 0x000e, 0x001e, 0x003e, 0x007e, 0x00fe, 0x01fe, 0x03fe, 0x07fe,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000,
+  },
+  { // CHROMA_AC
+    0x0000, 0x0001, 0x0004, 0x000a, 0x0018, 0x0019, 0x0038, 0x0078, 0x01f4, 0x03f6, 0x0ff4, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x000b, 0x0039, 0x00f6, 0x01f5, 0x07f6, 0x0ff5, 0xff88,
+    0xff89, 0xff8a, 0xff8b, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x001a, 0x00f7, 0x03f7,
+    0x0ff6, 0x7fc2, 0xff8c, 0xff8d, 0xff8e, 0xff8f, 0xff90, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x001b, 0x00f8, 0x03f8, 0x0ff7, 0xff91, 0xff92, 0xff93, 0xff94, 0xff95, 0xff96, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x003a, 0x01f6, 0xff97, 0xff98, 0xff99, 0xff9a, 0xff9b,
+    0xff9c, 0xff9d, 0xff9e, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x003b, 0x03f9, 0xff9f,
+    0xffa0, 0xffa1, 0xffa2, 0xffa3, 0xffa4, 0xffa5, 0xffa6, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0079, 0x07f7, 0xffa7, 0xffa8, 0xffa9, 0xffaa, 0xffab, 0xffac, 0xffad, 0xffae, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x007a, 0x07f8, 0xffaf, 0xffb0, 0xffb1, 0xffb2, 0xffb3,
+    0xffb4, 0xffb5, 0xffb6, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x00f9, 0xffb7, 0xffb8,
+    0xffb9, 0xffba, 0xffbb, 0xffbc, 0xffbd, 0xffbe, 0xffbf, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x01f7, 0xffc0, 0xffc1, 0xffc2, 0xffc3, 0xffc4, 0xffc5, 0xffc6, 0xffc7, 0xffc8, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x01f8, 0xffc9, 0xffca, 0xffcb, 0xffcc, 0xffcd, 0xffce,
+    0xffcf, 0xffd0, 0xffd1, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x01f9, 0xffd2, 0xffd3,
+    0xffd4, 0xffd5, 0xffd6, 0xffd7, 0xffd8, 0xffd9, 0xffda, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x01fa, 0xffdb, 0xffdc, 0xffdd, 0xffde, 0xffdf, 0xffe0, 0xffe1, 0xffe2, 0xffe3, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x07f9, 0xffe4, 0xffe5, 0xffe6, 0xffe7, 0xffe8, 0xffe9,
+    0xffea, 0xffeb, 0xffec, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x3fe0, 0xffed, 0xffee,
+    0xffef, 0xfff0, 0xfff1, 0xfff2, 0xfff3, 0xfff4, 0xfff5, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x03fa, 0x7fc3, 0xfff6, 0xfff7, 0xfff8, 0xfff9, 0xfffa, 0xfffb, 0xfffc, 0xfffd, 0xfffe, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000,
+  },
+};
+
+// DQT luma tables as written to the file (zig-zag order), [quality - 1]
+static const uint8_t tjei_dqt_luma[TJEI_NUM_QUALITY_PRESETS][64] =
+{
+  { // quality 1
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+  },
+  { // quality 2
+    1, 1, 1, 1, 2, 4, 5, 6, 1, 1, 1, 1, 2, 5, 6, 5,
+    1, 1, 1, 2, 4, 5, 6, 5, 1, 1, 2, 2, 5, 8, 8, 6,
+    1, 2, 3, 5, 6, 10, 10, 7, 2, 3, 5, 6, 8, 10, 11, 9,
+    4, 6, 7, 8, 10, 12, 12, 10, 7, 9, 9, 9, 11, 10, 10, 9,
+  },
+  { // quality 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  },
+};
+
+// DQT chroma tables as written to the file (zig-zag order), [quality - 1]
+static const uint8_t tjei_dqt_chroma[TJEI_NUM_QUALITY_PRESETS][64] =
+{
+  { // quality 1
+    16, 12, 14, 14, 18, 24, 49, 72, 11, 10, 16, 24, 40, 51, 61, 12,
+    13, 17, 22, 35, 64, 92, 14, 16, 22, 37, 55, 78, 95, 19, 24, 29,
+    56, 64, 87, 98, 26, 40, 51, 68, 81, 103, 112, 58, 57, 87, 109, 104,
+    121, 100, 60, 69, 80, 103, 113, 120, 103, 55, 56, 62, 77, 92, 101, 99,
+  },
+  { // quality 2
+    1, 1, 1, 1, 1, 2, 4, 7, 1, 1, 1, 2, 4, 5, 6, 1,
+    1, 1, 2, 3, 6, 9, 1, 1, 2, 3, 5, 7, 9, 1, 2, 2,
+    5, 6, 8, 9, 2, 4, 5, 6, 8, 10, 11, 5, 5, 8, 10, 10,
+    12, 10, 6, 6, 8, 10, 11, 12, 10, 5, 5, 6, 7, 9, 10, 9,
+  },
+  { // quality 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  },
+};
+
+// AAN scaled reciprocal luma quantization (natural order), [quality - 1]
+static const float tjei_pqt_luma[TJEI_NUM_QUALITY_PRESETS][64] =
+{
+  { // quality 1
+    0x1p-7f, 0x1.0c759p-7f, 0x1.397e88p-9f, 0x1.11347p-9f,
+    0x1.111112p-9f, 0x1.7b24aap-9f, 0x1.04fae4p-7f, 0x1.23190ep-7f,
+    0x1.274e1cp-7f, 0x1.62d6aap-9f, 0x1.286a5ap-10f, 0x1.5a652p-10f,
+    0x1.a5dd4ep-8f, 0x1.55af0cp-8f, 0x1.f5bfe8p-10f, 0x1.853694p-8f,
+    0x1.87de2ap-8f, 0x1.78b1dp-8f, 0x1.7122b2p-9f, 0x1.9a2956p-8f,
+    0x1.70d118p-8f, 0x1.8f00a6p-10f, 0x1.4b01bcp-8f, 0x1.63150ap-8f,
+    0x1.2247b8p-7f, 0x1.085aa4p-8f, 0x1.4d4196p-8f, 0x1.a73196p-8f,
+    0x1.c1775p-10f, 0x1.7174e2p-8f, 0x1.3dd8fcp-9f, 0x1.a15f06p-9f,
+    0x1.24924ap-7f, 0x1.ec2cdep-9f, 0x1.bfd954p-10f, 0x1.830a4ap-8f,
+    0x1.a98ef6p-10f, 0x1.910452p-10f, 0x1.25eb56p-9f, 0x1.eeddccp-9f,
+    0x1.04a934p-8f, 0x1.b3c546p-10f, 0x1.6abac6p-8f, 0x1.58590cp-10f,
+    0x1.7113d4p-10f, 0x1.3110b6p-9f, 0x1.7d7ef6p-9f, 0x1.516adp-8f,
+    0x1.098f02p-8f, 0x1.26f28ap-8f, 0x1.a92574p-10f, 0x1.17d814p-9f,
+    0x1.841fcap-9f, 0x1.0b93b8p-8f, 0x1.1d667ep-8f, 0x1.125172p-7f,
+    0x1.091b64p-7f, 0x1.3ace08p-8f, 0x1.cfc7e2p-8f, 0x1.8a8bd4p-8f,
+    0x1.42bd2cp-8f, 0x1.8dcc12p-8f, 0x1.0a540cp-7f, 0x1.0fc3cep-6f,
+  },
+  { // quality 2
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-6f, 0x1.5c561p-6f,
+    0x1.555556p-6f, 0x1.04a934p-5f, 0x1.d906bcp-4f, 0x1.732658p-4f,
+    0x1.7121a4p-4f, 0x1.0a21p-5f, 0x1.78b1dp-7f, 0x1.f645d2p-7f,
+    0x1.7121a4p-4f, 0x1.d5d0bp-5f, 0x1.55087p-6f, 0x1.0b9586p-4f,
+    0x1.87de2ap-4f, 0x1.1a855cp-4f, 0x1.2bec32p-5f, 0x1.4d4196p-4f,
+    0x1.87de2ap-4f, 0x1.f2c0cep-7f, 0x1.e2b7dcp-5f, 0x1.d97164p-5f,
+    0x1.b36b94p-4f, 0x1.39eba4p-4f, 0x1.4d4196p-4f, 0x1.724b64p-4f,
+    0x1.2247b8p-6f, 0x1.1517a8p-4f, 0x1.92469ep-6f, 0x1.0707e2p-5f,
+    0x1p-3f, 0x1.7121a4p-5f, 0x1.397e88p-6f, 0x1.b36b94p-4f,
+    0x1.24924ap-6f, 0x1.04a934p-6f, 0x1.7a6bcap-6f, 0x1.354aap-5f,
+    0x1.45d382p-5f, 0x1.3935ccp-6f, 0x1.f2c0cep-5f, 0x1.bb590cp-7f,
+    0x1.d9edd2p-7f, 0x1.9eb2b6p-6f, 0x1.e1a37ep-6f, 0x1.ad70aap-5f,
+    0x1.7a6bcap-5f, 0x1.c6b5eap-5f, 0x1.21a184p-6f, 0x1.65941ap-6f,
+    0x1.0e4cfep-5f, 0x1.58071p-5f, 0x1.84762ep-5f, 0x1.56e5dp-4f,
+    0x1.732658p-4f, 0x1.bdf936p-5f, 0x1.63150ap-4f, 0x1.0707e2p-4f,
+    0x1.9c638p-5f, 0x1.066f84p-4f, 0x1.56e5dp-4f, 0x1.75ad3cp-3f,
+  },
+  { // quality 3
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-4f, 0x1.b36b94p-4f,
+    0x1p-3f, 0x1.45d382p-3f, 0x1.d906bcp-3f, 0x1.cfeffp-2f,
+    0x1.7121a4p-4f, 0x1.0a21p-4f, 0x1.1a855cp-4f, 0x1.39eba4p-4f,
+    0x1.7121a4p-4f, 0x1.d5d0bp-4f, 0x1.55087p-3f, 0x1.4e7ae8p-2f,
+    0x1.87de2ap-4f, 0x1.1a855cp-4f, 0x1.2bec32p-4f, 0x1.4d4196p-4f,
+    0x1.87de2ap-4f, 0x1.f2c0cep-4f, 0x1.6a09e4p-3f, 0x1.63150ap-2f,
+    0x1.b36b94p-4f, 0x1.39eba4p-4f, 0x1.4d4196p-4f, 0x1.724b64p-4f,
+    0x1.b36b94p-4f, 0x1.1517a8p-3f, 0x1.92469ep-3f, 0x1.8a8bd4p-2f,
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-4f, 0x1.b36b94p-4f,
+    0x1p-3f, 0x1.45d382p-3f, 0x1.d906bcp-3f, 0x1.cfeffp-2f,
+    0x1.45d382p-3f, 0x1.d5d0bp-4f, 0x1.f2c0cep-4f, 0x1.1517a8p-3f,
+    0x1.45d382p-3f, 0x1.9eb2b6p-3f, 0x1.2d062ep-2f, 0x1.273d74p-1f,
+    0x1.d906bcp-3f, 0x1.55087p-3f, 0x1.6a09e4p-3f, 0x1.92469ep-3f,
+    0x1.d906bcp-3f, 0x1.2d062ep-2f, 0x1.b504f2p-2f, 0x1.ac9f44p-1f,
+    0x1.cfeffp-2f, 0x1.4e7ae8p-2f, 0x1.63150ap-2f, 0x1.8a8bd4p-2f,
+    0x1.cfeffp-2f, 0x1.273d74p-1f, 0x1.ac9f44p-1f, 0x1.a462e4p+0f,
+  },
+};
+
+// AAN scaled reciprocal chroma quantization (natural order), [quality - 1]
+static const float tjei_pqt_chroma[TJEI_NUM_QUALITY_PRESETS][64] =
+{
+  { // quality 1
+    0x1p-7f, 0x1.ec2cdep-8f, 0x1.053ec6p-8f, 0x1.1c5b28p-9f,
+    0x1.0c9714p-9f, 0x1.b26f58p-7f, 0x1.841fcap-9f, 0x1.388c14p-8f,
+    0x1.a5dd4ep-8f, 0x1.d91e36p-9f, 0x1.f6426cp-11f, 0x1.89f07cp-10f,
+    0x1.c650cap-8f, 0x1.1158d6p-9f, 0x1.1f2f86p-7f, 0x1.7e4352p-9f,
+    0x1.bfd954p-8f, 0x1.9af088p-8f, 0x1.dfe04ep-10f, 0x1.39a724p-8f,
+    0x1.52e9a8p-9f, 0x1.4c8088p-8f, 0x1.c1e98p-10f, 0x1.87d09ap-8f,
+    0x1.5c561p-7f, 0x1.a28f84p-9f, 0x1.e4bc7ep-9f, 0x1.0d4e1ap-8f,
+    0x1.e076b4p-9f, 0x1.b5dfdcp-10f, 0x1.c3ad9cp-9f, 0x1.ea4f54p-9f,
+    0x1p-7f, 0x1.517dd8p-9f, 0x1.87de2ap-8f, 0x1.f19f86p-10f,
+    0x1.e1e1e2p-10f, 0x1.df606p-10f, 0x1.7a6bcap-9f, 0x1.06c2ccp-8f,
+    0x1.45d382p-9f, 0x1.0c774p-7f, 0x1.f2c0cep-10f, 0x1.5bb94cp-9f,
+    0x1.7e9f22p-10f, 0x1.80a5c4p-9f, 0x1.4117aap-9f, 0x1.eac9e6p-8f,
+    0x1.490fdp-9f, 0x1.f5bfe8p-10f, 0x1.21a184p-8f, 0x1.ef1bd6p-10f,
+    0x1.f88fb8p-9f, 0x1.761696p-9f, 0x1.c31de2p-8f, 0x1.2a2c02p-7f,
+    0x1.2efabcp-8f, 0x1.9baaf6p-7f, 0x1.779fc8p-9f, 0x1.f904e8p-9f,
+    0x1.0ded58p-7f, 0x1.516adp-7f, 0x1.0f9a26p-7f, 0x1.0fc3cep-6f,
+  },
+  { // quality 2
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-5f, 0x1.b36b94p-6f,
+    0x1.555556p-6f, 0x1.45d382p-3f, 0x1.0e4cfep-5f, 0x1.9c638p-5f,
+    0x1.7121a4p-4f, 0x1.0a21p-4f, 0x1.42e18ep-7f, 0x1.f645d2p-7f,
+    0x1.7121a4p-4f, 0x1.77da26p-6f, 0x1.55087p-3f, 0x1.e6843ap-6f,
+    0x1.87de2ap-4f, 0x1.1a855cp-4f, 0x1.2bec32p-6f, 0x1.4d4196p-4f,
+    0x1.053ec6p-5f, 0x1.f2c0cep-5f, 0x1.21a184p-6f, 0x1.1c10d4p-4f,
+    0x1.b36b94p-4f, 0x1.39eba4p-5f, 0x1.4d4196p-5f, 0x1.724b64p-5f,
+    0x1.b36b94p-5f, 0x1.1517a8p-6f, 0x1.41d218p-5f, 0x1.3ba31p-5f,
+    0x1p-3f, 0x1.ec2cdep-6f, 0x1.87de2ap-4f, 0x1.5c561p-6f,
+    0x1.555556p-6f, 0x1.45d382p-6f, 0x1.d906bcp-6f, 0x1.5168aep-5f,
+    0x1.b26f58p-6f, 0x1.d5d0bp-4f, 0x1.4c8088p-6f, 0x1.bb590cp-6f,
+    0x1.04a934p-6f, 0x1.147724p-5f, 0x1.915d92p-6f, 0x1.516adp-4f,
+    0x1.a477c6p-6f, 0x1.55087p-6f, 0x1.6a09e4p-5f, 0x1.41d218p-6f,
+    0x1.3b59d4p-5f, 0x1.e1a37ep-6f, 0x1.2358a2p-4f, 0x1.7cff58p-4f,
+    0x1.9c638p-5f, 0x1.4e7ae8p-3f, 0x1.d97164p-6f, 0x1.3ba31p-5f,
+    0x1.732658p-4f, 0x1.d86254p-4f, 0x1.56e5dp-4f, 0x1.75ad3cp-3f,
+  },
+  { // quality 3
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-4f, 0x1.b36b94p-4f,
+    0x1p-3f, 0x1.45d382p-3f, 0x1.d906bcp-3f, 0x1.cfeffp-2f,
+    0x1.7121a4p-4f, 0x1.0a21p-4f, 0x1.1a855cp-4f, 0x1.39eba4p-4f,
+    0x1.7121a4p-4f, 0x1.d5d0bp-4f, 0x1.55087p-3f, 0x1.4e7ae8p-2f,
+    0x1.87de2ap-4f, 0x1.1a855cp-4f, 0x1.2bec32p-4f, 0x1.4d4196p-4f,
+    0x1.87de2ap-4f, 0x1.f2c0cep-4f, 0x1.6a09e4p-3f, 0x1.63150ap-2f,
+    0x1.b36b94p-4f, 0x1.39eba4p-4f, 0x1.4d4196p-4f, 0x1.724b64p-4f,
+    0x1.b36b94p-4f, 0x1.1517a8p-3f, 0x1.92469ep-3f, 0x1.8a8bd4p-2f,
+    0x1p-3f, 0x1.7121a4p-4f, 0x1.87de2ap-4f, 0x1.b36b94p-4f,
+    0x1p-3f, 0x1.45d382p-3f, 0x1.d906bcp-3f, 0x1.cfeffp-2f,
+    0x1.45d382p-3f, 0x1.d5d0bp-4f, 0x1.f2c0cep-4f, 0x1.1517a8p-3f,
+    0x1.45d382p-3f, 0x1.9eb2b6p-3f, 0x1.2d062ep-2f, 0x1.273d74p-1f,
+    0x1.d906bcp-3f, 0x1.55087p-3f, 0x1.6a09e4p-3f, 0x1.92469ep-3f,
+    0x1.d906bcp-3f, 0x1.2d062ep-2f, 0x1.b504f2p-2f, 0x1.ac9f44p-1f,
+    0x1.cfeffp-2f, 0x1.4e7ae8p-2f, 0x1.63150ap-2f, 0x1.8a8bd4p-2f,
+    0x1.cfeffp-2f, 0x1.273d74p-1f, 0x1.ac9f44p-1f, 0x1.a462e4p+0f,
+  },
+};
+
+#endif /* __JPEG_TABLES_H__ */
@@ -17,8 +17,9 @@
 // TX Buffer return codes
 #define DCMI_CAPTURE_ERR								(0x50U)
 #define BLACK_FILTERING_ERR								(0x51U)
-#define CAPTURE_TIMEOUT_ERR								(0x52U)		// TODO - Implement this error code when timeout is implemented
+#define CAPTURE_TIMEOUT_ERR								(0x52U)
 #define COMPRESSION_ERR									(0x53U)
+#define UNCHANGED_SCENE_ERR								(0x54U)		// frame dropped by change detection
 
 #define COMMAND_SUCCESS									(0x40U)
 #define COMMAND_FAILURE 								(0x41U)
@@ -13,8 +13,9 @@
 #include "jpeg.h"
 #include "command.h"
 #include "fram.h"
-
-#define TJE_IMPLEMENTATION													// adds compression library
+#include "cam_regs.h"
+#include "wavelet.h"
+#include "rice.h"
 
 #define H 							  	 (640U)								// Horizontal resolution
 #define L 							  	 (480U)								// Vertical resolution
@@ -30,6 +31,7 @@
 #endif
 
 #define I2C_TIMEOUT_MS  			  	 (50U)
+#define DCMI_CAPTURE_TIMEOUT_MS			 (2000U)	// frame end, longest exposure included
 
 // ------------------------ USS GPIO definitions ----------------------
 #define CAM_A_GPIO_PIN_EN			  	 (2U)
@@ -37,47 +39,288 @@
 #define CAM_GPIO_I2C_EN				  	 (11U)
 #define CAM_GPIO_POW_EN				  	 (12U)
 
+// --------------------------- Preview capture -------------------------
+// STM32F2 DCMI has no byte/line select, so decimation is done on the fly:
+// DMA loops over a small line ring in internal RAM and the DCMI line
+// interrupt keeps the Y byte of 1 out of PREVIEW_DECIMATION pixels and lines
+#define PREVIEW_DECIMATION				 (2U)								// must be even (2 pixels per DMA word)
+#define PREVIEW_H						 (H / PREVIEW_DECIMATION)			// 320
+#define PREVIEW_L						 (L / PREVIEW_DECIMATION)			// 240
+#define PREVIEW_LINE_WORDS				 (H / 2U)							// one sensor line, 32b words
+#define PREVIEW_RING_LINES				 (4U)								// line being written is 2 ahead of the one read
+
 // ----------------------------- SRAM Memory ---------------------------
 #define RAW_PHOTO_BASE_ADDRESS 		  	 (0x60000000U)							// NOR SRAM BANK 1
 #define RAW_PHOTO_BYTE_SIZE 		  	 (2*H*L)								// in bytes
 #define DCMI_NUM_TRANSFERS				 (RAW_PHOTO_BYTE_SIZE / 4U)
 #define NUM_BUFFERS 				  	 (3U)
-#define RAW_METADATA_SIZE 			     (10U)
+#define RAW_METADATA_SIZE 			     (16U)
 #define RAW_PHOTO_SIZE					 (RAW_PHOTO_BYTE_SIZE) + (RAW_METADATA_SIZE)
 
+// ------------------------- Crop / ROI capture ------------------------
+#define NUM_CROP_PRESETS				 (4U)								// preset 0 is always the full frame
+#define CROP_UNIT						 (8U)								// window granularity in pixels (one JPEG block)
+
+typedef struct {
+	uint16_t x0;					  // first column, in pixels
+	uint16_t y0;					  // first line, in pixels
+	uint16_t width;					  // window width, in pixels
+	uint16_t height;				  // window height, in pixels
+} crop_window_t;
+
+// Ownership of each raw buffer while a capture/compression pipeline is running
+typedef enum {
+	BUFFER_FREE = 0,				  // no useful data, can be captured into
+	BUFFER_CAPTURING,				  // DCMI + DMA are filling the buffer
+	BUFFER_CAPTURED,				  // frame complete, waiting for compression
+	BUFFER_ENCODING,				  // CPU is compressing the frame
+	BUFFER_DONE						  // frame compressed, raw data kept until overwritten
+} buffer_state_t;
 
 typedef struct {					  // all 15b variables to avoid struct padding
 	uint16_t designator;			  // global raw photo number taken
 	uint16_t opcode[2]; 			  // opcodes sent to take picture 	- TODO: Define in MACRO
+	uint16_t width;					  // captured width in pixels (H unless cropped)
+	uint16_t height;				  // captured height in pixels (L unless cropped)
 	uint32_t timestamp;			      // timestamp is uint32_t
-	uint16_t data[L*H];               // Image data in YCbCr 4:2:2 format
+	uint16_t data[L*H];               // Image data in YCbCr 4:2:2 format, width * height used
 } raw_photo_t;
 
 typedef struct {
 	uint8_t index;					  // index of compressed photo
+	uint8_t quality;				  // JPEG quality used: preset 1-3, or IJG quality 1-100 (compression 0 / rate control), or QT slot
+	uint8_t format;					  // JPEG_FORMAT_* flags of the stored image
+	uint16_t restarts;				  // restart intervals in the restart index, 0 = none
+	uint8_t link;					  // full image: index of its thumbnail. Thumbnail: index of its image. JPEG_NO_LINK = none
+	uint8_t changed;				  // tiles changed since the recent images (change detection), CHANGE_NOT_SCORED = none
+	uint8_t tile;					  // tiled JPEG: tile size in MCUs (8 px), one restart interval per tile and MCU row. 0 = not tiled
 	uint16_t *address;			  	  // memory address start for picture
 	uint32_t size;				 	  // size of compressed photo
 	uint32_t timestamp;				  // internal timestamp
 	uint16_t opcode[2];				  // instruction + opcode, saved in 16b to avoid padding
 } compressed_metadata_t;
 
+// compressed_metadata_t format flags
+#define JPEG_FORMAT_PROGRESSIVE			 (0x01U)							// SOF2, DC scan first
+#define JPEG_FORMAT_RESTART				 (0x02U)							// DRI/RSTn, offsets in the restart index
+#define JPEG_FORMAT_THUMBNAIL			 (0x04U)							// 1/8 scale thumbnail of the image in link
+#define JPEG_FORMAT_GRAYSCALE			 (0x08U)							// Y only, one component
+#define JPEG_FORMAT_HALF				 (0x10U)							// with THUMBNAIL: the 320x240 quick look instead of 1/8 scale
+#define JPEG_FORMAT_CUSTOM_QT			 (0x20U)							// uploaded quantization tables, quality is the slot
+#define JPEG_NO_LINK					 (0xFFU)
+#define FORMAT_CODEC_MASK				 (0xC0U)							// codec of the image, CODEC_* << 6
+#define FORMAT_CODEC_WAVELET			 (0x40U)							// wavelet.h stream, quality is the stop bit plane
+#define FORMAT_CODEC_RICE				 (0x80U)							// rice.h stream, lossless YCbCr 4:2:2
+
+// Image codecs, TAKE_PICTURE 2nd byte bits 6-7
+#define CODEC_JPEG						 (0U)
+#define CODEC_WAVELET					 (1U)
+#define CODEC_RICE						 (2U)
+#define CODEC_JPEG_GRAY					 (3U)								// JPEG of Y only
+
 #define MAX_COMPRESSED_PICS 			 (100U)
 #define COMPRESSED_METADATA_SIZE		 (10U)
 #define COMPRESSED_METADATA_BASE_ADDR 	 (RAW_PHOTO_BASE_ADDRESS) + ( NUM_BUFFERS*RAW_PHOTO_SIZE )
-#define COMPRESSED_DATA_BASE_ADDR 	     (COMPRESSED_METADATA_BASE_ADDR) + (MAX_COMPRESSED_PICS * sizeof(compressed_metadata_t))
-
-#define END_OF_MEMORY 				  	 (COMPRESSED_DATA_BASE_ADDR) + (0x7A120000U)   // Start: 0x6000_0000, Capacity: 2048M 16b addresses
+#define JPEG_TILE_MIN					 (128U)									// smallest tile of a tiled JPEG, pixels
+#define JPEG_MAX_RESTARTS				 ((L / 8U) * (H / JPEG_TILE_MIN))		// one restart interval per MCU row and tile at most
+#define RESTART_INDEX_BASE_ADDR			 (COMPRESSED_METADATA_BASE_ADDR) + (MAX_COMPRESSED_PICS * sizeof(compressed_metadata_t))
+#define COMPRESSED_DATA_BASE_ADDR 	     (RESTART_INDEX_BASE_ADDR) + (MAX_COMPRESSED_PICS * JPEG_MAX_RESTARTS * sizeof(uint32_t))
+
+#define SRAM_SIZE						 (0x00400000U)							// 4MB: 2M 16b addresses
+#define JPEG_SCRATCH_SIZE				 (0x00080000U)							// encoder work area, top of SRAM, min reserved for it
+#define JPEG_SCRATCH_ADDR				 ((RAW_PHOTO_BASE_ADDRESS) + (SRAM_SIZE) - (JPEG_SCRATCH_SIZE))
+#define END_OF_MEMORY 				  	 (JPEG_SCRATCH_ADDR)					// compressed photos end where the scratch starts
+#define JPEG_THUMB_RAW_SIZE				 ((H / 8U) * (L / 8U) * 2U)				// block averages of the last image, YCbCr 4:2:2
+#define JPEG_THUMB_RAW_ADDR				 ((JPEG_SCRATCH_ADDR) + (JPEG_SCRATCH_SIZE) - (JPEG_THUMB_RAW_SIZE))	// end of JPEG_SCRATCH
+#define JPEG_HALF_STRIP_ADDR			 (JPEG_SCRATCH_ADDR)					// 8 lines of the quick look, filled by the image encode
+#define JPEG_HALF_OUT_ADDR				 ((JPEG_HALF_STRIP_ADDR) + TJE_HALF_STRIP_SIZE(H))		// quick look JPEG, copied after the image
+#define JPEG_HALF_OUT_SIZE				 ((JPEG_THUMB_RAW_ADDR) - (JPEG_HALF_OUT_ADDR))
 
 // ----------------------------- FRAM Memory ---------------------------
 #define START_ADDR_FRAM  				 	(0x0U)
 #define PARAMETER_BYTES 					(200U)		// left for parameters that must survive power down
-#define COMPRESSED_METADATA_BASE_ADDR_FRAM	(START_ADDR_FRAM) + (PARAMETER_BYTES)
+#define CAM_TABLES_BASE_ADDR_FRAM			((START_ADDR_FRAM) + (PARAMETER_BYTES))		// camera register tables (cam_regs.h)
+#define JPEG_JOB_BASE_ADDR_FRAM				((CAM_TABLES_BASE_ADDR_FRAM) + (CAM_TABLES_FRAM_SIZE))	// background JPEG checkpoints
+#define JPEG_JOB_FRAM_SLOT_SIZE				(128U)		// magic + jpeg_job_t, two slots written in turns
+#define JPEG_QT_BASE_ADDR_FRAM				((JPEG_JOB_BASE_ADDR_FRAM) + (2U * JPEG_JOB_FRAM_SLOT_SIZE))	// uploaded quantization tables
+#define CHANGE_RING_BASE_ADDR_FRAM			((JPEG_QT_BASE_ADDR_FRAM) + (JPEG_QT_SLOTS * JPEG_QT_FRAM_SLOT_SIZE))	// change detection signatures
+#define COMPRESSED_METADATA_BASE_ADDR_FRAM	(CHANGE_RING_BASE_ADDR_FRAM) + (CHANGE_RING_SLOTS * CHANGE_FRAM_SLOT_SIZE)
 #define COMPRESSED_DATA_BASE_ADDR_FRAM	    (COMPRESSED_METADATA_BASE_ADDR_FRAM) + (MAX_COMPRESSED_PICS * sizeof(compressed_metadata_t))
 #define END_ADDR_FRAM					 	(0x7A120000U)
 
+// ------------------------- JPEG compression --------------------------
+#define JPEG_DEFAULT_QUALITY			 (75U)							// IJG scale, used for compression 0
+#define JPEG_THUMB_QUALITY				 (75U)							// IJG scale, thumbnails
+
+typedef struct {
+	uint8_t  quality;				  // IJG quality 1-100 for compression 0
+	uint16_t target_kb;				  // default size budget in KB when a command has none, 0 = off
+	uint8_t  huffman_optimize;		  // 1: two pass encode with per image Huffman tables (JPEG_SCRATCH)
+	uint8_t  progressive;			  // 1: progressive JPEG, whole image preview from the first frames sent
+	uint8_t  restart_rows;			  // MCU rows (8 lines) per restart interval, 0 = no restart markers
+	uint8_t  half_quality;			  // IJG quality of the half resolution quick look, 0 = 80x60 thumbnail instead
+	uint8_t  tile_mcus;				  // tiled JPEG, tile size in MCUs (8 px), 0 = off. Overrides restart_rows
+} jpeg_config_t;
+
+// Tiled JPEG: still one baseline JPEG, with one restart interval per tile
+// and MCU row, so the restart index is the tile index. Each interval decodes
+// on its own: the intervals of one tile, behind the header of the image with
+// its size set to the tile's and with their RST markers renumbered, are a
+// JPEG of the tile alone (JpegTile_Read). Tiles are square, numbered in
+// raster order; the last row is cut at the bottom of the image. Images whose
+// width is not a whole number of tiles are stored as usual
+typedef struct {
+	uint16_t width;					  // pixels
+	uint16_t height;
+	uint16_t columns;				  // tiles of the image
+	uint16_t rows;
+	uint16_t first;					  // restart interval of its first MCU row
+	uint16_t intervals;				  // MCU rows
+	uint16_t header;				  // bytes of the image header, up to the first interval
+	uint16_t sof;					  // offset of the SOF0 marker in the header
+	uint32_t size;					  // bytes of the tile JPEG
+} jpeg_tile_t;
+
+// Uploaded quantization tables (JPEG_QT_WRITE), picked by TAKE_PICTURE. Slot
+// 0 is the built-in tables (presets, IJG quality), 1-3 are in FRAM: magic
+// followed by 64 luma and 64 chroma quantizers (1-255), natural order. The
+// encoder tables are built once per slot (load, upload), not per image
+#define JPEG_QT_SLOTS					 (3U)
+#define JPEG_QT_FRAM_MAGIC				 (0x51U)
+#define JPEG_QT_FRAM_SLOT_SIZE			 (1U + 2U * 64U)
+#define JPEG_QT_CHUNK_VALUES			 (3U)							// quantizers per upload command
+#define JPEG_QT_CHUNK_COMMIT			 (0x1FU)						// chunk number that ends an upload
+
+// Background JPEG (COMPRESS_START): the encoder runs a few MCU rows per pass
+// of the main loop and is checkpointed to FRAM after each slice, so a reset
+// resumes the image instead of losing it
+#define JPEG_JOB_DEFAULT_ROWS			 (2U)							// MCU rows (8 lines) per slice
+#define JPEG_JOB_FRAM_MAGIC				 (0x4AU)						// checkpoint slot valid
+#define JPEG_JOB_CHECK_BYTES			 (64U)							// output bytes summed to detect a lost SRAM
+
+typedef enum {
+	JPEG_JOB_IDLE = 0,
+	JPEG_JOB_RUNNING,
+	JPEG_JOB_DONE,
+	JPEG_JOB_FAILED					  // output didn't fit, raw frame kept
+} jpeg_job_state_t;
+
+typedef struct {
+	uint8_t  state;					  // jpeg_job_state_t
+	uint8_t  resumed;				  // 1 if picked up from the FRAM checkpoint after a reset
+	uint8_t  buffer_number;
+	uint8_t  image_index;			  // compressed index the image gets, thumbnail next
+	uint16_t rows_done;				  // MCU rows encoded
+	uint16_t rows_total;
+	uint32_t size;					  // bytes written so far, final size once done
+} jpeg_job_status_t;
+
 // ------------------------- Calculation constants ---------------------
 #define BLACK_THRESHOLD_UNITS 			 (0.0079f)						// Default Y threshold for identifying black pixels
 #define DEFAULT_BLACK_THRESHOLD 		 (0.2f)						// Max allowed percentage of black pixels in an image
+#define BLACK_Y_LEVEL					 (32U)						// Y below which a preview pixel is black
+
+// --------------------------- Auto exposure ---------------------------
+// Run on every frame rejected by black filtering. Sensor response is taken
+// as linear in integration time x gain, so one step lands close to the
+// target and the next one or two refine it
+#define AE_HIST_BINS					 (64U)							// Y >> 2
+#define AE_HIST_SUBSAMPLE				 (4U)							// every 4th pixel and line of raw frames
+#define AE_TARGET_MEAN_Y				 (110U)							// mid grey, leaves headroom for bright limbs
+#define AE_TOLERANCE_Y					 (12U)							// no register writes within target +- tolerance
+#define AE_SATURATED_PERCENT			 (5U)							// above this many clipped pixels exposure is halved
+#define AE_MAX_STEP_Q8					 (8U << 8)						// max exposure ratio per step, Q8
+#define AE_MIN_STEP_Q8					 ((1U << 8) / 8U)
+#define AE_MIN_INTEGRATION				 (1U)							// lines
+#define AE_MAX_INTEGRATION				 (1200U)						// lines, about one frame - TODO: check frame length
+#define AE_GAIN_1X						 (0x20U)						// TODO: confirm gain code format against datasheet
+#define AE_MAX_GAIN						 (0x7FU)						// ~4x
+
+typedef struct {
+	uint8_t  steps;					  // register updates made during this command
+	uint8_t  mean_y;				  // mean Y of the last evaluated frame
+	uint16_t integration;			  // integration time after the last update, in lines
+	uint16_t gain;					  // gain code after the last update
+	uint8_t  at_limit;				  // 1 if the last update was clamped by a limit
+} ae_stats_t;
+
+// ------------------------- Multi-frame stacking ----------------------
+// K frames of the same scene averaged into one before compression: noise
+// drops by sqrt(K), so does the size it adds to the JPEG. Frames are merged
+// in pairs (1+2, 3+4, then both), so the raw buffers hold K = 4 at most.
+// Registration shifts each frame by whole pixel pairs and rows, found from
+// the Y profiles (row and column sums) of the frames
+#define STACK_MAX_FRAMES				 (4U)
+#define STACK_MAX_SHIFT_ROWS			 (8)							// registration search range, lines
+#define STACK_MAX_SHIFT_PAIRS			 (4)							// registration search range, pixel pairs (8 px)
+
+typedef struct {
+	uint8_t  frames;				  // frames averaged
+	int8_t   dx[STACK_MAX_FRAMES - 1U];	  // shift of each merge in pixels (even), 0 without registration
+	int8_t   dy[STACK_MAX_FRAMES - 1U];	  // shift of each merge in lines
+} stack_stats_t;
+
+// -------------------------- Change detection -------------------------
+// Signature of a full frame: mean Y of every 16x16 cell, 40x30 bytes. The
+// signatures of the last CHANGE_RING_SLOTS images that changed are kept in
+// FRAM (magic, sequence, signature), the newest one replacing the oldest. A
+// new frame is compared with each, after the global shift (pointing, +-32
+// px) and exposure offset that match best, per 64x64 tile (4x4 cells): a
+// tile changed if its cells differ by more than threshold on average. It is
+// scored against the ring entry it matches best
+#define CHANGE_CELL						 (16U)							// pixels
+#define CHANGE_COLS						 (H / CHANGE_CELL)
+#define CHANGE_ROWS						 (L / CHANGE_CELL)
+#define CHANGE_SIG_SIZE					 (CHANGE_COLS * CHANGE_ROWS)
+#define CHANGE_TILE_CELLS				 (4U)							// 64x64 pixel tiles
+#define CHANGE_TILE_COLS				 ((CHANGE_COLS + CHANGE_TILE_CELLS - 1U) / CHANGE_TILE_CELLS)
+#define CHANGE_TILE_ROWS				 ((CHANGE_ROWS + CHANGE_TILE_CELLS - 1U) / CHANGE_TILE_CELLS)	// last row 64x32
+#define CHANGE_TILES					 (CHANGE_TILE_COLS * CHANGE_TILE_ROWS)
+#define CHANGE_MASK_BYTES				 ((CHANGE_TILES + 7U) / 8U)		// bit t: tile t changed, raster order
+#define CHANGE_MAX_SHIFT				 (2)							// cells
+#define CHANGE_RING_SLOTS				 (4U)
+#define CHANGE_FRAM_MAGIC				 (0x43U)
+#define CHANGE_FRAM_SLOT_SIZE			 (2U + CHANGE_SIG_SIZE)
+#define CHANGE_NOT_SCORED				 (0xFFU)
+#define CHANGE_DEFAULT_THRESHOLD		 (12U)							// mean Y difference of a changed tile
+#define CHANGE_DEFAULT_MIN_TILES		 (2U)							// changed tiles of a changed image
+
+typedef struct {
+	uint8_t  enabled;				  // 1: every full frame compressed is scored
+	uint8_t  threshold;				  // mean Y difference of a changed tile
+	uint8_t  min_tiles;				  // an image with fewer changed tiles is unchanged: low priority, not in the ring
+	uint8_t  evict;					  // 1: TAKE_PICTURE drops unchanged frames before compression
+} change_config_t;
+
+typedef struct {
+	uint16_t designator;			  // raw photo scored
+	uint8_t  changed;				  // changed tiles, CHANGE_TILES if the ring is empty
+	uint8_t  reference;				  // ring entry matched, 1 = newest, 0 = none
+	int8_t   dx;					  // shift of the reference, in cells
+	int8_t   dy;
+	uint8_t  mask[CHANGE_MASK_BYTES];
+} change_result_t;
+
+// --------------------------- HDR bracketing --------------------------
+// Short, mid and long exposure of the same scene fused into one frame
+// (exposure fusion): every pixel pair is a weighted mean of the three,
+// each weighted by how well exposed its neighbourhood is, so highlights
+// come from the short frame and shadows from the long one. Weights are
+// smoothed over 16x16 blocks: per pixel weights flatten or even invert
+// the local contrast. The result is display ready, no tone curve after it
+#define HDR_FRAMES						 (3U)							// one per raw buffer
+#define HDR_MAX_EV						 (4U)							// bracket step, stops
+#define HDR_WEIGHT_CENTRE				 (128)							// Y of the largest weight
+#define HDR_BLOCK_PAIRS					 (8U)							// weight map block, 16x16 pixels
+#define HDR_BLOCK_LINES					 (16U)
+#define HDR_BLOCK_COLS					 ((H / 2U + HDR_BLOCK_PAIRS - 1U) / HDR_BLOCK_PAIRS)
+#define HDR_BLOCK_ROWS					 ((L + HDR_BLOCK_LINES - 1U) / HDR_BLOCK_LINES)
+#define HDR_FRAC_BITS					 (8U)							// bilinear weights: 4b vertical, 4b horizontal
+
+typedef struct {
+	uint16_t integration[HDR_FRAMES]; // short, mid, long, in lines
+	uint8_t  share[HDR_FRAMES];		  // % of the fused frame taken from each
+} hdr_stats_t;
 
 
 // Raw photo buffers
@@ -88,11 +331,15 @@ extern volatile raw_photo_t* raw_buffers[NUM_BUFFERS];
 
 // Metadata for compressed photo buffer
 extern volatile compressed_metadata_t* compressed_metadata[MAX_COMPRESSED_PICS];
+extern uint32_t* restart_index[MAX_COMPRESSED_PICS];	// per image: file offset of each restart interval
 extern          uint16_t* compressed_photo_space;
 extern          uint16_t* current_compressed_address;
 extern 			uint8_t current_compressed_index;
 
 extern volatile compressed_metadata_t* compressed_metadata_FRAM[MAX_COMPRESSED_PICS];
+
+extern change_config_t change_config;
+extern change_result_t change_results[MAX_COMPRESSED_PICS];	// per image, valid if its changed field is set
 extern uint8_t* compressed_photo_space_FRAM;
 extern uint8_t* current_compressed_address_FRAM;
 extern uint8_t current_compressed_index_FRAM;
@@ -102,10 +349,21 @@ extern volatile raw_photo_t* p;					// helper pointer to raw photo
 extern volatile uint16_t* p_raw;				// helper pointer to compressed memory spac - 16b
 extern volatile uint8_t* p_raw8;				// helper pointer to compressed memory space - 8b
 extern volatile uint8_t frame_done;
+extern volatile buffer_state_t buffer_state[NUM_BUFFERS];
+extern volatile uint8_t capturing_buffer;		// buffer currently owned by DCMI (valid while frame_done == 0)
 extern volatile uint16_t raw_photo_number_global;
 
 extern volatile uint16_t photos_taken;
 
+extern crop_window_t crop_presets[NUM_CROP_PRESETS];
+
+extern jpeg_config_t jpeg_config;
+extern jpeg_job_status_t jpeg_job_status;
+extern uint32_t jpeg_cycles_per_mcu;			// CPU cycles per 8x8 MCU of the last JPEG (DWT cycle counter)
+extern uint32_t jpeg_flat_blocks;				// 8x8 blocks of the last JPEG coded DC only, no DCT
+
+extern uint8_t preview_y[PREVIEW_L * PREVIEW_H];	// Y only preview frame, internal RAM
+
 /**********************************************************
  * Function to initialize parameters for both cameras
  * in Unsam SpaceSnap
@@ -118,17 +376,22 @@ HAL_StatusTypeDef Camera_Init(void);
  * Camera is turned on. Relevant configurations:
  * 		- YCbCr 4:2:2 output (16 bit per pixel)
  * 		- 8 bit output
- * 		TODO - Are there other configurations?
+ * Applies and verifies the camera register table
+ * (cam_regs.h) and measures the time to ready.
  **********************************************************/
 HAL_StatusTypeDef CameraConfig(uint8_t camera);
 
 /**********************************************************
- * Function to enable camera A and disable camera B
+ * Function to enable camera A and disable camera B.
+ * Configuration is skipped if A is already on and
+ * programmed.
  **********************************************************/
 void ActivateCameraA(void);
 
 /**********************************************************
- * Function to enable camera B and disable camera A
+ * Function to enable camera B and disable camera A.
+ * Configuration is skipped if B is already on and
+ * programmed.
  **********************************************************/
 void ActivateCameraB(void);
 
@@ -144,18 +407,83 @@ HAL_StatusTypeDef cam_write_reg16_uint16(uint8_t camera, uint16_t reg16, uint16_
  **********************************************************/
 HAL_StatusTypeDef cam_read_reg16_uint16(uint8_t camera, uint16_t reg16, uint16_t *out16);
 
-/**********************************************************
- * Callback function for DMA transfer of raw image
- **********************************************************/
-void HAL_DCMI_XferCpltCallback(DMA_HandleTypeDef *hdma);
-
 /**********************************************************
  * Arms DCMI capture of a single frame before requesting
  * it to the sensor through i2C and saves that frame into
  * the corresponding buffer number and the corresponding
  * frame index in that buffer
  **********************************************************/
-HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, uint8_t *opcode);
+HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop, uint8_t *opcode);
+
+/**********************************************************
+ * Non-blocking half of DCMICapture. Activates the camera,
+ * marks the buffer as BUFFER_CAPTURING and starts the
+ * DCMI + DMA transfer, returning immediately so the CPU
+ * can compress another buffer in the meantime.
+ * If crop is not NULL only that window is transferred,
+ * using the DCMI crop registers (CWSTRT/CWSIZE), and it is
+ * stored packed at the start of the buffer.
+ **********************************************************/
+HAL_StatusTypeDef DCMICaptureStart(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop);
+
+/**********************************************************
+ * Waits for the capture started by DCMICaptureStart to
+ * finish and saves the raw photo metadata. After
+ * DCMI_CAPTURE_TIMEOUT_MS the capture is stopped, the
+ * buffer freed and CAPTURE_TIMEOUT_ERR set in tx_buffer[1].
+ **********************************************************/
+HAL_StatusTypeDef DCMICaptureWait(uint8_t buffer_number, uint8_t *opcode);
+
+/**********************************************************
+ * Captures a reduced resolution (PREVIEW_H x PREVIEW_L),
+ * Y only frame straight into internal RAM (preview_y),
+ * without any FSMC writes. Used to run black filtering
+ * before committing to a full resolution capture. After
+ * DCMI_CAPTURE_TIMEOUT_MS the capture is stopped and
+ * CAPTURE_TIMEOUT_ERR set in tx_buffer[1].
+ **********************************************************/
+HAL_StatusTypeDef DCMICapturePreview(uint8_t camera_number);
+
+/**********************************************************
+ * DCMI line and frame callbacks. The frame event ends
+ * every capture, the line event decimates the lines of a
+ * preview as they arrive
+ **********************************************************/
+void HAL_DCMI_LineEventCallback(DCMI_HandleTypeDef *hdcmi);
+void HAL_DCMI_FrameEventCallback(DCMI_HandleTypeDef *hdcmi);
+
+/**********************************************************
+ * Same as ComputeBlackPercentage, on the preview frame
+ **********************************************************/
+void ComputeBlackPercentagePreview(float *result);
+
+/**********************************************************
+ * Builds a 64 bin Y histogram (Y >> 2) of the raw frame
+ * in a buffer, sampling every AE_HIST_SUBSAMPLE pixels
+ * and lines. Returns the number of samples.
+ **********************************************************/
+uint32_t ComputeYHistogram(uint32_t *hist, uint8_t buffer);
+
+/**********************************************************
+ * Same as ComputeYHistogram, on the whole preview frame
+ **********************************************************/
+uint32_t ComputeYHistogramPreview(uint32_t *hist);
+
+/**********************************************************
+ * One auto exposure step. From the Y histogram of the
+ * last frame, scales integration time x gain towards
+ * AE_TARGET_MEAN_Y, using integration time first and
+ * gain only once integration is at its maximum. Writes
+ * the new values to the sensor and to the RAM register
+ * table, so they survive a camera power cycle.
+ **********************************************************/
+HAL_StatusTypeDef AutoExposureUpdate(uint8_t camera, const uint32_t *hist, uint32_t samples, ae_stats_t *stats);
+
+/**********************************************************
+ * Checks that a crop window is aligned to CROP_UNIT and
+ * lies inside the sensor frame
+ **********************************************************/
+uint8_t CropWindowIsValid(const crop_window_t *crop);
 
 /**********************************************************
  * Computes the percentage of black pixels in the image
@@ -165,18 +493,196 @@ HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, uint
  **********************************************************/
 void ComputeBlackPercentage(float *result, uint8_t buffer);
 
+/**********************************************************
+ * Captures 2 or 4 frames of the same scene and
+ * averages them into buffer_number, ready for
+ * CompressPhoto. The other raw buffers are used as work
+ * area and left BUFFER_FREE. Each frame is captured by
+ * DMA while the CPU merges the previous ones.
+ * Merges average 4 bytes (one pixel pair) per 32b word
+ * (SWAR), rounding up in the first merges and down in the
+ * last so that K = 4 has no bias. With registration each
+ * frame is shifted onto the first one before it is
+ * averaged; pixels shifted in from outside the frame keep
+ * the value of the first frame.
+ **********************************************************/
+HAL_StatusTypeDef CaptureStacked(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop,
+								 uint8_t frames, uint8_t registration, stack_stats_t *stats, uint8_t *opcode);
+
+/**********************************************************
+ * Captures an exposure bracket and fuses it into
+ * buffer_number, ready for CompressPhoto. The mid frame
+ * uses the current integration time (auto exposure), the
+ * short and long ones ev stops (1-HDR_MAX_EV) below and
+ * above it, within the AE integration limits; gain is not
+ * changed. The integration time is restored afterwards.
+ * The other raw buffers hold the short and long frames
+ * and are left BUFFER_FREE. Frames are not registered:
+ * the bracket is taken back to back.
+ * Fusion is in place and in fixed point, in two passes
+ * over the frames: weight maps per 16x16 block, then
+ * every pixel pair blended with the weights of its
+ * block, interpolated from the neighbouring blocks.
+ **********************************************************/
+HAL_StatusTypeDef CaptureHDR(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop,
+							 uint8_t ev, hdr_stats_t *stats, uint8_t *opcode);
+
 /**********************************************************
  * Compresses raw image data from specified buffer to JPEG
  * format and stores it in compressed photo buffer area.
- * Returns the size of compressed data in bytes.
+ * Returns the size of compressed data in bytes. The buffer
+ * must hold a complete frame (not BUFFER_CAPTURING).
  * 
  * Parameters:
  *   - buffer_number: index of raw photo buffer (0-2)
- *   - quality: JPEG compression quality (1-3)
- *              1 = good, 2 = standard, 3 = poor
+ *   - quality: JPEG compression quality (0-3)
+ *              0 = IJG quality from jpeg_config (1-100)
+ *              1 = poor, 2 = standard, 3 = all quantizers 1
+ *   - target_size: size budget in bytes, 0 = none. When
+ *              set, the IJG quality is chosen by rate
+ *              control and quality is ignored
+ *   - grayscale: 1 encodes only Y, one block per MCU:
+ *              less than half the encode time
+ *   - qt_slot: uploaded quantization tables (1-3), they
+ *              replace quality and target_size. 0 = none.
+ *              Fails if the slot holds no valid tables
+ *   If jpeg_config.huffman_optimize is set, every image
+ *   gets its own Huffman tables (two pass encode), about
+ *   10-20% smaller. If jpeg_config.progressive is set, the
+ *   image is progressive (SOF2). Both modes cache the
+ *   quantized coefficients above the output, in the upper
+ *   half of the free compressed space and JPEG_SCRATCH.
+ *   With jpeg_config.restart_rows, baseline images get
+ *   restart markers and the offset of every interval is
+ *   saved in restart_index.
+ *   Every image is followed by its 80x60 thumbnail (1/8
+ *   scale, from the 8x8 block averages of the same pass),
+ *   stored as the next index. Both entries are linked.
+ *   With jpeg_config.half_quality, a one pass baseline
+ *   encode (no size budget, Huffman optimization or
+ *   progressive) stores a 320x240 quick look in place of
+ *   the thumbnail: the 2x2 averages of the same read of
+ *   the frame, encoded alongside it (flags THUMBNAIL and
+ *   HALF, restart markers like the image).
  *   - compressed_size: pointer to store resulting size
  **********************************************************/
-HAL_StatusTypeDef CompressToJPEG(uint8_t buffer_number, uint8_t quality, uint32_t *compressed_size, uint8_t *opcode);
+HAL_StatusTypeDef CompressToJPEG(uint8_t buffer_number, uint8_t quality, uint32_t target_size, uint8_t grayscale, uint8_t qt_slot, uint32_t *compressed_size, uint8_t *opcode);
+
+/**********************************************************
+ * Compresses the Y plane of a raw photo with the wavelet
+ * codec (wavelet.h, CCSDS 122.0 style) and saves it to the
+ * compressed area like CompressToJPEG, thumbnail included.
+ *
+ * Parameters:
+ *   - quality: lowest bit plane coded. 0 = lossless,
+ *              1 = poor (plane 3), 2 = standard (plane 2),
+ *              3 = good (plane 1)
+ *   - target_size: size budget in bytes, 0 = none. Every
+ *              strip is cut at its share, which only
+ *              lowers its precision
+ **********************************************************/
+HAL_StatusTypeDef CompressToWavelet(uint8_t buffer_number, uint8_t quality, uint32_t target_size, uint32_t *compressed_size, uint8_t *opcode);
+
+/**********************************************************
+ * Compresses a raw photo losslessly, all of YCbCr 4:2:2
+ * (rice.h, CCSDS 121.0 style), and saves it to the
+ * compressed area like CompressToJPEG, thumbnail included.
+ * About 3:1 on typical frames, never more than 3% above
+ * the raw size. Tools/rice_decode.py gives the raw frame
+ * back.
+ **********************************************************/
+HAL_StatusTypeDef CompressLossless(uint8_t buffer_number, uint32_t *compressed_size, uint8_t *opcode);
+
+/**********************************************************
+ * Scores a full frame (no crop) against the signatures
+ * of the recent images in FRAM, see change_result_t. The
+ * result of the last frame is kept: scoring it again is
+ * free. HAL_ERROR for a cropped frame.
+ **********************************************************/
+HAL_StatusTypeDef ChangeDetect(uint8_t buffer_number, change_result_t *result);
+
+/**********************************************************
+ * Drops the signatures of the recent images: the next
+ * frame is scored as all new.
+ **********************************************************/
+void ChangeDetect_Clear(void);
+
+/**********************************************************
+ * Compresses a raw photo with codec (CODEC_*). qt_slot
+ * is used by the JPEG codecs only. With change_config
+ * enabled the image is then scored (ChangeDetect), the
+ * result saved with it, and its signature added to the
+ * ring if it changed.
+ **********************************************************/
+HAL_StatusTypeDef CompressPhoto(uint8_t buffer_number, uint8_t codec, uint8_t quality, uint32_t target_size, uint8_t qt_slot, uint32_t *compressed_size, uint8_t *opcode);
+
+/**********************************************************
+ * Loads the uploaded quantization tables of every slot
+ * from FRAM and builds the encoder tables. A slot with no
+ * valid tables can't be picked. Call once after SPI2 is up.
+ **********************************************************/
+void JpegTables_Load(void);
+
+/**********************************************************
+ * Writes count quantizers of a slot (1-3) to FRAM, from
+ * position first (natural order) of the luma (table 0) or
+ * chroma (table 1) table. The slot can't be used until
+ * JpegTables_Commit.
+ **********************************************************/
+HAL_StatusTypeDef JpegTables_Write(uint8_t slot, uint8_t table, uint8_t first, const uint8_t *values, uint8_t count);
+
+/**********************************************************
+ * Ends the upload of a slot: builds its encoder tables
+ * and marks it valid in FRAM. HAL_ERROR if a quantizer
+ * is 0, the slot then stays unusable.
+ **********************************************************/
+HAL_StatusTypeDef JpegTables_Commit(uint8_t slot);
+
+/**********************************************************
+ * Finds a tile of a tiled JPEG (tile in raster order).
+ * HAL_ERROR if the image is not tiled or has no such tile.
+ **********************************************************/
+HAL_StatusTypeDef JpegTile_Info(uint8_t image_index, uint16_t tile, jpeg_tile_t *info);
+
+/**********************************************************
+ * Copies up to count bytes from offset of the JPEG file of
+ * a tile (JpegTile_Info) to dst. The file is not stored:
+ * it is put together from the image as it is read.
+ * Returns the bytes copied, 0 past the end of the file.
+ **********************************************************/
+uint32_t JpegTile_Read(uint8_t image_index, const jpeg_tile_t *info, uint32_t offset, uint8_t *dst, uint32_t count);
+
+/**********************************************************
+ * Starts a background JPEG compression of a raw photo and
+ * returns at once. CompressJob_Step, called from the main
+ * loop, encodes rows_per_step MCU rows at a time (0 =
+ * JPEG_JOB_DEFAULT_ROWS) between commands; once done the
+ * image and its thumbnail are saved like CompressToJPEG.
+ * Progress is in jpeg_job_status.
+ *
+ * The image is baseline with the quality, IJG quality and
+ * restart interval of CompressToJPEG: rate control, the
+ * optimized Huffman tables and progressive need the whole
+ * frame first and are not used. While the job runs no
+ * other image can be compressed (CompressPhoto fails).
+ **********************************************************/
+HAL_StatusTypeDef CompressToJPEG_Start(uint8_t buffer_number, uint8_t quality, uint8_t grayscale, uint8_t rows_per_step, uint8_t *opcode);
+
+/**********************************************************
+ * Runs one slice of the background JPEG compression, if
+ * any, and saves the encoder to FRAM. Called from the
+ * main loop while no command is pending.
+ **********************************************************/
+void CompressJob_Step(void);
+
+/**********************************************************
+ * Picks up a background JPEG compression interrupted by
+ * a reset from its last FRAM checkpoint. The raw frame
+ * and the output so far must still be in SRAM: if they
+ * are not (power loss), the checkpoint is dropped. Call
+ * once at boot, after the SRAM, SPI2 and FRAM init.
+ **********************************************************/
+void CompressJob_Resume(void);
 
 /**********************************************************
  * Allocates memory for raw photo buffers
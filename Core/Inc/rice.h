@@ -0,0 +1,51 @@
+/*
+ * rice.h - CCSDS 121.0 style lossless encoder (unit delay prediction + adaptive Rice coding)
+ *
+ *  Created on: Mar 9, 2026
+ *      Author: finazzi
+ */
+
+#ifndef __RICE_H__
+#define __RICE_H__
+
+#include "main.h"
+#include <stdint.h>
+
+// Lossless coding of the whole YCbCr 4:2:2 frame, following CCSDS 121.0-B:
+// unit delay predictor (left sample, the sample above for the first of a
+// row), prediction error mapper, then blocks of RICE_BLOCK_SIZE mapped
+// samples coded with the shortest of the options below, 3 bit option id.
+// The zero block option and reference samples are not used, so it is not a
+// compliant stream. Tools/rice_decode.py decodes it and checks a round trip.
+//
+// Stream, multi byte fields LSB first:
+//   header:  'R' '1' '2' '1', width (2B), height (2B), block size, sample bits,
+//            components (3: Y, Cb, Cr)
+//   data:    one bit stream, MSB first: planes Y (width x height), Cb and Cr
+//            (width/2 x height) in raster order, the last block of a plane
+//            padded with zeros. Zero padded to a byte at the end.
+//   options: 000 1 second extension, 001 fundamental sequence,
+//            010-110 split samples k = 1-5, 111 no compression
+
+#define RICE_BLOCK_SIZE					 (16U)								// J
+#define RICE_SAMPLE_BITS				 (8U)								// n
+#define RICE_HEADER_SIZE				 (11U)
+#define RICE_ID_BITS					 (3U)
+#define RICE_K_MAX						 (5U)								// split sample options of a 3 bit id
+#define RICE_MAX_WIDTH					 (1024U)
+
+#define RICE_ID_EXTENSION				 (0x0U)								// followed by 1: second extension
+#define RICE_ID_NO_COMPRESSION			 (0x7U)
+
+/**********************************************************
+ * Encodes a YCbCr 4:2:2 frame (even width) into dst,
+ * losslessly. The frame is read once, plane by plane.
+ * thumbnail, if not NULL, receives the 8x8 block averages
+ * as a YCbCr 4:2:2 thumbnail (see jpeg.h).
+ * Returns HAL_ERROR if the stream doesn't fit dst_size.
+ **********************************************************/
+HAL_StatusTypeDef Rice_Encode(const uint8_t *src, uint16_t width, uint16_t height,
+							  uint8_t *dst, uint32_t dst_size, uint32_t *bytes_written,
+							  uint8_t *thumbnail);
+
+#endif /* __RICE_H__ */
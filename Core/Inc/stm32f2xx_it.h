@@ -56,7 +56,11 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 /* USER CODE BEGIN EFP */
-
+void DMA2_Stream1_IRQHandler(void);
+void DCMI_IRQHandler(void);
+void DMA1_Stream7_IRQHandler(void);
+void I2C2_EV_IRQHandler(void);
+void I2C2_ER_IRQHandler(void);
 /* USER CODE END EFP */
 
 #ifdef __cplusplus
@@ -0,0 +1,59 @@
+/*
+ * wavelet.h - CCSDS 122.0 style wavelet image encoder (integer 9/7M DWT + bit plane coding)
+ *
+ *  Created on: Mar 2, 2026
+ *      Author: finazzi
+ */
+
+#ifndef __WAVELET_H__
+#define __WAVELET_H__
+
+#include "main.h"
+#include <stdint.h>
+
+// Follows the structure of CCSDS 122.0-B: 3 level integer 9/7M DWT, image
+// coded in segments, each an embedded bit plane stream that can be cut at any
+// byte. It is NOT a compliant stream: segments are strips of WAVELET_STRIP_ROWS
+// lines transformed on their own, significance is coded with an adaptive run
+// length code instead of the BPE word mapping, and only Y is coded.
+// Tools/wavelet_decode.py decodes it.
+//
+// Stream, multi byte fields LSB first:
+//   header:  'C' '1' '2' '2', width (2B), height (2B), levels, strip rows,
+//            stop plane, components (1 = Y)
+//   strips:  segment length in bytes after this field (4B), bit planes (1B),
+//            then bit planes from the top one down to the stop plane:
+//            significance pass (run length coded, sign after every new
+//            coefficient) and refinement pass (1 raw bit per coefficient).
+//            Coefficients go by subband: LL3, HL3, LH3, HH3, HL2 ... HH1
+
+#define WAVELET_LEVELS					 (3U)
+#define WAVELET_STRIP_ROWS				 (64U)								// 8 << WAVELET_LEVELS: one row of 8x8 blocks
+#define WAVELET_HEADER_SIZE				 (12U)
+#define WAVELET_SEGMENT_HEADER_SIZE		 (5U)
+#define WAVELET_RUN_K_MAX				 (15U)								// run length code parameter limit
+
+typedef struct {
+	uint32_t target_size;			  // size budget in bytes, shared by the strips by their rows. 0 = none
+	uint8_t  stop_plane;			  // lowest bit plane coded, 0 = lossless
+	uint8_t *work;					  // strip buffer, at least WAVELET_WORK_SIZE(width)
+	uint32_t work_size;
+	uint8_t *thumbnail;				  // receives LL3 as a YCbCr 4:2:2 thumbnail (see jpeg.h), NULL = none
+} wavelet_options_t;
+
+// One strip of int16 coefficients plus an int32 line
+#define WAVELET_WORK_SIZE(width)		 ((uint32_t)(width) * WAVELET_STRIP_ROWS * 2U + (uint32_t)(((width) > WAVELET_STRIP_ROWS) ? (width) : WAVELET_STRIP_ROWS) * 4U)
+
+/**********************************************************
+ * Encodes the Y plane of a YCbCr 4:2:2 frame (width and
+ * height multiple of 8) into dst. The strips are read from
+ * the frame one at a time, so only the work buffer holds
+ * coefficients. With a target size every segment is cut
+ * at its share of the budget, otherwise running out of
+ * dst is an error.
+ **********************************************************/
+HAL_StatusTypeDef Wavelet_Encode(const uint8_t *src, uint16_t width, uint16_t height,
+								 uint8_t *dst, uint32_t dst_size, uint32_t *bytes_written,
+								 const wavelet_options_t *options);
+
+#endif /* __WAVELET_H__ */
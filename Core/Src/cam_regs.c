@@ -0,0 +1,234 @@
+/*
+ * cam_regs.c - camera register tables and DMA driven i2C register sequencer
+ *
+ *  Created on: Jan 12, 2026
+ *      Author: finazzi
+ */
+
+#include "cam_regs.h"
+#include "photo.h"
+#include "i2c.h"
+#include "fram.h"
+
+// Compile-time profiles, copied to cam_tables when FRAM holds nothing valid.
+// Empty until the sensor registers are confirmed against the datasheet: the
+// sensor keeps its power-on defaults, as before the tables existed
+const cam_reg_op_t cam_profile_A[] = {
+	{ CAM_OP_END,			 0,			 0 },
+};
+
+const cam_reg_op_t cam_profile_B[] = {
+	{ CAM_OP_END,			 0,			 0 },
+};
+
+cam_reg_op_t cam_tables[NUM_CAMERAS][CAM_TABLE_MAX_OPS];
+volatile cam_config_status_t cam_config_status[NUM_CAMERAS];
+
+// Sequencer state, shared with the i2C2 interrupts
+static const cam_reg_op_t *seq_table;
+static volatile uint8_t  seq_index;
+static volatile uint8_t  seq_busy = 0;
+static volatile uint8_t  seq_waiting = 0;				// DELAY op pending, resumed from CamRegs_Apply
+static volatile uint32_t seq_wait_until;
+static volatile uint32_t seq_last_event;				// tick of last progress, for the timeout
+static volatile HAL_StatusTypeDef seq_status;
+static uint16_t seq_addr;
+static uint8_t  seq_data[2];							// DMA source, must outlive the transfer
+
+static uint32_t CamRegs_FramAddr(uint8_t camera)
+{
+	return CAM_TABLES_BASE_ADDR_FRAM + (uint32_t)camera * CAM_TABLE_FRAM_SIZE;
+}
+
+static void CamRegs_CopyProfile(uint8_t camera)
+{
+	const cam_reg_op_t *profile = (camera == 0) ? cam_profile_A : cam_profile_B;
+	uint8_t i = 0;
+
+	do {
+		cam_tables[camera][i] = profile[i];
+	} while (profile[i++].op != CAM_OP_END && i < CAM_TABLE_MAX_OPS);
+
+	cam_tables[camera][CAM_TABLE_MAX_OPS - 1].op = CAM_OP_END;		// always terminated
+}
+
+static void CamRegs_Save(uint8_t camera)
+{
+	uint32_t addr = CamRegs_FramAddr(camera);
+
+	// wExtMem_DataSet skips zero bytes, so ops are written byte by byte
+	for (uint8_t i = 0; i < CAM_TABLE_MAX_OPS; i++) {
+		const cam_reg_op_t *o = &cam_tables[camera][i];
+		uint32_t a = addr + 1U + (uint32_t)i * CAM_OP_PACKED_SIZE;
+		wExtMem(a,      o->op,                 0, 0);
+		wExtMem(a + 1U, (uint8_t)(o->reg >> 8), 0, 0);
+		wExtMem(a + 2U, (uint8_t)(o->reg     ), 0, 0);
+		wExtMem(a + 3U, (uint8_t)(o->val >> 8), 0, 0);
+		wExtMem(a + 4U, (uint8_t)(o->val     ), 0, 0);
+	}
+	wExtMem(addr, CAM_TABLE_FRAM_MAGIC, 0, 0);					// table valid only once complete
+}
+
+void CamRegs_Load(void)
+{
+	for (uint8_t camera = 0; camera < NUM_CAMERAS; camera++) {
+		uint32_t addr = CamRegs_FramAddr(camera);
+		uint8_t valid = ((uint8_t)rExtMem(addr, 0, 0) == CAM_TABLE_FRAM_MAGIC);
+
+		for (uint8_t i = 0; valid && i < CAM_TABLE_MAX_OPS; i++) {
+			uint32_t a = addr + 1U + (uint32_t)i * CAM_OP_PACKED_SIZE;
+			cam_reg_op_t *o = &cam_tables[camera][i];
+			o->op  = (uint8_t)rExtMem(a, 0, 0);
+			o->reg = (uint16_t)(((uint8_t)rExtMem(a + 1U, 0, 0) << 8) | (uint8_t)rExtMem(a + 2U, 0, 0));
+			o->val = (uint16_t)(((uint8_t)rExtMem(a + 3U, 0, 0) << 8) | (uint8_t)rExtMem(a + 4U, 0, 0));
+			if (o->op >= CAM_NUM_OPS) valid = 0;					// corrupted record
+		}
+		if (valid && cam_tables[camera][CAM_TABLE_MAX_OPS - 1].op != CAM_OP_END) valid = 0;
+
+		if (!valid) CamRegs_CopyProfile(camera);
+		cam_config_status[camera].from_fram  = valid;
+		cam_config_status[camera].configured = 0;
+	}
+}
+
+// Issues the next op of the table. Called from thread mode to start the
+// sequence and after each DELAY, and from the i2C2 interrupt otherwise
+static void CamRegs_Next(void)
+{
+	const cam_reg_op_t *o = &seq_table[seq_index];
+	seq_last_event = HAL_GetTick();
+
+	switch (o->op) {
+	case CAM_OP_WRITE:
+	case CAM_OP_WRITE_NOVERIFY:
+		seq_data[0] = (uint8_t)(o->val >> 8);					// data MSB first
+		seq_data[1] = (uint8_t)(o->val     );
+		seq_index++;
+		if (HAL_I2C_Mem_Write_DMA(&hi2c2, seq_addr, o->reg, I2C_MEMADD_SIZE_16BIT, seq_data, 2) != HAL_OK) {
+			seq_status = HAL_ERROR;
+			seq_busy = 0;
+		}
+		break;
+	case CAM_OP_DELAY:
+		seq_wait_until = HAL_GetTick() + o->val;
+		seq_index++;
+		seq_waiting = 1;
+		break;
+	default:													// END, or table full
+		seq_busy = 0;
+		break;
+	}
+}
+
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	if (hi2c->Instance != I2C2 || !seq_busy) return;
+
+	if (seq_index >= CAM_TABLE_MAX_OPS) seq_busy = 0;
+	else 								CamRegs_Next();
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+	if (hi2c->Instance != I2C2 || !seq_busy) return;
+
+	seq_status = HAL_ERROR;
+	seq_busy = 0;
+}
+
+HAL_StatusTypeDef CamRegs_Apply(uint8_t camera)
+{
+	if (camera >= NUM_CAMERAS || seq_busy) return HAL_ERROR;
+
+	seq_table   = cam_tables[camera];
+	seq_addr    = (camera == 0) ? CAM_A_I2C_ADDR : CAM_B_I2C_ADDR;
+	seq_index   = 0;
+	seq_status  = HAL_OK;
+	seq_waiting = 0;
+	seq_busy    = 1;
+	CamRegs_Next();
+
+	while (seq_busy) {
+		if (seq_waiting) {
+			if ((int32_t)(HAL_GetTick() - seq_wait_until) >= 0) {
+				seq_waiting = 0;
+				CamRegs_Next();
+			}
+		}
+		else if (HAL_GetTick() - seq_last_event > I2C_TIMEOUT_MS) {
+			// sensor stopped answering, reset i2C2 so the next sequence starts clean
+			seq_busy = 0;
+			seq_status = HAL_TIMEOUT;
+			HAL_I2C_DeInit(&hi2c2);
+			MX_I2C2_Init();
+		}
+	}
+
+	uint16_t writes = 0;
+	for (uint8_t i = 0; i < seq_index; i++) {
+		if (seq_table[i].op == CAM_OP_WRITE || seq_table[i].op == CAM_OP_WRITE_NOVERIFY) writes++;
+	}
+	cam_config_status[camera].ops_written = writes;
+
+	return seq_status;
+}
+
+HAL_StatusTypeDef CamRegs_Verify(uint8_t camera)
+{
+	if (camera >= NUM_CAMERAS) return HAL_ERROR;
+
+	uint8_t errors = 0;
+	for (uint8_t i = 0; i < CAM_TABLE_MAX_OPS && cam_tables[camera][i].op != CAM_OP_END; i++) {
+		const cam_reg_op_t *o = &cam_tables[camera][i];
+		if (o->op != CAM_OP_WRITE) continue;
+
+		uint16_t readback;
+		if (cam_read_reg16_uint16(camera, o->reg, &readback) != HAL_OK || readback != o->val) {
+			errors++;
+		}
+	}
+
+	cam_config_status[camera].verify_errors = errors;
+	return (errors == 0) ? HAL_OK : HAL_ERROR;
+}
+
+cam_reg_op_t* CamRegs_Find(uint8_t camera, uint16_t reg)
+{
+	if (camera >= NUM_CAMERAS) return NULL;
+
+	for (uint8_t i = 0; i < CAM_TABLE_MAX_OPS && cam_tables[camera][i].op != CAM_OP_END; i++) {
+		cam_reg_op_t *o = &cam_tables[camera][i];
+		if ((o->op == CAM_OP_WRITE || o->op == CAM_OP_WRITE_NOVERIFY) && o->reg == reg) return o;
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef CamRegs_SetOp(uint8_t camera, uint8_t index, uint8_t field, uint8_t op, uint16_t word)
+{
+	if (camera >= NUM_CAMERAS || index >= CAM_TABLE_MAX_OPS - 1U) return HAL_ERROR;	// last op is always END
+
+	cam_reg_op_t *o = &cam_tables[camera][index];
+	if (field == 0) {
+		if (op >= CAM_NUM_OPS) return HAL_ERROR;
+		o->op  = op;
+		o->reg = word;
+	}
+	else {
+		o->val = word;
+	}
+
+	CamRegs_Save(camera);
+	cam_config_status[camera].from_fram  = 1;
+	cam_config_status[camera].configured = 0;					// reprogrammed on next activation
+	return HAL_OK;
+}
+
+void CamRegs_RestoreDefault(uint8_t camera)
+{
+	if (camera >= NUM_CAMERAS) return;
+
+	CamRegs_CopyProfile(camera);
+	wExtMem(CamRegs_FramAddr(camera), 0x00, 0, 0);				// invalidates the saved table
+	cam_config_status[camera].from_fram  = 0;
+	cam_config_status[camera].configured = 0;
+}
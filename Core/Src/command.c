@@ -12,35 +12,121 @@
 #include "ls_comms.h"
 
 
+// A failed capture: DCMI_CAPTURE_ERR unless the capture functions already
+// put a more precise error in tx_buffer[1] (CAPTURE_TIMEOUT_ERR)
+static void ReportCaptureError(void)
+{
+	if (tx_buffer[1] == 0) tx_buffer[1] = DCMI_CAPTURE_ERR;
+}
+
+// Convergence of the exposure loop over the tries of a TAKE_PICTURE command
+static void ReportAutoExposure(uint8_t tries_rejected, const ae_stats_t *ae)
+{
+	tx_buffer[2] = tries_rejected;
+	tx_buffer[3] = ae->steps;
+	tx_buffer[4] = ae->mean_y;
+	tx_buffer[5] = (uint8_t)((ae->integration & 0x00FF)     );
+	tx_buffer[6] = (uint8_t)((ae->integration & 0xFF00) >> 8);
+	tx_buffer[7] = (uint8_t)((ae->gain & 0x00FF)     );
+	tx_buffer[8] = (uint8_t)((ae->gain & 0xFF00) >> 8);
+	tx_buffer[9] = ae->at_limit;
+}
+
+// Quality, size and format of the image just compressed
+static void ReportCompression(uint32_t compressed_size)
+{
+	// Last entry is the thumbnail (or quick look) of the image, when it has one
+	uint8_t index = current_compressed_index - 1;
+	if (compressed_metadata[index]->format & JPEG_FORMAT_THUMBNAIL) {
+		index = compressed_metadata[index]->link;
+	}
+	uint8_t  thumb		= compressed_metadata[index]->link;
+	uint32_t thumb_size = (thumb == JPEG_NO_LINK) ? 0 : compressed_metadata[thumb]->size;
+
+	tx_buffer[10] = compressed_metadata[index]->quality;
+	tx_buffer[15] = compressed_metadata[index]->format;
+	tx_buffer[11] = (uint8_t)((compressed_size & 0x000000FF)      );
+	tx_buffer[12] = (uint8_t)((compressed_size & 0x0000FF00) >> 8 );
+	tx_buffer[13] = (uint8_t)((compressed_size & 0x00FF0000) >> 16);
+	tx_buffer[14] = (uint8_t)((compressed_size & 0xFF000000) >> 24);
+	tx_buffer[16] = index;
+	tx_buffer[17] = thumb;										// JPEG_NO_LINK if no thumbnail
+	tx_buffer[18] = (uint8_t)((thumb_size & 0x00FF)     );		// thumbnails are a few KB, quick looks tens of KB
+	tx_buffer[19] = (uint8_t)((thumb_size & 0xFF00) >> 8);
+	tx_buffer[20] = compressed_metadata[index]->changed;		// CHANGE_NOT_SCORED without change detection
+}
+
+// Change detection eviction: a full frame that shows nothing new is dropped
+// before it costs a compression. Returns 1 if dropped
+static uint8_t DropUnchanged(uint8_t buffer_number)
+{
+	change_result_t change;
+	if (!change_config.enabled || !change_config.evict ||
+		ChangeDetect(buffer_number, &change) != HAL_OK ||
+		change.reference == 0 || change.changed >= change_config.min_tiles) {
+		return 0;
+	}
+	tx_buffer[20] = change.changed;
+	tx_buffer[21] = change.reference;
+	buffer_state[buffer_number] = BUFFER_FREE;
+	return 1;
+}
+
 HAL_StatusTypeDef CMD_TakePicture(uint8_t *opcode) {
 	uint8_t cam_number 		= opcode[0] & 0x01;			// 0000_0001 mask, TODO - check endianness and ordering of bytes
-	uint8_t buffer_number 	= opcode[0] & 0x06;	    	// 0000_0110 mask
+	uint8_t buffer_number 	= (opcode[0] & 0x06) >> 1;	// 0000_0110 mask
+	uint8_t crop_preset		= (opcode[0] & 0x18) >> 3;	// 0001_1000 mask - 0 is full frame
+	uint8_t use_preview		= (opcode[0] & 0x20) >> 5;	// 0010_0000 mask - filter on preview before full capture
+	uint8_t qt_slot			= (opcode[0] & 0xC0) >> 6;	// 1100_0000 mask - uploaded quantization tables, 0 = none
 	uint8_t tries 		 	= opcode[1] & 0x0F;			// 0000_1111 mask
-	uint8_t compression		= opcode[1] & 0x30;			// 0011_0000 mask
+	uint8_t compression		= (opcode[1] & 0x30) >> 4;	// 0011_0000 mask
+	uint8_t codec			= (opcode[1] & 0xC0) >> 6;	// 1100_0000 mask - CODEC_*
 	uint8_t black_filtering = opcode[2] & 0x01;			// 0000_0001 mask
-	uint8_t black_threshold = opcode[2] & 0xFE;	 		// 1111_1110 mask - 7b
-	// opcode[3] unused for this Command
+	uint8_t black_threshold = (opcode[2] & 0xFE) >> 1;	// 1111_1110 mask - 7b
+	uint8_t target_kb		= opcode[3];				// 8b - size budget in KB, 0 = jpeg_config default
 
 	float threshold_float = (float)black_threshold * (float)(BLACK_THRESHOLD_UNITS);
+	const crop_window_t *crop = (crop_preset == 0) ? NULL : &crop_presets[crop_preset];
 
 	uint8_t current_tries    = 0;
 	float   result 			 = 0.0f;
 	uint8_t success 		 = 0;
 	uint32_t compressed_size = 0;
+	uint32_t target_size	 = (uint32_t)(target_kb ? target_kb : jpeg_config.target_kb) * 1024U;
+	uint32_t hist[AE_HIST_BINS];		// Y histogram of rejected frames
+	ae_stats_t ae = { 0 };
 
 	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
 	while (current_tries < tries) {
+		if (black_filtering && use_preview) {
+			// Cheap reduced resolution check in internal RAM, full capture only once it passes
+			if (DCMICapturePreview(cam_number) != HAL_OK) {
+				ReportCaptureError();
+				return HAL_ERROR;
+			}
+			ComputeBlackPercentagePreview(&result);
+			if (result > threshold_float) {
+				current_tries++;
+				AutoExposureUpdate(cam_number, hist, ComputeYHistogramPreview(hist), &ae);	// corrects exposure before next try
+				continue;
+			}
+		}
+
 		// send take picture command to corresponding camera
-		HAL_StatusTypeDef st = DCMICapture(cam_number, buffer_number, opcode);
+		HAL_StatusTypeDef st = DCMICapture(cam_number, buffer_number, crop, opcode);
+		if (st == HAL_ERROR) {
+			ReportCaptureError();
+			return st;
+		}
 		while(!frame_done) {
 			if (st == HAL_ERROR){
-				tx_buffer[1] = DCMI_CAPTURE_ERR;
+				ReportCaptureError();
 				return st;
 			}
 			// wait for frame - TODO: Implement timeout
 		}
 
-		if(black_filtering == 0) { // no black filtering
+		if(black_filtering == 0 || use_preview) { // no black filtering, or already done on preview
 			success = 1;
 			break;
 		}
@@ -53,15 +139,24 @@ HAL_StatusTypeDef CMD_TakePicture(uint8_t *opcode) {
 			break;	// picture accepted
 		}
 		current_tries++;
+		AutoExposureUpdate(cam_number, hist, ComputeYHistogram(hist, buffer_number), &ae);	// corrects exposure before next try
+	}
+	ReportAutoExposure(current_tries, &ae);
+
+	if (success && DropUnchanged(buffer_number)) {
+		tx_buffer[1] = UNCHANGED_SCENE_ERR;
+		return HAL_ERROR;
 	}
 
 	if(success) {
-		HAL_StatusTypeDef st = CompressToJPEG(buffer_number, compression, &compressed_size, opcode); 	// compresses and saves compressed image to current index addres in SRAM
+		HAL_StatusTypeDef st = CompressPhoto(buffer_number, codec, compression, target_size, qt_slot, &compressed_size, opcode); 	// compresses and saves compressed image to current index addres in SRAM
 		if(st == HAL_ERROR) {
 			tx_buffer[1] = COMPRESSION_ERR;
 			return st;
 		}
 
+		ReportCompression(compressed_size);
+
 		// Save a version of compressed picture to FRAM - TODO
 
 		// TODO - something else in return buffer?
@@ -75,19 +170,27 @@ HAL_StatusTypeDef CMD_TakePicture(uint8_t *opcode) {
 
 HAL_StatusTypeDef CMD_TakePictureDelayed(uint8_t *opcode) {
 	uint8_t cam_number 		= opcode[0] & 0x01;			// 0000_0001 mask, TODO - check endianness and ordering of bytes
-	uint8_t buffer_number 	= opcode[0] & 0x06;	    	// 0000_0110 mask
+	uint8_t buffer_number 	= (opcode[0] & 0x06) >> 1;	// 0000_0110 mask
+	uint8_t crop_preset		= (opcode[0] & 0x18) >> 3;	// 0001_1000 mask - 0 is full frame
+	uint8_t use_preview		= (opcode[0] & 0x20) >> 5;	// 0010_0000 mask - filter on preview before full capture
+	uint8_t qt_slot			= (opcode[0] & 0xC0) >> 6;	// 1100_0000 mask - uploaded quantization tables, 0 = none
 	uint8_t tries 		 	= opcode[1] & 0x0F;			// 0000_1111 mask
-	uint8_t compression		= opcode[1] & 0x30;			// 0011_0000 mask
+	uint8_t compression		= (opcode[1] & 0x30) >> 4;	// 0011_0000 mask
+	uint8_t codec			= (opcode[1] & 0xC0) >> 6;	// 1100_0000 mask - CODEC_*
 	uint8_t black_filtering = opcode[2] & 0x01;			// 0000_0001 mask
-	uint8_t black_threshold = opcode[2] & 0xFE;	 		// 1111_1110 mask - 7b
+	uint8_t black_threshold = (opcode[2] & 0xFE) >> 1;	// 1111_1110 mask - 7b
 	uint8_t delay 			= opcode[3]       ;	 		// 8b - Delay in 5 minute increments for photo capture
 
 	float threshold_float = (float)black_threshold * (float)(BLACK_THRESHOLD_UNITS);
+	const crop_window_t *crop = (crop_preset == 0) ? NULL : &crop_presets[crop_preset];
 
 	uint8_t current_tries    = 0;
 	float   result 			 = 0.0f;
 	uint8_t success 		 = 0;
 	uint32_t compressed_size = 0;
+	uint32_t target_size	 = (uint32_t)jpeg_config.target_kb * 1024U;
+	uint32_t hist[AE_HIST_BINS];		// Y histogram of rejected frames
+	ae_stats_t ae = { 0 };
 
 	uint8_t real_tries = 9 * tries;				// Max. 256 tries of picture capture - This is executed while satellite is not over GS, so we might want many tries
 	uint32_t delay_ms = 300 * delay * 1000;	    // Delay has a resolution of 5 minutes
@@ -97,17 +200,35 @@ HAL_StatusTypeDef CMD_TakePictureDelayed(uint8_t *opcode) {
 
 	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
 	while (current_tries < real_tries) {
+		if (black_filtering && use_preview) {
+			// Cheap reduced resolution check in internal RAM, full capture only once it passes
+			if (DCMICapturePreview(cam_number) != HAL_OK) {
+				ReportCaptureError();
+				return HAL_ERROR;
+			}
+			ComputeBlackPercentagePreview(&result);
+			if (result > threshold_float) {
+				current_tries++;
+				AutoExposureUpdate(cam_number, hist, ComputeYHistogramPreview(hist), &ae);	// corrects exposure before next try
+				continue;
+			}
+		}
+
 		// send take picture command to corresponding camera
-		HAL_StatusTypeDef st = DCMICapture(cam_number, buffer_number, opcode);
+		HAL_StatusTypeDef st = DCMICapture(cam_number, buffer_number, crop, opcode);
+		if (st == HAL_ERROR) {
+			ReportCaptureError();
+			return st;
+		}
 		while(!frame_done) {
 			if (st == HAL_ERROR){
-				tx_buffer[1] = DCMI_CAPTURE_ERR;
+				ReportCaptureError();
 				return st;
 			}
 			// wait for frame - TODO: Implement timeout
 		}
 
-		if(black_filtering == 0) { // no black filtering
+		if(black_filtering == 0 || use_preview) { // no black filtering, or already done on preview
 			success = 1;
 			break;
 		}
@@ -120,15 +241,24 @@ HAL_StatusTypeDef CMD_TakePictureDelayed(uint8_t *opcode) {
 			break;	// picture accepted
 		}
 		current_tries++;
+		AutoExposureUpdate(cam_number, hist, ComputeYHistogram(hist, buffer_number), &ae);	// corrects exposure before next try
+	}
+	ReportAutoExposure(current_tries, &ae);
+
+	if (success && DropUnchanged(buffer_number)) {
+		tx_buffer[1] = UNCHANGED_SCENE_ERR;
+		return HAL_ERROR;
 	}
 
 	if(success) {
-		HAL_StatusTypeDef st = CompressToJPEG(buffer_number, compression, &compressed_size, opcode); 	// compresses and saves compressed image to current index addres in SRAM
+		HAL_StatusTypeDef st = CompressPhoto(buffer_number, codec, compression, target_size, qt_slot, &compressed_size, opcode); 	// compresses and saves compressed image to current index addres in SRAM
 		if(st == HAL_ERROR) {
 			tx_buffer[1] = COMPRESSION_ERR;
 			return st;
 		}
 
+		ReportCompression(compressed_size);
+
 		// Save a version of compressed picture to FRAM - TODO
 
 		// TODO - something else in return buffer?
@@ -140,6 +270,351 @@ HAL_StatusTypeDef CMD_TakePictureDelayed(uint8_t *opcode) {
 	return HAL_ERROR;
 }
 
+HAL_StatusTypeDef CMD_TakePicturePair(uint8_t *opcode) {
+	uint8_t first_cam		= opcode[0] & 0x01;			// 0000_0001 mask
+	uint8_t first_buffer	= (opcode[0] & 0x06) >> 1;	// 0000_0110 mask
+	uint8_t second_buffer	= (opcode[0] & 0x18) >> 3;	// 0001_1000 mask
+	uint8_t compression		= (opcode[1] & 0x30) >> 4;	// 0011_0000 mask
+	uint8_t codec			= (opcode[1] & 0xC0) >> 6;	// 1100_0000 mask - CODEC_*
+	uint8_t qt_slot			= opcode[2] & 0x03;			// 0000_0011 mask - uploaded quantization tables, 0 = none
+	// opcode[3] unused for this Command
+
+	uint8_t second_cam = first_cam ^ 0x01;				// the other camera
+	uint32_t compressed_size = 0;
+	uint32_t target_size = (uint32_t)jpeg_config.target_kb * 1024U;
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (first_buffer >= NUM_BUFFERS || second_buffer >= NUM_BUFFERS || first_buffer == second_buffer) {
+		return HAL_ERROR;
+	}
+
+	// First frame has nothing to overlap with
+	if (DCMICapture(first_cam, first_buffer, NULL, opcode) != HAL_OK) {
+		ReportCaptureError();
+		return HAL_ERROR;
+	}
+
+	// Second camera fills its buffer through DMA while the CPU encodes the first one
+	if (DCMICaptureStart(second_cam, second_buffer, NULL) != HAL_OK) {
+		ReportCaptureError();
+		return HAL_ERROR;
+	}
+
+	HAL_StatusTypeDef st_first = CompressPhoto(first_buffer, codec, compression, target_size, qt_slot, &compressed_size, opcode);
+
+	if (DCMICaptureWait(second_buffer, opcode) != HAL_OK) {
+		ReportCaptureError();
+		return HAL_ERROR;
+	}
+	if (st_first != HAL_OK) {
+		tx_buffer[1] = COMPRESSION_ERR;
+		return HAL_ERROR;
+	}
+
+	if (CompressPhoto(second_buffer, codec, compression, target_size, qt_slot, &compressed_size, opcode) != HAL_OK) {
+		tx_buffer[1] = COMPRESSION_ERR;
+		return HAL_ERROR;
+	}
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_TakePictureStacked(uint8_t *opcode) {
+	uint8_t cam_number		= opcode[0] & 0x01;			// 0000_0001 mask
+	uint8_t buffer_number	= (opcode[0] & 0x06) >> 1;	// 0000_0110 mask
+	uint8_t crop_preset		= (opcode[0] & 0x18) >> 3;	// 0001_1000 mask - 0 is full frame
+	uint8_t four_frames		= (opcode[0] & 0x20) >> 5;	// 0010_0000 mask - 0: 2 frames, 1: 4 frames
+	uint8_t registration	= (opcode[0] & 0x40) >> 6;	// 0100_0000 mask
+	uint8_t qt_slot			= opcode[1] & 0x03;			// 0000_0011 mask - uploaded quantization tables, 0 = none
+	uint8_t compression		= (opcode[1] & 0x30) >> 4;	// 0011_0000 mask
+	uint8_t codec			= (opcode[1] & 0xC0) >> 6;	// 1100_0000 mask - CODEC_*
+	uint8_t target_kb		= opcode[3];				// 8b - size budget in KB, 0 = jpeg_config default
+	// opcode[2] unused for this Command
+
+	const crop_window_t *crop = (crop_preset == 0) ? NULL : &crop_presets[crop_preset];
+	uint32_t compressed_size = 0;
+	uint32_t target_size	 = (uint32_t)(target_kb ? target_kb : jpeg_config.target_kb) * 1024U;
+	stack_stats_t stack;
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (CaptureStacked(cam_number, buffer_number, crop, four_frames ? 4U : 2U, registration, &stack, opcode) != HAL_OK) {
+		ReportCaptureError();
+		return HAL_ERROR;
+	}
+	tx_buffer[2] = stack.frames;
+	for (uint8_t i = 0; i < STACK_MAX_FRAMES - 1U; i++) {
+		tx_buffer[3 + 2 * i] = (uint8_t)stack.dx[i];
+		tx_buffer[4 + 2 * i] = (uint8_t)stack.dy[i];
+	}
+
+	if (CompressPhoto(buffer_number, codec, compression, target_size, qt_slot, &compressed_size, opcode) != HAL_OK) {
+		tx_buffer[1] = COMPRESSION_ERR;
+		return HAL_ERROR;
+	}
+	ReportCompression(compressed_size);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_TakePictureHDR(uint8_t *opcode) {
+	uint8_t cam_number		= opcode[0] & 0x01;			// 0000_0001 mask
+	uint8_t buffer_number	= (opcode[0] & 0x06) >> 1;	// 0000_0110 mask
+	uint8_t crop_preset		= (opcode[0] & 0x18) >> 3;	// 0001_1000 mask - 0 is full frame
+	uint8_t ev				= ((opcode[0] & 0x60) >> 5) + 1U;	// 0110_0000 mask - bracket step, 1-4 stops
+	uint8_t qt_slot			= opcode[1] & 0x03;			// 0000_0011 mask - uploaded quantization tables, 0 = none
+	uint8_t compression		= (opcode[1] & 0x30) >> 4;	// 0011_0000 mask
+	uint8_t codec			= (opcode[1] & 0xC0) >> 6;	// 1100_0000 mask - CODEC_*
+	uint8_t target_kb		= opcode[3];				// 8b - size budget in KB, 0 = jpeg_config default
+	// opcode[2] unused for this Command
+
+	const crop_window_t *crop = (crop_preset == 0) ? NULL : &crop_presets[crop_preset];
+	uint32_t compressed_size = 0;
+	uint32_t target_size	 = (uint32_t)(target_kb ? target_kb : jpeg_config.target_kb) * 1024U;
+	hdr_stats_t hdr;
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (CaptureHDR(cam_number, buffer_number, crop, ev, &hdr, opcode) != HAL_OK) {
+		ReportCaptureError();
+		return HAL_ERROR;
+	}
+	for (uint8_t i = 0; i < HDR_FRAMES; i++) {
+		tx_buffer[2 + 2 * i] = (uint8_t)((hdr.integration[i] & 0x00FF)     );
+		tx_buffer[3 + 2 * i] = (uint8_t)((hdr.integration[i] & 0xFF00) >> 8);
+	}
+	tx_buffer[8] = hdr.share[0];
+	tx_buffer[9] = hdr.share[2];
+
+	if (CompressPhoto(buffer_number, codec, compression, target_size, qt_slot, &compressed_size, opcode) != HAL_OK) {
+		tx_buffer[1] = COMPRESSION_ERR;
+		return HAL_ERROR;
+	}
+	ReportCompression(compressed_size);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_SetCropPreset(uint8_t *opcode) {
+	uint8_t preset = opcode[0] & 0x03;					// 0000_0011 mask
+	crop_window_t window;
+	window.y0     = ((opcode[0] & 0xFC) >> 2) * CROP_UNIT;	// 1111_1100 mask - 6b
+	window.x0     = (opcode[1] & 0x7F) * CROP_UNIT;		// 0111_1111 mask - 7b
+	window.width  = (opcode[2] & 0x7F) * CROP_UNIT;		// 0111_1111 mask - 7b
+	window.height = (opcode[3] & 0x7F) * CROP_UNIT;		// 0111_1111 mask - 7b
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (preset == 0 || !CropWindowIsValid(&window)) {	// preset 0 stays full frame
+		return HAL_ERROR;
+	}
+
+	crop_presets[preset] = window;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_SetJpegConfig(uint8_t *opcode) {
+	uint8_t  quality   = opcode[0];
+	uint16_t target_kb = (opcode[2] << 8) | opcode[1];
+	uint8_t  huffman   = opcode[3] & 0x01;				// 0000_0001 mask
+	uint8_t  progressive = (opcode[3] & 0x02) >> 1;		// 0000_0010 mask
+	uint8_t  restart_rows = (opcode[3] & 0xFC) >> 2;	// 1111_1100 mask - 6b
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (quality < 1 || quality > 100) {
+		return HAL_ERROR;
+	}
+
+	jpeg_config.quality   = quality;
+	jpeg_config.target_kb = target_kb;
+	jpeg_config.huffman_optimize = huffman;
+	jpeg_config.progressive = progressive;
+	jpeg_config.restart_rows = restart_rows;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_SetJpegQuicklook(uint8_t *opcode) {
+	uint8_t quality = opcode[0];						// IJG quality, 0 = off
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (quality > 100) {
+		return HAL_ERROR;
+	}
+
+	jpeg_config.half_quality = quality;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_SetJpegTiles(uint8_t *opcode) {
+	uint8_t tile_mcus = opcode[0];						// tile size in MCUs (8 px), 0 = off
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (tile_mcus != 0 && (tile_mcus < JPEG_TILE_MIN / 8U || tile_mcus > H / 8U)) {
+		return HAL_ERROR;
+	}
+
+	jpeg_config.tile_mcus = tile_mcus;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_SetChangeDetect(uint8_t *opcode) {
+	uint8_t enabled	  = opcode[0] & 0x01;					// 0000_0001 mask
+	uint8_t evict	  = (opcode[0] & 0x02) >> 1;			// 0000_0010 mask
+	uint8_t clear	  = (opcode[0] & 0x04) >> 2;			// 0000_0100 mask - drops the recent signatures
+	uint8_t threshold = opcode[1];							// 8b - 0 = default
+	uint8_t min_tiles = opcode[2];							// 8b - 0 = default
+	// opcode[3] unused for this Command
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (min_tiles > CHANGE_TILES) {
+		return HAL_ERROR;
+	}
+
+	change_config.enabled	= enabled;
+	change_config.evict		= evict;
+	change_config.threshold = threshold ? threshold : CHANGE_DEFAULT_THRESHOLD;
+	change_config.min_tiles = min_tiles ? min_tiles : CHANGE_DEFAULT_MIN_TILES;
+	if (clear) {
+		ChangeDetect_Clear();
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_GetChangeMask(uint8_t *opcode) {
+	uint8_t index_number = opcode[0];
+	// opcode[1], opcode[2] and opcode[3] unused for this Command
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (index_number >= current_compressed_index) {
+		return HAL_ERROR;
+	}
+
+	const change_result_t *change = &change_results[index_number];
+	tx_buffer[1] = compressed_metadata[index_number]->changed;
+	if (tx_buffer[1] == CHANGE_NOT_SCORED) {
+		return HAL_OK;
+	}
+	tx_buffer[2] = CHANGE_TILE_COLS;
+	tx_buffer[3] = CHANGE_TILE_ROWS;
+	tx_buffer[4] = change->reference;
+	tx_buffer[5] = (uint8_t)change->dx;
+	tx_buffer[6] = (uint8_t)change->dy;
+	memcpy(&tx_buffer[7], change->mask, CHANGE_MASK_BYTES);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_JpegTableWrite(uint8_t *opcode) {
+	uint8_t slot  = opcode[0] & 0x03;					// 0000_0011 mask
+	uint8_t table = (opcode[0] & 0x04) >> 2;			// 0000_0100 mask - 0: luma, 1: chroma
+	uint8_t chunk = (opcode[0] & 0xF8) >> 3;			// 1111_1000 mask
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (chunk == JPEG_QT_CHUNK_COMMIT) {
+		return JpegTables_Commit(slot);
+	}
+
+	return JpegTables_Write(slot, table, chunk * JPEG_QT_CHUNK_VALUES, &opcode[1], JPEG_QT_CHUNK_VALUES);
+}
+
+HAL_StatusTypeDef CMD_CameraTableWrite(uint8_t *opcode) {
+	uint8_t  cam_number = opcode[0] & 0x01;				// 0000_0001 mask
+	uint8_t  field		= (opcode[0] & 0x02) >> 1;		// 0000_0010 mask - 0: op + register, 1: value
+	uint8_t  index		= (opcode[0] & 0x7C) >> 2;		// 0111_1100 mask
+	uint8_t  restore	= (opcode[0] & 0x80) >> 7;		// 1000_0000 mask
+	uint8_t  op			= opcode[1];
+	uint16_t word		= (opcode[3] << 8) | opcode[2];
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (restore) {
+		CamRegs_RestoreDefault(cam_number);
+		return HAL_OK;
+	}
+
+	return CamRegs_SetOp(cam_number, index, field, op, word);
+}
+
+HAL_StatusTypeDef CMD_CameraConfigStatus(uint8_t *opcode) {
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+
+	for (uint8_t cam = 0; cam < NUM_CAMERAS; cam++) {
+		uint8_t *b = &tx_buffer[1 + 9 * cam];
+		uint32_t ready_ms = cam_config_status[cam].ready_ms;
+		uint16_t writes   = cam_config_status[cam].ops_written;
+		b[0] = (uint8_t)((ready_ms & 0x000000FF)      );
+		b[1] = (uint8_t)((ready_ms & 0x0000FF00) >> 8 );
+		b[2] = (uint8_t)((ready_ms & 0x00FF0000) >> 16);
+		b[3] = (uint8_t)((ready_ms & 0xFF000000) >> 24);
+		b[4] = (uint8_t)((writes & 0x00FF)     );
+		b[5] = (uint8_t)((writes & 0xFF00) >> 8);
+		b[6] = cam_config_status[cam].verify_errors;
+		b[7] = cam_config_status[cam].from_fram;
+		b[8] = cam_config_status[cam].configured;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_GetRestartIndex(uint8_t *opcode) {
+	uint8_t  index_number = opcode[0];
+	uint16_t first		  = (opcode[2] << 8) | opcode[1];	// first restart interval to send
+	// opcode[3] unused for this Command
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	if (index_number >= current_compressed_index) {
+		return HAL_ERROR;
+	}
+
+	uint16_t restarts = compressed_metadata[index_number]->restarts;
+	tx_buffer[1] = (uint8_t)((restarts & 0x00FF)     );
+	tx_buffer[2] = (uint8_t)((restarts & 0xFF00) >> 8);
+	tx_buffer[3] = (uint8_t)((first & 0x00FF)     );
+	tx_buffer[4] = (uint8_t)((first & 0xFF00) >> 8);
+	for (uint8_t i = 0; i < RESTART_OFFSETS_PER_FRAME && first + i < restarts; i++) {
+		uint32_t offset = restart_index[index_number][first + i];
+		uint8_t *b = &tx_buffer[5 + 4 * i];
+		b[0] = (uint8_t)((offset & 0x000000FF)      );
+		b[1] = (uint8_t)((offset & 0x0000FF00) >> 8 );
+		b[2] = (uint8_t)((offset & 0x00FF0000) >> 16);
+		b[3] = (uint8_t)((offset & 0xFF000000) >> 24);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CMD_CompressStart(uint8_t *opcode) {
+	uint8_t buffer_number = opcode[0] & 0x03;			// 0000_0011 mask
+	uint8_t compression	  = (opcode[0] & 0x0C) >> 2;	// 0000_1100 mask
+	uint8_t grayscale	  = (opcode[0] & 0x10) >> 4;	// 0001_0000 mask
+	uint8_t rows_per_step = opcode[1];					// 8b - MCU rows per slice, 0 = default
+	// opcode[2] and opcode[3] unused for this Command
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	HAL_StatusTypeDef st = CompressToJPEG_Start(buffer_number, compression, grayscale, rows_per_step, opcode);
+	tx_buffer[1] = jpeg_job_status.image_index;
+	return st;
+}
+
+HAL_StatusTypeDef CMD_CompressStatus(uint8_t *opcode) {
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+
+	tx_buffer[1]  = jpeg_job_status.state;
+	tx_buffer[2]  = jpeg_job_status.resumed;
+	tx_buffer[3]  = jpeg_job_status.buffer_number;
+	tx_buffer[4]  = jpeg_job_status.image_index;
+	tx_buffer[5]  = (uint8_t)((jpeg_job_status.rows_done & 0x00FF)      );
+	tx_buffer[6]  = (uint8_t)((jpeg_job_status.rows_done & 0xFF00) >> 8 );
+	tx_buffer[7]  = (uint8_t)((jpeg_job_status.rows_total & 0x00FF)     );
+	tx_buffer[8]  = (uint8_t)((jpeg_job_status.rows_total & 0xFF00) >> 8);
+	tx_buffer[9]  = (uint8_t)((jpeg_job_status.size & 0x000000FF)      );
+	tx_buffer[10] = (uint8_t)((jpeg_job_status.size & 0x0000FF00) >> 8 );
+	tx_buffer[11] = (uint8_t)((jpeg_job_status.size & 0x00FF0000) >> 16);
+	tx_buffer[12] = (uint8_t)((jpeg_job_status.size & 0xFF000000) >> 24);
+	tx_buffer[13] = (uint8_t)((jpeg_cycles_per_mcu & 0x000000FF)      );
+	tx_buffer[14] = (uint8_t)((jpeg_cycles_per_mcu & 0x0000FF00) >> 8 );
+	tx_buffer[15] = (uint8_t)((jpeg_cycles_per_mcu & 0x00FF0000) >> 16);
+	tx_buffer[16] = (uint8_t)((jpeg_cycles_per_mcu & 0xFF000000) >> 24);
+	tx_buffer[17] = (uint8_t)((jpeg_flat_blocks & 0x000000FF)      );
+	tx_buffer[18] = (uint8_t)((jpeg_flat_blocks & 0x0000FF00) >> 8 );
+	tx_buffer[19] = (uint8_t)((jpeg_flat_blocks & 0x00FF0000) >> 16);
+	tx_buffer[20] = (uint8_t)((jpeg_flat_blocks & 0xFF000000) >> 24);
+	return HAL_OK;
+}
+
 // ===== Example Handlers =====
 HAL_StatusTypeDef CMD_TransmitFrameCompressed(uint8_t *opcode) {
 	uint8_t  index_number 	=  opcode[0];
@@ -169,6 +644,8 @@ HAL_StatusTypeDef CMD_TransmitFrameCompressed(uint8_t *opcode) {
 	tx_buffer[10] = (uint8_t)((metadata.timestamp & 0x0000FF00) >> 8 );
 	tx_buffer[11] = (uint8_t)((metadata.timestamp & 0x00FF0000) >> 16);
 	tx_buffer[12] = (uint8_t)((metadata.timestamp & 0xFF000000) >> 24);
+	tx_buffer[13] = metadata.format;
+	tx_buffer[14] = metadata.link;				// thumbnail <-> full image
 
 	// Fill remaining 100 Bytes with requested frame
 	for(uint8_t i = 19; i < (DATA_FRAME_SIZE - 19); i+=2) {
@@ -183,6 +660,36 @@ HAL_StatusTypeDef CMD_TransmitFrameCompressed(uint8_t *opcode) {
 
 }
 
+HAL_StatusTypeDef CMD_TransmitTile(uint8_t *opcode) {
+	uint8_t  index_number = opcode[0];
+	uint8_t  tile		  = opcode[1];
+	uint16_t frame_number = (opcode[3] << 8) | opcode[2];
+
+	FillTxBufferWithZeroes();		// Fills Tx buffer with zeroes
+	jpeg_tile_t info;
+	if (JpegTile_Info(index_number, tile, &info) != HAL_OK) {
+		return HAL_ERROR;
+	}
+
+	uint32_t bytes = JpegTile_Read(index_number, &info, (uint32_t)frame_number * TILE_FRAME_BYTES, &tx_buffer[19], TILE_FRAME_BYTES);
+	tx_buffer[0]  = index_number;
+	tx_buffer[1]  = tile;
+	tx_buffer[2]  = (uint8_t)((info.width & 0x00FF)     );
+	tx_buffer[3]  = (uint8_t)((info.width & 0xFF00) >> 8);
+	tx_buffer[4]  = (uint8_t)((info.height & 0x00FF)     );
+	tx_buffer[5]  = (uint8_t)((info.height & 0xFF00) >> 8);
+	tx_buffer[6]  = (uint8_t)((info.size & 0x000000FF)      );
+	tx_buffer[7]  = (uint8_t)((info.size & 0x0000FF00) >> 8 );
+	tx_buffer[8]  = (uint8_t)((info.size & 0x00FF0000) >> 16);
+	tx_buffer[9]  = (uint8_t)((info.size & 0xFF000000) >> 24);
+	tx_buffer[10] = (uint8_t)((frame_number & 0x00FF)     );
+	tx_buffer[11] = (uint8_t)((frame_number & 0xFF00) >> 8);
+	tx_buffer[12] = (uint8_t)info.columns;
+	tx_buffer[13] = (uint8_t)info.rows;
+	tx_buffer[14] = (uint8_t)bytes;
+	return HAL_OK;
+}
+
 HAL_StatusTypeDef CMD_TransmitFrameRaw(uint8_t *opcode) {
 	uint8_t  buffer_number 	=  opcode[0];
 	uint16_t frame_number 	= (opcode[2] << 8) | opcode[1];
@@ -275,8 +782,56 @@ const command_t command_table[NUM_COMMANDS] = {
 																		"and saves a copy to non-volatile buffer. Compresses the photo and saves it "
 																		"to volatile and non-volatile memory.", 1, 24 * 60 * 1000 }, 	// TODO - See timeout for this one
 
+	{ "TAKE_PICTURE_PAIR", 0x3A, CMD_TakePicturePair,					"Captures one image with each camera (stereo / dual FOV). The second camera "
+																		"captures while the first image is being compressed. No black filtering.", 1, 30000 },
+
+	{ "TAKE_PICTURE_STACKED", 0x44, CMD_TakePictureStacked,				"Captures 2 or 4 frames, averages them (optionally registered) into one "
+																		"and compresses it: less noise for low light scenes", 1, 20000 },
+
+	{ "TAKE_PICTURE_HDR", 0x45, CMD_TakePictureHDR,						"Captures a short, mid and long exposure and fuses them into one "
+																		"frame before compressing it: high contrast scenes", 1, 20000 },
+
+	{ "SET_CROP_PRESET", 0x3B, CMD_SetCropPreset,						"Sets the region of interest window of a crop preset (1-3) used by "
+																		"TAKE_PICTURE. Coordinates in 8 pixel units.", 1, 20000 },
+
+	{ "SET_JPEG_CONFIG", 0x3E, CMD_SetJpegConfig,						"Sets the IJG quality (1-100) used by compression 0 and the default "
+																		"compressed size budget", 1, 20000 },
+
+	{ "SET_JPEG_QUICKLOOK", 0x42, CMD_SetJpegQuicklook,					"Sets the IJG quality of the 320x240 quick look stored with every JPEG "
+																		"in place of the thumbnail, 0 = off", 1, 20000 },
+
+	{ "SET_JPEG_TILES", 0x48, CMD_SetJpegTiles,							"Sets the tile size of tiled JPEGs (restart interval per tile), "
+																		"0 = off", 1, 20000 },
+
+	{ "SET_CHANGE_DETECT", 0x46, CMD_SetChangeDetect,					"Turns change detection against the recent images on/off, sets its "
+																		"thresholds and whether unchanged frames are dropped", 1, 20000 },
+
+	{ "GET_CHANGE_MASK", 0x47, CMD_GetChangeMask,						"Transmits which 64x64 tiles of a compressed image changed since the "
+																		"recent images", 1, 20000 },
+
+	{ "JPEG_TABLE_WRITE", 0x43, CMD_JpegTableWrite,						"Uploads 3 quantizers of a JPEG quantization table slot, saved in FRAM "
+																		"and picked by TAKE_PICTURE", 1, 20000 },
+
+	{ "CAMERA_TABLE_WRITE", 0x3C, CMD_CameraTableWrite,					"Uploads one op of a camera register table, saved in FRAM and applied "
+																		"on the next camera power-on", 1, 20000 },
+
+	{ "CAMERA_CONFIG_STATUS", 0x3D, CMD_CameraConfigStatus,				"Transmits time to ready and verification result of the last "
+																		"configuration of each camera", 0, 20000 },
+
+	{ "GET_RESTART_INDEX", 0x3F, CMD_GetRestartIndex,					"Transmits the byte offsets of the JPEG restart intervals of a "
+																		"compressed image", 1, 20000 },
+
+	{ "COMPRESS_START", 0x40, CMD_CompressStart,						"Starts a background JPEG compression of a raw buffer, encoded "
+																		"between commands", 1, 20000 },
+
+	{ "COMPRESS_STATUS", 0x41, CMD_CompressStatus,						"Transmits the progress of the background JPEG compression and "
+																		"the encode cycles per MCU and flat blocks", 0, 20000 },
+
     { "TRANSMIT_FRAME_COMPRESSED", 0x35, CMD_TransmitFrameCompressed, 	"Transmits a 110B frame of a compressed image with a certain index", 1, 20000 },
 
+	{ "TRANSMIT_TILE", 0x49, CMD_TransmitTile,							"Transmits an 80B frame of one tile of a tiled JPEG, as a JPEG of "
+																		"the tile alone", 1, 20000 },
+
     { "TRANSMIT_FRAME_RAW", 0x36, CMD_TransmitFrameRaw, 			    "Transmits a 110B frame of a raw image in a certain buffer", 1, 20000 },
 
 	{ "CURRENT_MEMORY_STATE", 0x37, CMD_MemoryState, 			    	"Transmits compressed image metadata to know how many images are saved and "
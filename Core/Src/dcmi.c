@@ -25,6 +25,7 @@
 /* USER CODE END 0 */
 
 DCMI_HandleTypeDef hdcmi;
+DMA_HandleTypeDef hdma_dcmi;
 
 /* DCMI init function */
 void MX_DCMI_Init(void)
@@ -114,6 +115,33 @@ void HAL_DCMI_MspInit(DCMI_HandleTypeDef* dcmiHandle)
 
   /* USER CODE BEGIN DCMI_MspInit 1 */
 
+    /* DCMI DMA Init: DMA2 Stream1 Channel1. Mode is switched to circular
+       at runtime for preview captures (see DCMICapturePreview) */
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    hdma_dcmi.Instance = DMA2_Stream1;
+    hdma_dcmi.Init.Channel = DMA_CHANNEL_1;
+    hdma_dcmi.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_dcmi.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_dcmi.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_dcmi.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    hdma_dcmi.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    hdma_dcmi.Init.Mode = DMA_NORMAL;
+    hdma_dcmi.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_dcmi.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+    hdma_dcmi.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    hdma_dcmi.Init.MemBurst = DMA_MBURST_SINGLE;
+    hdma_dcmi.Init.PeriphBurst = DMA_PBURST_SINGLE;
+    if (HAL_DMA_Init(&hdma_dcmi) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(dcmiHandle, DMA_Handle, hdma_dcmi);
+
+    HAL_NVIC_SetPriority(DMA2_Stream1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA2_Stream1_IRQn);
+    HAL_NVIC_SetPriority(DCMI_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DCMI_IRQn);
+
   /* USER CODE END DCMI_MspInit 1 */
   }
 }
@@ -152,6 +180,9 @@ void HAL_DCMI_MspDeInit(DCMI_HandleTypeDef* dcmiHandle)
 
   /* USER CODE BEGIN DCMI_MspDeInit 1 */
 
+    HAL_DMA_DeInit(dcmiHandle->DMA_Handle);
+    HAL_NVIC_DisableIRQ(DCMI_IRQn);
+
   /* USER CODE END DCMI_MspDeInit 1 */
   }
 }
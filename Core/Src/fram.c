@@ -197,10 +197,6 @@ bool wExtMem_DataSet(uint32_t address, uint8_t* dat, uint8_t len, uint8_t cs, bo
 	uint16_t photos_taken;
 	uint32_t total_frames_sent;
 	uint32_t time_on;
-	uint8_t camera_regs_A[20];		// Camera registers to write
-	uint8_t *camera_reg_B[20];
-	uint8_t camera_params_A[20];	// Parameters to write them with
-	uint8_t *camera_params_B[20];
 */
 void Init_status(status_t *status)
 {
@@ -210,7 +206,7 @@ void Init_status(status_t *status)
 	val16 = rExtMem(START_ADDR_FRAM, 0, 1);		// Delay on
 
 
-	static_assert(sizeof(status_t) == 92);
+	static_assert(sizeof(status_t) == 12);
 
 }
 
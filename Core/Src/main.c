@@ -86,12 +86,6 @@ uint8_t* compressed_photo_space_FRAM;
 uint8_t* current_compressed_address_FRAM;
 uint8_t current_compressed_index_FRAM;
 
-// global camera registers to write and their parameters
-volatile uint8_t camera_regs_A[20];
-volatile uint8_t camera_regs_B[20];
-volatile uint8_t camera_params_A[20];
-volatile uint8_t camera_params_B[20];
-
 // timestamp saved in FRAM
 volatile uint32_t ts_fram;
 
@@ -184,6 +178,10 @@ int main(void)
   MX_UART5_Init();
   /* USER CODE BEGIN 2 */
 
+  CamRegs_Load();											// camera register tables from FRAM (needs SPI2)
+  JpegTables_Load();										// uploaded JPEG quantization tables from FRAM
+  CompressJob_Resume();										// background JPEG interrupted by a reset, if any
+
   #if defined(COMM_UART) && !defined(COMM_I2C)
   	  HAL_UART_Receive_IT(&huart1, (uint8_t*)rx_buffer, INSTRUCTION_SIZE);
   #elif defined(COMM_I2C) && !defined(COMM_UART)
@@ -204,6 +202,9 @@ int main(void)
 				  new_command_received = 0;
 				  state = STATE_EXECUTE_COMMAND;
 			  }
+			  else {
+				  CompressJob_Step();									// background JPEG, a few MCU rows per pass
+			  }
 			  break;
 
 		  case STATE_EXECUTE_COMMAND:
@@ -13,12 +13,80 @@
 #include "i2c.h"
 #include "tim.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "ls_comms.h"
 
 volatile raw_photo_t* p;					// helper pointer for raw photos
 volatile uint16_t* p_raw;					// helper pointer for compressed memory space - 16b
 volatile uint8_t* p_raw8;					// helper pointer for compressed memory space - 8b
 volatile uint8_t frame_done = 0;
+volatile buffer_state_t buffer_state[NUM_BUFFERS];
+volatile uint8_t capturing_buffer = 0;
+
+uint8_t preview_y[PREVIEW_L * PREVIEW_H];
+static uint32_t preview_ring[PREVIEW_RING_LINES][PREVIEW_LINE_WORDS];	// DMA target during preview
+static volatile uint8_t  preview_active = 0;
+static volatile uint8_t  preview_done = 0;
+static volatile uint16_t preview_line = 0;								// sensor lines completed
+
+jpeg_config_t jpeg_config = { JPEG_DEFAULT_QUALITY, 0, 0, 0, 0, 0, 0 };
+jpeg_job_status_t jpeg_job_status = { JPEG_JOB_IDLE, 0, 0, 0, 0, 0, 0 };
+uint32_t jpeg_cycles_per_mcu = 0;
+uint32_t jpeg_flat_blocks = 0;
+
+// Encoder tables of the uploaded quantization tables, slot n at n - 1
+static TJEQuantTables jpeg_qt_tables[JPEG_QT_SLOTS];
+static uint8_t		  jpeg_qt_valid[JPEG_QT_SLOTS];
+
+// Background JPEG: the resumable encoder plus what is saved with the image
+// once it is done. Checkpointed to FRAM as is
+typedef struct {
+	TJEEncoder enc;
+	uint8_t  buffer_number;
+	uint8_t  image_index;
+	uint8_t  quality;				  // metadata quality field
+	uint8_t  format;				  // JPEG_FORMAT_* known at the start
+	uint8_t  rows_per_step;
+	uint8_t  tile;					  // metadata tile field
+	uint8_t  sequence;				  // checkpoint number, the newest valid slot wins
+	uint16_t check;					  // sum of the last JPEG_JOB_CHECK_BYTES output bytes
+	uint8_t  opcode[4];
+	uint32_t cycles;				  // spent in tje_encode_step so far
+} jpeg_job_t;
+
+_Static_assert(sizeof(jpeg_job_t) < JPEG_JOB_FRAM_SLOT_SIZE, "jpeg_job_t doesn't fit a FRAM checkpoint slot");
+
+static jpeg_job_t jpeg_job;
+
+// Y profiles of a raw frame, for the registration of stacked frames. Whole
+// lines and columns are summed: low light frames are noisy, sparse sums
+// don't register them
+typedef struct {
+	uint32_t rows[L];				  // Y of each line, summed
+	uint32_t cols[H / 2U];			  // Y of each column of pixel pairs, summed
+} stack_profile_t;
+
+static stack_profile_t stack_profiles[3];	// first frame, frame being merged, third frame
+
+// HDR weight maps: share of the short and mid frames of every block, 1/256
+static uint8_t hdr_maps[2][HDR_BLOCK_ROWS][HDR_BLOCK_COLS];
+
+change_config_t change_config = { 0, CHANGE_DEFAULT_THRESHOLD, CHANGE_DEFAULT_MIN_TILES, 0 };
+change_result_t change_results[MAX_COMPRESSED_PICS];
+static uint8_t		   change_sig[CHANGE_SIG_SIZE];				// signature of the last frame scored
+static uint8_t		   change_ref[CHANGE_SIG_SIZE];				// ring entry being compared
+static change_result_t change_last;
+static uint8_t		   change_last_valid = 0;
+static uint8_t		   change_last_threshold;
+
+uint32_t* restart_index[MAX_COMPRESSED_PICS];
+
+crop_window_t crop_presets[NUM_CROP_PRESETS] = {
+	{ 0, 0, H, L },		// full frame, read only
+	{ 0, 0, H, L },
+	{ 0, 0, H, L },
+	{ 0, 0, H, L },
+};
 
 HAL_StatusTypeDef Camera_Init(void)
 {
@@ -28,30 +96,49 @@ HAL_StatusTypeDef Camera_Init(void)
 	return HAL_OK; // TODO
 }
 
-HAL_StatusTypeDef CameraConfig(uint8_t camera)	// TODO
+HAL_StatusTypeDef CameraConfig(uint8_t camera)
 {
 	// camera addresses:
 	// A: 0x90
 	// B: 0xBA
 	// transfers done 8b at a time, MSB FIRST
-	// TODO - camera configuration. This needs to be called every time the camera is turned on!
+	// This needs to be called every time the camera is turned on!
+	if (camera >= NUM_CAMERAS) return HAL_ERROR;
 
-	//HAL_StatusTypeDef st;
+	uint32_t start = HAL_GetTick();
+	cam_config_status[camera].configured = 0;
 
-	return HAL_OK;
+	HAL_StatusTypeDef st = CamRegs_Apply(camera);				// streams the register table
+	if (st == HAL_OK) st = CamRegs_Verify(camera);				// readback of the verified registers
+
+	cam_config_status[camera].ready_ms = HAL_GetTick() - start;
+	cam_config_status[camera].configured = (st == HAL_OK);
+
+	char config_text[60];
+	snprintf(config_text, sizeof(config_text), "Camera %c configured in %lu ms, %u verify errors", camera ? 'B' : 'A',
+			 (unsigned long)cam_config_status[camera].ready_ms, cam_config_status[camera].verify_errors);
+	Log(config_text);
+
+	return st;
 }
 
 void ActivateCameraA(void)
 {
-	HAL_GPIO_WritePin(GPIOA, CAM_A_GPIO_PIN_EN, GPIO_PIN_SET);			// Activate Camera A
 	HAL_GPIO_WritePin(GPIOA, CAM_B_GPIO_PIN_EN, GPIO_PIN_RESET);		// Ensure Camera B is off
+	cam_config_status[1].configured = 0;								// B loses its registers when off
+	if (cam_config_status[0].configured) return;						// A already on and programmed
+
+	HAL_GPIO_WritePin(GPIOA, CAM_A_GPIO_PIN_EN, GPIO_PIN_SET);			// Activate Camera A
 	CameraConfig(0);													// Configures Camera A
 }
 
 void ActivateCameraB(void)
 {
-	HAL_GPIO_WritePin(GPIOA, CAM_B_GPIO_PIN_EN, GPIO_PIN_SET);			// Activate Camera B
 	HAL_GPIO_WritePin(GPIOA, CAM_A_GPIO_PIN_EN, GPIO_PIN_RESET);		// Ensure Camera A is off
+	cam_config_status[0].configured = 0;								// A loses its registers when off
+	if (cam_config_status[1].configured) return;						// B already on and programmed
+
+	HAL_GPIO_WritePin(GPIOA, CAM_B_GPIO_PIN_EN, GPIO_PIN_SET);			// Activate Camera B
 	CameraConfig(1);													// Configures Camera B
 }
 
@@ -81,29 +168,67 @@ HAL_StatusTypeDef cam_read_reg16_uint16(uint8_t camera, uint16_t reg16, uint16_t
 
 	// sends the 16b register address (no stop) and then performs a 16b read
 	st = HAL_I2C_Master_Transmit(&hi2c2, addr, reg_buf, 2, I2C_TIMEOUT_MS);
-	if(!HAL_OK) return st;
+	if(st != HAL_OK) return st;
 
 	uint8_t val_buf[2];
 	st = HAL_I2C_Master_Receive(&hi2c2, addr, val_buf, 2, I2C_TIMEOUT_MS);
-	if(!HAL_OK) return st;
+	if(st != HAL_OK) return st;
 
 	*out16 = (uint16_t)( val_buf[0] << 8 | val_buf[1] );
 	return HAL_OK;
 }
 
-void HAL_DCMI_XferCpltCallback(DMA_HandleTypeDef *hdma)
+HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop, uint8_t *opcode)
 {
-	// DMA finished exact expected transfer
-	HAL_DCMI_Stop(&hdcmi);
-	HAL_TIM_PWM_Stop(&htim11, TIM_CHANNEL_1);		// Stops EXT_CLK for sensor
-	frame_done = 1;   								// signal to main loop
+	HAL_StatusTypeDef st = DCMICaptureStart(camera_number, buffer_number, crop);
+	if (st != HAL_OK) return st;
+
+	return DCMICaptureWait(buffer_number, opcode);
 }
 
-HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, uint8_t *opcode)
+uint8_t CropWindowIsValid(const crop_window_t *crop)
 {
+	if (crop->width == 0 || crop->height == 0) return 0;
+	if ((crop->x0 | crop->y0 | crop->width | crop->height) % CROP_UNIT) return 0;
+	if ((uint32_t)crop->x0 + crop->width  > H) return 0;
+	if ((uint32_t)crop->y0 + crop->height > L) return 0;
+	return 1;
+}
+
+HAL_StatusTypeDef DCMICaptureStart(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop)
+{
+	if (buffer_number >= NUM_BUFFERS) return HAL_ERROR;
+	if (crop != NULL && !CropWindowIsValid(crop)) return HAL_ERROR;
+
+	uint16_t width  = (crop != NULL) ? crop->width  : H;
+	uint16_t height = (crop != NULL) ? crop->height : L;
+
+	// DCMI can only fill one buffer at a time, and never the one being compressed
+	if (buffer_state[capturing_buffer] == BUFFER_CAPTURING || buffer_state[buffer_number] == BUFFER_ENCODING) {
+		tx_buffer[1] = DCMI_CAPTURE_ERR;
+		return HAL_ERROR;
+	}
+
+	// Both cameras share the DCMI bus, so only the requested one is powered
+	if (camera_number == 0) ActivateCameraA();
+	else 					ActivateCameraB();
+
 	frame_done = 0;
+	capturing_buffer = buffer_number;
+	buffer_state[buffer_number] = BUFFER_CAPTURING;
 
-	p = raw_buffers[buffer_number];
+	volatile raw_photo_t* dst = raw_buffers[buffer_number];		// local pointer, p may be in use by the encoder
+	dst->width  = width;
+	dst->height = height;
+
+	// Crop window: counted in pixel clocks, 2 per pixel in 8b YCbCr 4:2:2
+	if (crop != NULL && (width != H || height != L)) {
+		HAL_DCMI_ConfigCrop(&hdcmi, 2U * crop->x0, crop->y0, 2U * width - 1U, height - 1U);
+		HAL_DCMI_EnableCrop(&hdcmi);
+	}
+	else {
+		HAL_DCMI_DisableCrop(&hdcmi);
+	}
 
 	HAL_TIM_PWM_Start(&htim11, TIM_CHANNEL_1);		// Starts EXT_CLK for sensor
 
@@ -118,38 +243,154 @@ HAL_StatusTypeDef DCMICapture(uint8_t camera_number, uint8_t buffer_number, uint
 	// DMA copies from DCMI_DR -> frame buffer
 	if (HAL_DCMI_Start_DMA(&hdcmi,
 						   DCMI_MODE_SNAPSHOT,					// We don't want video, just photo
-						   (uint32_t)&(p->data),				// address of destination
-						   (H * L) / 2) != HAL_OK) 				// Transfers two pixels at a time (transfer total: 32b)
+						   (uint32_t)&(dst->data),				// address of destination
+						   ((uint32_t)width * height) / 2) != HAL_OK) 	// Transfers two pixels at a time (transfer total: 32b)
 	{
-		tx_buffer[0] = DCMI_CAPTURE_ERR;						// Execution failed due to DCMI capture problem
+		buffer_state[buffer_number] = BUFFER_FREE;
+		frame_done = 1;
+		tx_buffer[1] = DCMI_CAPTURE_ERR;						// Execution failed due to DCMI capture problem
 		return HAL_ERROR;
 	}
 
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef DCMICaptureWait(uint8_t buffer_number, uint8_t *opcode)
+{
+	if (buffer_number >= NUM_BUFFERS) return HAL_ERROR;
 
-	while(!frame_done) {
-		// wait for capture to end - TODO: Timeout?
+	// Ended by HAL_DCMI_FrameEventCallback
+	uint32_t start = HAL_GetTick();
+	while(buffer_state[buffer_number] == BUFFER_CAPTURING) {
+		if (HAL_GetTick() - start >= DCMI_CAPTURE_TIMEOUT_MS) {
+			HAL_DCMI_Stop(&hdcmi);
+			HAL_TIM_PWM_Stop(&htim11, TIM_CHANNEL_1);		// Stops EXT_CLK for sensor
+			buffer_state[buffer_number] = BUFFER_FREE;		// partial frame
+			frame_done = 1;
+			tx_buffer[1] = CAPTURE_TIMEOUT_ERR;
+			return HAL_ERROR;
+		}
 	}
 
+	if (buffer_state[buffer_number] != BUFFER_CAPTURED) return HAL_ERROR;
+
+	volatile raw_photo_t* dst = raw_buffers[buffer_number];
+
 	// saves metadata after saving photo
-	p->designator = photos_taken;
+	dst->designator = photos_taken;
 	photos_taken++;						// increments the counter by one. TODO - Save this change in FRAM pending (Implement function!)
 
 	uint16_t opcode0 = (opcode[1] << 8) | opcode[0];
 	uint16_t opcode1 = (opcode[3] << 8) | opcode[2];
-	p->timestamp = timestamp;
-	p->opcode[0] = opcode0;	// LSB
-	p->opcode[1] = opcode1;	// MSB
+	dst->timestamp = timestamp;
+	dst->opcode[0] = opcode0;	// LSB
+	dst->opcode[1] = opcode1;	// MSB
 
 	return HAL_OK;
 }
 
+// Keeps the Y byte of every PREVIEW_DECIMATION-th pixel of a sensor line
+static void PreviewDecimateLine(uint16_t line)
+{
+	if (line >= L || (line % PREVIEW_DECIMATION) != 0) return;
+
+	const uint32_t *src = preview_ring[line % PREVIEW_RING_LINES];
+	uint8_t *dst = &preview_y[(line / PREVIEW_DECIMATION) * PREVIEW_H];
+
+	for (uint32_t x = 0; x < PREVIEW_H; x++) {
+		uint32_t word = src[x * (PREVIEW_DECIMATION / 2U)];		// 2 pixels per word
+		dst[x] = (uint8_t)(word & 0xFF);						// Y0 of [Y0, Cb, Y1, Cr], as the encoder reads it
+	}
+}
+
+void HAL_DCMI_LineEventCallback(DCMI_HandleTypeDef *hdcmi)
+{
+	if (!preview_active) return;
+
+	// Line N just ended: line N-1 is complete in the ring and DMA is now writing N+1
+	if (preview_line > 0) PreviewDecimateLine(preview_line - 1);
+	preview_line++;
+}
+
+void HAL_DCMI_FrameEventCallback(DCMI_HandleTypeDef *hdcmi)
+{
+	if (!preview_active) {
+		// Full frame in the raw buffer (snapshot mode, DMA done)
+		HAL_DCMI_Stop(hdcmi);
+		HAL_TIM_PWM_Stop(&htim11, TIM_CHANNEL_1);		// Stops EXT_CLK for sensor
+		buffer_state[capturing_buffer] = BUFFER_CAPTURED;	// buffer ownership goes back to the CPU
+		frame_done = 1;   								// signal to main loop
+		return;
+	}
+
+	PreviewDecimateLine(preview_line - 1);		// last line has no following line event
+	preview_done = 1;
+}
+
+HAL_StatusTypeDef DCMICapturePreview(uint8_t camera_number)
+{
+	if (buffer_state[capturing_buffer] == BUFFER_CAPTURING) return HAL_ERROR;	// DCMI busy
+
+	if (camera_number == 0) ActivateCameraA();
+	else 					ActivateCameraB();
+
+	HAL_DCMI_DisableCrop(&hdcmi);
+
+	// DMA loops over the line ring instead of filling a raw buffer in FSMC SRAM
+	hdcmi.DMA_Handle->Init.Mode = DMA_CIRCULAR;
+	HAL_DMA_Init(hdcmi.DMA_Handle);
+
+	preview_line = 0;
+	preview_done = 0;
+	preview_active = 1;
+
+	HAL_TIM_PWM_Start(&htim11, TIM_CHANNEL_1);		// Starts EXT_CLK for sensor
+
+	HAL_StatusTypeDef st = HAL_DCMI_Start_DMA(&hdcmi,
+											  DCMI_MODE_SNAPSHOT,
+											  (uint32_t)preview_ring,
+											  PREVIEW_RING_LINES * PREVIEW_LINE_WORDS);
+	if (st == HAL_OK) {
+		__HAL_DCMI_ENABLE_IT(&hdcmi, DCMI_IT_LINE | DCMI_IT_FRAME);
+		uint32_t start = HAL_GetTick();
+		while(!preview_done) {
+			if (HAL_GetTick() - start >= DCMI_CAPTURE_TIMEOUT_MS) {
+				tx_buffer[1] = CAPTURE_TIMEOUT_ERR;		// stopped below like a finished preview
+				st = HAL_ERROR;
+				break;
+			}
+		}
+	}
+
+	preview_active = 0;
+	HAL_DCMI_Stop(&hdcmi);
+	HAL_TIM_PWM_Stop(&htim11, TIM_CHANNEL_1);		// Stops EXT_CLK for sensor
+
+	hdcmi.DMA_Handle->Init.Mode = DMA_NORMAL;		// back to single shot raw captures
+	HAL_DMA_Init(hdcmi.DMA_Handle);
+
+	return st;
+}
+
+void ComputeBlackPercentagePreview(float *result)
+{
+	uint32_t total_pixels = (uint32_t)PREVIEW_H * PREVIEW_L;
+	uint32_t black_pixels = 0;
+
+	for (uint32_t i = 0; i < total_pixels; i++) {
+		if (preview_y[i] < BLACK_Y_LEVEL) black_pixels++;
+	}
+
+	*result = (float)black_pixels / (float)total_pixels;
+}
+
 void ComputeBlackPercentage(float *result, uint8_t buffer)
 {
-    uint32_t total_pixels = (uint32_t)(L * H);
     uint32_t black_pixels = 0;
 
     // Pointer to image in external SRAM
     p = raw_buffers[buffer];
+    uint32_t total_pixels = (uint32_t)p->width * p->height;
 
     // In YCbCr 4:2:2, 4 bytes = 2 pixels:  Y0 Cb  Y1 Cr
     // So for each pixel:
@@ -166,59 +407,1239 @@ void ComputeBlackPercentage(float *result, uint8_t buffer)
     *result = (float)black_pixels / (float)total_pixels;
 }
 
-HAL_StatusTypeDef CompressToJPEG(uint8_t buffer_number, uint8_t quality, uint32_t *compressed_size, uint8_t *opcode)
+uint32_t ComputeYHistogram(uint32_t *hist, uint8_t buffer)
+{
+	volatile raw_photo_t* src = raw_buffers[buffer];		// local pointer, p may be in use by the encoder
+	uint16_t width  = src->width;
+	uint16_t height = src->height;
+	uint32_t samples = 0;
+
+	for (uint8_t i = 0; i < AE_HIST_BINS; i++) hist[i] = 0;
+
+	// Exposure only needs the distribution, so a sparse grid keeps the FSMC reads low
+	for (uint32_t y = 0; y < height; y += AE_HIST_SUBSAMPLE) {
+		volatile uint16_t *line = &src->data[y * width];
+		for (uint32_t x = 0; x < width; x += AE_HIST_SUBSAMPLE) {
+			hist[(line[x] & 0xFF) >> 2]++;					// Y is the LSB of [Y0, Cb] / [Y1, Cr], 64 bins
+			samples++;
+		}
+	}
+	return samples;
+}
+
+uint32_t ComputeYHistogramPreview(uint32_t *hist)
+{
+	uint32_t total_pixels = (uint32_t)PREVIEW_H * PREVIEW_L;
+
+	for (uint8_t i = 0; i < AE_HIST_BINS; i++) hist[i] = 0;
+	for (uint32_t i = 0; i < total_pixels; i++) hist[preview_y[i] >> 2]++;
+
+	return total_pixels;
+}
+
+// Y0 + Y1 of a pixel pair word [Y0, Cb, Y1, Cr]
+static inline uint32_t PairY(uint32_t pair)
+{
+	uint32_t y = pair & 0x00FF00FFU;
+	return (y + (y >> 16)) & 0x01FFU;
+}
+
+static void StackProfile(uint8_t buffer, stack_profile_t *profile)
+{
+	const raw_photo_t *src = (const raw_photo_t*)raw_buffers[buffer];	// not written by DMA any more
+	uint16_t pairs = src->width / 2U;
+
+	memset(profile->cols, 0, sizeof(profile->cols));
+	for (uint16_t y = 0; y < src->height; y++) {
+		const uint32_t *line = (const uint32_t*)&src->data[(uint32_t)y * src->width];
+		uint32_t sum = 0;
+		for (uint16_t x = 0; x < pairs; x++) {
+			uint32_t pair_y = PairY(line[x]);
+			sum += pair_y;
+			profile->cols[x] += pair_y;
+		}
+		profile->rows[y] = sum;
+	}
+}
+
+// Shift s of profile b against a (b[i + s] matches a[i]) with the smallest
+// mean absolute difference over their overlap, the smallest shift on ties.
+// The mean difference is removed first: the other direction of the shift and
+// the noise of the sensor change the level of a whole profile. Shifts that
+// leave less than half of the profile to compare are not tried
+static int8_t ProfileShift(const uint32_t *a, const uint32_t *b, int16_t n, int8_t max_shift)
+{
+	uint32_t best_cost = UINT32_MAX;
+	int8_t   best = 0;
+
+	for (int8_t s = -max_shift; s <= max_shift; s++) {
+		int16_t first = (s < 0) ? -s : 0;
+		int16_t last  = (s > 0) ? n - s : n;
+		if (2 * (last - first) < n) continue;
+
+		int32_t count  = last - first;
+		int32_t offset = 0;
+		for (int16_t i = first; i < last; i++) offset += (int32_t)a[i] - (int32_t)b[i + s];
+		offset /= count;
+
+		uint32_t sum = 0;
+		for (int16_t i = first; i < last; i++) {
+			int32_t d = (int32_t)a[i] - (int32_t)b[i + s] - offset;
+			sum += (uint32_t)((d < 0) ? -d : d);
+		}
+		uint32_t cost = sum / (uint32_t)count;
+		if (cost < best_cost || (cost == best_cost && abs(s) < abs(best))) {
+			best_cost = cost;
+			best = s;
+		}
+	}
+	return best;
+}
+
+// Averages frame b into frame a, b read dy lines and dx pixel pairs away.
+// One pixel pair per 32b word: the halving add works on the 4 bytes at once
+// and can't carry from one into the next
+static void StackMerge(uint8_t a, uint8_t b, int8_t dx, int8_t dy, uint8_t round_up)
+{
+	raw_photo_t *dst = (raw_photo_t*)raw_buffers[a];
+	const raw_photo_t *src = (const raw_photo_t*)raw_buffers[b];
+	int16_t pairs  = (int16_t)(dst->width / 2U);
+	int16_t height = (int16_t)dst->height;
+	int16_t x0 = (dx < 0) ? -dx : 0;
+	int16_t x1 = (dx > 0) ? pairs - dx : pairs;
+
+	for (int16_t y = 0; y < height; y++) {
+		int16_t sy = y + dy;
+		if (sy < 0 || sy >= height) continue;						// keeps frame a
+
+		uint32_t *pa = (uint32_t*)&dst->data[(uint32_t)y * dst->width];
+		const uint32_t *pb = (const uint32_t*)&src->data[(uint32_t)sy * dst->width] + dx;
+		if (round_up) {
+			for (int16_t x = x0; x < x1; x++) {
+				uint32_t u = pa[x], v = pb[x];
+				pa[x] = (u | v) - (((u ^ v) & 0xFEFEFEFEU) >> 1);
+			}
+		}
+		else {
+			for (int16_t x = x0; x < x1; x++) {
+				uint32_t u = pa[x], v = pb[x];
+				pa[x] = (u & v) + (((u ^ v) & 0xFEFEFEFEU) >> 1);
+			}
+		}
+	}
+}
+
+// Registers frame b on the frame profile_a was taken from, then averages it in
+static void StackMergeFrame(uint8_t a, uint8_t b, const stack_profile_t *profile_a, uint8_t registration,
+							uint8_t round_up, int8_t *dx, int8_t *dy)
+{
+	int8_t pairs = 0;
+	*dy = 0;
+	if (registration) {
+		const raw_photo_t *frame = (const raw_photo_t*)raw_buffers[b];
+		StackProfile(b, &stack_profiles[1]);
+		*dy	  = ProfileShift(profile_a->rows, stack_profiles[1].rows, (int16_t)frame->height, STACK_MAX_SHIFT_ROWS);
+		pairs = ProfileShift(profile_a->cols, stack_profiles[1].cols, (int16_t)(frame->width / 2U), STACK_MAX_SHIFT_PAIRS);
+	}
+	*dx = (int8_t)(2 * pairs);
+	StackMerge(a, b, pairs, *dy, round_up);
+}
+
+HAL_StatusTypeDef CaptureStacked(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop,
+								 uint8_t frames, uint8_t registration, stack_stats_t *stats, uint8_t *opcode)
+{
+	if (buffer_number >= NUM_BUFFERS || (frames != 2U && frames != 4U)) return HAL_ERROR;
+
+	// The other two buffers hold frames 2 to 4
+	uint8_t work[NUM_BUFFERS - 1U];
+	for (uint8_t b = 0, n = 0; b < NUM_BUFFERS; b++) {
+		if (b != buffer_number) work[n++] = b;
+	}
+	memset(stats, 0, sizeof(stack_stats_t));
+
+	// Frame 1, then frame 2 captured while frame 1 is profiled
+	if (DCMICapture(camera_number, buffer_number, crop, opcode) != HAL_OK) return HAL_ERROR;
+	if (DCMICaptureStart(camera_number, work[0], crop) != HAL_OK) return HAL_ERROR;
+	if (registration) StackProfile(buffer_number, &stack_profiles[0]);
+	if (DCMICaptureWait(work[0], opcode) != HAL_OK) return HAL_ERROR;
+
+	if (frames == 2U) {
+		StackMergeFrame(buffer_number, work[0], &stack_profiles[0], registration, 1, &stats->dx[0], &stats->dy[0]);
+	}
+	else {
+		// Frame 3 captured while 2 is merged into 1, frame 4 while 3 is profiled
+		if (DCMICaptureStart(camera_number, work[1], crop) != HAL_OK) return HAL_ERROR;
+		StackMergeFrame(buffer_number, work[0], &stack_profiles[0], registration, 1, &stats->dx[0], &stats->dy[0]);
+		if (DCMICaptureWait(work[1], opcode) != HAL_OK) return HAL_ERROR;
+
+		if (DCMICaptureStart(camera_number, work[0], crop) != HAL_OK) return HAL_ERROR;
+		if (registration) StackProfile(work[1], &stack_profiles[2]);
+		if (DCMICaptureWait(work[0], opcode) != HAL_OK) return HAL_ERROR;
+
+		StackMergeFrame(work[1], work[0], &stack_profiles[2], registration, 1, &stats->dx[1], &stats->dy[1]);
+		StackMergeFrame(buffer_number, work[1], &stack_profiles[0], registration, 0, &stats->dx[2], &stats->dy[2]);
+		buffer_state[work[1]] = BUFFER_FREE;
+	}
+	buffer_state[work[0]] = BUFFER_FREE;						// partial averages, nothing to keep
+
+	stats->frames = frames;
+	return HAL_OK;
+}
+
+// Well exposedness of a pixel pair from Y0 + Y1: a biweight around
+// HDR_WEIGHT_CENTRE (close to the usual gaussian, sigma ~0.2), 1 to 257 so
+// the weights of a block never sum to 0
+static inline uint32_t HdrWeight(uint32_t pair)
+{
+	int32_t d = (int32_t)(PairY(pair) >> 1) - HDR_WEIGHT_CENTRE;
+	uint32_t t = 16384U - (uint32_t)(d * d);					// Q14, d^2 <= 128^2
+	return 1U + ((t * t) >> 20);
+}
+
+// Weight maps: per HDR_BLOCK block, the share of the short and mid frames
+// in 1/256 (long = the rest), from the sum of the pixel weights of the block.
+// Returns the weight of each frame over the whole image
+static void HdrWeightMaps(const uint32_t *frames[HDR_FRAMES], uint16_t pairs, uint16_t height, uint32_t *weights)
+{
+	uint16_t cols = (pairs + HDR_BLOCK_PAIRS - 1U) / HDR_BLOCK_PAIRS;
+	uint32_t sums[HDR_FRAMES][HDR_BLOCK_COLS];
+
+	memset(weights, 0, HDR_FRAMES * sizeof(uint32_t));
+	memset(sums, 0, sizeof(sums));
+	for (uint16_t y = 0; y < height; y++) {
+		uint32_t line = (uint32_t)y * pairs;
+		for (uint8_t k = 0; k < HDR_FRAMES; k++) {
+			const uint32_t *p = frames[k] + line;
+			for (uint16_t x = 0; x < pairs; x++) sums[k][x / HDR_BLOCK_PAIRS] += HdrWeight(p[x]);
+		}
+
+		// End of a strip of blocks
+		if ((y % HDR_BLOCK_LINES) == HDR_BLOCK_LINES - 1U || y == height - 1U) {
+			uint16_t row = y / HDR_BLOCK_LINES;
+			for (uint16_t c = 0; c < cols; c++) {
+				uint32_t total = sums[0][c] + sums[1][c] + sums[2][c];
+				hdr_maps[0][row][c] = (uint8_t)((sums[0][c] * 256U + total / 2U) / total);
+				hdr_maps[1][row][c] = (uint8_t)((sums[1][c] * 256U + total / 2U) / total);
+				for (uint8_t k = 0; k < HDR_FRAMES; k++) weights[k] += sums[k][c];
+			}
+			memset(sums, 0, sizeof(sums));
+		}
+	}
+}
+
+// Fuses the frames into frames[1] (mid), in place. The shares of the 4
+// nearest blocks are interpolated to every pixel pair (bilinear), so the
+// weights change smoothly: a pixel is a weighted mean of the frames with
+// weights of its neighbourhood, which keeps the local contrast and has no
+// block edges. Shares always sum to 256 << HDR_FRAC_BITS: no division
+static void HdrFuse(const uint32_t *frames[HDR_FRAMES], uint16_t pairs, uint16_t height)
+{
+	uint16_t cols = (pairs + HDR_BLOCK_PAIRS - 1U) / HDR_BLOCK_PAIRS;
+	uint16_t rows = (height + HDR_BLOCK_LINES - 1U) / HDR_BLOCK_LINES;
+	uint16_t line_share[2][HDR_BLOCK_COLS];						// short and mid of each block column, this line, Q4
+	uint32_t *dst = (uint32_t*)frames[1];
+
+	for (uint16_t y = 0; y < height; y++) {
+		// Vertical position between block centres, in half lines (2 * HDR_BLOCK_LINES per block)
+		int32_t  fy = 2 * (int32_t)y + 1 - (int32_t)HDR_BLOCK_LINES;
+		uint16_t r0 = (fy < 0) ? 0 : (uint16_t)(fy / (2 * (int32_t)HDR_BLOCK_LINES));
+		uint16_t ty = (fy < 0) ? 0 : (uint16_t)(fy % (2 * (int32_t)HDR_BLOCK_LINES)) >> 1;	// 0 to HDR_BLOCK_LINES - 1
+		uint16_t r1 = (r0 + 1U < rows) ? r0 + 1U : r0;
+		for (uint8_t k = 0; k < 2; k++) {
+			for (uint16_t c = 0; c < cols; c++) {
+				line_share[k][c] = (uint16_t)(hdr_maps[k][r0][c] * (HDR_BLOCK_LINES - ty) + hdr_maps[k][r1][c] * ty);
+			}
+		}
+
+		uint32_t line = (uint32_t)y * pairs;
+		const uint32_t *ps = frames[0] + line;
+		const uint32_t *pl = frames[2] + line;
+		uint32_t *pm = dst + line;
+		for (uint16_t x = 0; x < pairs; x++) {
+			// Horizontal position in half pairs (2 * HDR_BLOCK_PAIRS per block)
+			int32_t  fx = 2 * (int32_t)x + 1 - (int32_t)HDR_BLOCK_PAIRS;
+			uint16_t c0 = (fx < 0) ? 0 : (uint16_t)(fx / (2 * (int32_t)HDR_BLOCK_PAIRS));
+			uint32_t tx = (fx < 0) ? 0 : (uint32_t)(fx % (2 * (int32_t)HDR_BLOCK_PAIRS));	// 0 to 2 * HDR_BLOCK_PAIRS - 1
+			uint16_t c1 = (c0 + 1U < cols) ? c0 + 1U : c0;
+
+			uint32_t fs = line_share[0][c0] * (2U * HDR_BLOCK_PAIRS - tx) + line_share[0][c1] * tx;
+			uint32_t fm = line_share[1][c0] * (2U * HDR_BLOCK_PAIRS - tx) + line_share[1][c1] * tx;
+			uint32_t fl = (256U << HDR_FRAC_BITS) - fs - fm;
+
+			uint32_t s = ps[x], m = pm[x], l = pl[x];
+			uint32_t out = 0;
+			for (uint8_t shift = 0; shift < 32U; shift += 8U) {
+				uint32_t acc = fs * ((s >> shift) & 0xFFU) + fm * ((m >> shift) & 0xFFU) + fl * ((l >> shift) & 0xFFU);
+				out |= ((acc + (1UL << (HDR_FRAC_BITS + 7U))) >> (HDR_FRAC_BITS + 8U)) << shift;
+			}
+			pm[x] = out;
+		}
+	}
+}
+
+HAL_StatusTypeDef CaptureHDR(uint8_t camera_number, uint8_t buffer_number, const crop_window_t *crop,
+							 uint8_t ev, hdr_stats_t *stats, uint8_t *opcode)
+{
+	if (buffer_number >= NUM_BUFFERS || camera_number >= NUM_CAMERAS || ev == 0 || ev > HDR_MAX_EV) return HAL_ERROR;
+
+	cam_reg_op_t *integration = CamRegs_Find(camera_number, CAM_REG_INTEGRATION_TIME);
+	if (integration == NULL) return HAL_ERROR;					// table doesn't control exposure
+
+	uint32_t mid	= integration->val;
+	uint32_t shorter = mid >> ev;
+	uint32_t longer	 = mid << ev;
+	if (shorter < AE_MIN_INTEGRATION) shorter = AE_MIN_INTEGRATION;
+	if (longer  > AE_MAX_INTEGRATION) longer  = AE_MAX_INTEGRATION;
+
+	// Short and long frames go to the other two buffers
+	uint8_t work[NUM_BUFFERS - 1U];
+	for (uint8_t b = 0, n = 0; b < NUM_BUFFERS; b++) {
+		if (b != buffer_number) work[n++] = b;
+	}
+	memset(stats, 0, sizeof(hdr_stats_t));
+	stats->integration[0] = (uint16_t)shorter;
+	stats->integration[1] = (uint16_t)mid;
+	stats->integration[2] = (uint16_t)longer;
+
+	// Mid frame first, with the registers as programmed: its timestamp is the image's.
+	// The camera is on and configured after it, so the next writes stick
+	HAL_StatusTypeDef st = DCMICapture(camera_number, buffer_number, crop, opcode);
+	if (st == HAL_OK) st = cam_write_reg16_uint16(camera_number, CAM_REG_INTEGRATION_TIME, (uint16_t)shorter);
+	if (st == HAL_OK) st = DCMICapture(camera_number, work[0], crop, opcode);
+	if (st == HAL_OK) st = cam_write_reg16_uint16(camera_number, CAM_REG_INTEGRATION_TIME, (uint16_t)longer);
+	if (st == HAL_OK) st = DCMICapture(camera_number, work[1], crop, opcode);
+
+	// Back to the auto exposure value, whatever happened
+	if (cam_write_reg16_uint16(camera_number, CAM_REG_INTEGRATION_TIME, (uint16_t)mid) != HAL_OK) {
+		cam_config_status[camera_number].configured = 0;		// reprogrammed from the table on the next capture
+	}
+	if (st != HAL_OK) return st;
+
+	// Not written by DMA any more
+	const raw_photo_t *frame = (const raw_photo_t*)raw_buffers[buffer_number];
+	const uint32_t *frames[HDR_FRAMES] = { (const uint32_t*)((const raw_photo_t*)raw_buffers[work[0]])->data,
+										   (const uint32_t*)frame->data,
+										   (const uint32_t*)((const raw_photo_t*)raw_buffers[work[1]])->data };
+	uint32_t weights[HDR_FRAMES];
+	HdrWeightMaps(frames, frame->width / 2U, frame->height, weights);
+	HdrFuse(frames, frame->width / 2U, frame->height);
+	buffer_state[work[0]] = BUFFER_FREE;
+	buffer_state[work[1]] = BUFFER_FREE;
+
+	uint32_t total = weights[0] + weights[1] + weights[2];
+	for (uint8_t i = 0; i < HDR_FRAMES; i++) {
+		stats->share[i] = (uint8_t)(weights[i] * 100U / total);	// weights < 2^32 / 100 for a full frame
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef AutoExposureUpdate(uint8_t camera, const uint32_t *hist, uint32_t samples, ae_stats_t *stats)
+{
+	if (samples == 0) return HAL_ERROR;
+
+	// Current exposure is whatever the register table last programmed
+	cam_reg_op_t *integration = CamRegs_Find(camera, CAM_REG_INTEGRATION_TIME);
+	cam_reg_op_t *gain		  = CamRegs_Find(camera, CAM_REG_GLOBAL_GAIN);
+	if (integration == NULL || gain == NULL) return HAL_ERROR;	// table doesn't control exposure
+
+	uint32_t sum = 0;
+	for (uint8_t i = 0; i < AE_HIST_BINS; i++) sum += hist[i] * (4U * i + 2U);	// bin centre
+	uint32_t mean = sum / samples;
+
+	stats->mean_y	   = (uint8_t)mean;
+	stats->integration = integration->val;
+	stats->gain		   = gain->val;
+
+	uint32_t step_q8;
+	if (hist[AE_HIST_BINS - 1] * 100U > samples * AE_SATURATED_PERCENT) {
+		step_q8 = 1U << 7;										// clipped, mean is unreliable: halve
+	}
+	else if (mean + AE_TOLERANCE_Y >= AE_TARGET_MEAN_Y && mean <= AE_TARGET_MEAN_Y + AE_TOLERANCE_Y) {
+		return HAL_OK;											// converged, frame is just dark
+	}
+	else {
+		step_q8 = (mean == 0) ? AE_MAX_STEP_Q8 : (AE_TARGET_MEAN_Y << 8) / mean;
+		if (step_q8 > AE_MAX_STEP_Q8) step_q8 = AE_MAX_STEP_Q8;
+		if (step_q8 < AE_MIN_STEP_Q8) step_q8 = AE_MIN_STEP_Q8;
+	}
+
+	// Exposure as lines x gain code. Integration time first (no added noise),
+	// gain only once integration is at its maximum
+	uint32_t exposure		 = ((uint32_t)integration->val * gain->val * step_q8) >> 8;
+	uint32_t new_integration = exposure / AE_GAIN_1X;
+	uint32_t new_gain		 = AE_GAIN_1X;
+	uint8_t  at_limit		 = 0;
+
+	if (new_integration > AE_MAX_INTEGRATION) {
+		new_integration = AE_MAX_INTEGRATION;
+		new_gain = exposure / AE_MAX_INTEGRATION;
+		if (new_gain > AE_MAX_GAIN) {
+			new_gain = AE_MAX_GAIN;
+			at_limit = 1;
+		}
+	}
+	else if (new_integration < AE_MIN_INTEGRATION) {
+		new_integration = AE_MIN_INTEGRATION;
+		at_limit = 1;
+	}
+	stats->at_limit = at_limit;
+
+	if (new_integration == integration->val && new_gain == gain->val) return HAL_OK;	// nothing left to move
+
+	HAL_StatusTypeDef st = cam_write_reg16_uint16(camera, CAM_REG_INTEGRATION_TIME, (uint16_t)new_integration);
+	if (st == HAL_OK) st = cam_write_reg16_uint16(camera, CAM_REG_GLOBAL_GAIN, (uint16_t)new_gain);
+	if (st != HAL_OK) return st;
+
+	// Kept in the RAM table so the next power-on starts from the converged exposure
+	integration->val = (uint16_t)new_integration;
+	gain->val		 = (uint16_t)new_gain;
+
+	stats->steps++;
+	stats->integration = (uint16_t)new_integration;
+	stats->gain		   = (uint16_t)new_gain;
+	return HAL_OK;
+}
+
+// Mean Y of every CHANGE_CELL x CHANGE_CELL cell of a full frame
+static void ChangeSignature(uint8_t buffer, uint8_t *sig)
+{
+	const raw_photo_t *src = (const raw_photo_t*)raw_buffers[buffer];	// not written by DMA any more
+	uint32_t sums[CHANGE_COLS];
+
+	memset(sums, 0, sizeof(sums));
+	for (uint16_t y = 0; y < L; y++) {
+		const uint32_t *line = (const uint32_t*)&src->data[(uint32_t)y * H];
+		for (uint16_t x = 0; x < H / 2U; x++) sums[x / (CHANGE_CELL / 2U)] += PairY(line[x]);
+
+		if ((y % CHANGE_CELL) == CHANGE_CELL - 1U) {
+			uint8_t *row = sig + (y / CHANGE_CELL) * CHANGE_COLS;
+			for (uint16_t c = 0; c < CHANGE_COLS; c++) {
+				row[c] = (uint8_t)((sums[c] + CHANGE_CELL * CHANGE_CELL / 2U) / (CHANGE_CELL * CHANGE_CELL));
+			}
+			memset(sums, 0, sizeof(sums));
+		}
+	}
+}
+
+// Scores signature cur against ref: global shift (ref cell r + dy, c + dx
+// matches cur cell r, c) and exposure offset with the smallest mean absolute
+// difference, overlap at least half the frame, then the tiles that differ
+// by more than threshold after them. Tiles shifted out of ref changed
+static uint8_t ChangeCompare(const uint8_t *cur, const uint8_t *ref, uint8_t threshold, change_result_t *result)
+{
+	uint32_t best_cost = UINT32_MAX;
+	int32_t  best_offset = 0;
+
+	result->dx = 0;
+	result->dy = 0;
+	for (int8_t dy = -CHANGE_MAX_SHIFT; dy <= CHANGE_MAX_SHIFT; dy++) {
+		for (int8_t dx = -CHANGE_MAX_SHIFT; dx <= CHANGE_MAX_SHIFT; dx++) {
+			int16_t r0 = (dy < 0) ? -dy : 0, r1 = (dy > 0) ? (int16_t)CHANGE_ROWS - dy : (int16_t)CHANGE_ROWS;
+			int16_t c0 = (dx < 0) ? -dx : 0, c1 = (dx > 0) ? (int16_t)CHANGE_COLS - dx : (int16_t)CHANGE_COLS;
+			int32_t count = (int32_t)(r1 - r0) * (c1 - c0);
+			if (2 * count < (int32_t)CHANGE_SIG_SIZE) continue;
+
+			int32_t offset = 0;
+			for (int16_t r = r0; r < r1; r++) {
+				for (int16_t c = c0; c < c1; c++) offset += cur[r * CHANGE_COLS + c] - ref[(r + dy) * CHANGE_COLS + c + dx];
+			}
+			offset /= count;
+
+			uint32_t sum = 0;
+			for (int16_t r = r0; r < r1; r++) {
+				for (int16_t c = c0; c < c1; c++) {
+					int32_t d = cur[r * CHANGE_COLS + c] - ref[(r + dy) * CHANGE_COLS + c + dx] - offset;
+					sum += (uint32_t)((d < 0) ? -d : d);
+				}
+			}
+			uint32_t cost = (sum << 4) / (uint32_t)count;			// 1/16 Y
+			if (cost < best_cost || (cost == best_cost && abs(dx) + abs(dy) < abs(result->dx) + abs(result->dy))) {
+				best_cost	= cost;
+				best_offset = offset;
+				result->dx	= dx;
+				result->dy	= dy;
+			}
+		}
+	}
+
+	// Tiles at the best shift
+	uint8_t changed = 0;
+	memset(result->mask, 0, CHANGE_MASK_BYTES);
+	for (uint16_t t = 0; t < CHANGE_TILES; t++) {
+		uint16_t tr = t / CHANGE_TILE_COLS, tc = t % CHANGE_TILE_COLS;
+		uint32_t sum = 0, count = 0;
+		for (uint16_t r = tr * CHANGE_TILE_CELLS; r < (tr + 1U) * CHANGE_TILE_CELLS && r < CHANGE_ROWS; r++) {
+			int16_t sr = (int16_t)r + result->dy;
+			if (sr < 0 || sr >= (int16_t)CHANGE_ROWS) continue;
+			for (uint16_t c = tc * CHANGE_TILE_CELLS; c < (tc + 1U) * CHANGE_TILE_CELLS && c < CHANGE_COLS; c++) {
+				int16_t sc = (int16_t)c + result->dx;
+				if (sc < 0 || sc >= (int16_t)CHANGE_COLS) continue;
+				int32_t d = cur[r * CHANGE_COLS + c] - ref[sr * CHANGE_COLS + sc] - best_offset;
+				sum += (uint32_t)((d < 0) ? -d : d);
+				count++;
+			}
+		}
+		if (count == 0 || sum > (uint32_t)threshold * count) {
+			result->mask[t / 8U] |= (uint8_t)(1U << (t % 8U));
+			changed++;
+		}
+	}
+	return changed;
+}
+
+static uint32_t ChangeSlotAddr(uint8_t slot)
+{
+	return CHANGE_RING_BASE_ADDR_FRAM + (uint32_t)slot * CHANGE_FRAM_SLOT_SIZE;
+}
+
+// Sequence of the newest ring entry and the slot the next one goes to: the
+// first empty one, else the oldest. Returns the entries in the ring
+static uint8_t ChangeRingScan(uint8_t *newest, uint8_t *next_slot)
+{
+	uint8_t entries = 0, empty = CHANGE_RING_SLOTS, oldest = 0;
+
+	*next_slot = 0;
+	for (uint8_t s = 0; s < CHANGE_RING_SLOTS; s++) {
+		uint32_t addr = ChangeSlotAddr(s);
+		if ((uint8_t)rExtMem(addr, 0, 0) != CHANGE_FRAM_MAGIC) {
+			if (empty == CHANGE_RING_SLOTS) empty = s;
+			continue;
+		}
+		uint8_t seq = (uint8_t)rExtMem(addr + 1U, 0, 0);
+		if (!entries || (int8_t)(seq - *newest) > 0) *newest = seq;
+		if (!entries || (int8_t)(seq - oldest) < 0) {
+			oldest = seq;
+			*next_slot = s;
+		}
+		entries++;
+	}
+	if (empty != CHANGE_RING_SLOTS) *next_slot = empty;
+	return entries;
+}
+
+HAL_StatusTypeDef ChangeDetect(uint8_t buffer_number, change_result_t *result)
+{
+	if (buffer_number >= NUM_BUFFERS) return HAL_ERROR;
+	const raw_photo_t *frame = (const raw_photo_t*)raw_buffers[buffer_number];
+	if (frame->width != H || frame->height != L) return HAL_ERROR;	// signatures are of full frames
+
+	if (change_last_valid && change_last.designator == frame->designator && change_last_threshold == change_config.threshold) {
+		*result = change_last;
+		return HAL_OK;
+	}
+
+	ChangeSignature(buffer_number, change_sig);
+	memset(&change_last, 0, sizeof(change_last));
+	change_last.designator = frame->designator;
+	change_last.changed	   = CHANGE_TILES;							// nothing to compare with: all new
+	memset(change_last.mask, 0xFF, CHANGE_MASK_BYTES);
+
+	uint8_t newest = 0, next_slot;
+	if (ChangeRingScan(&newest, &next_slot)) {
+		for (uint8_t s = 0; s < CHANGE_RING_SLOTS; s++) {
+			uint32_t addr = ChangeSlotAddr(s);
+			if ((uint8_t)rExtMem(addr, 0, 0) != CHANGE_FRAM_MAGIC) continue;
+			uint8_t seq = (uint8_t)rExtMem(addr + 1U, 0, 0);
+			for (uint32_t i = 0; i < CHANGE_SIG_SIZE; i++) change_ref[i] = (uint8_t)rExtMem(addr + 2U + i, 0, 0);
+
+			change_result_t score;
+			score.changed = ChangeCompare(change_sig, change_ref, change_config.threshold, &score);
+			if (change_last.reference == 0 || score.changed < change_last.changed) {
+				memcpy(change_last.mask, score.mask, CHANGE_MASK_BYTES);
+				change_last.changed	  = score.changed;
+				change_last.dx		  = score.dx;
+				change_last.dy		  = score.dy;
+				change_last.reference = (uint8_t)(newest - seq) + 1U;
+			}
+		}
+	}
+	change_last_valid	  = 1;
+	change_last_threshold = change_config.threshold;
+
+	*result = change_last;
+	return HAL_OK;
+}
+
+// Saves the score of the frame just compressed with its image, and adds its
+// signature to the ring if it changed
+static void ChangeDetectStore(uint8_t buffer_number, uint8_t image_index)
+{
+	change_result_t result;
+	if (ChangeDetect(buffer_number, &result) != HAL_OK) return;
+
+	change_results[image_index] = result;
+	compressed_metadata[image_index]->changed = result.changed;
+	if (result.reference != 0 && result.changed < change_config.min_tiles) return;	// low priority, ring unchanged
+
+	uint8_t newest = 0, slot;
+	uint8_t entries = ChangeRingScan(&newest, &slot);
+	uint32_t addr = ChangeSlotAddr(slot);
+
+	wExtMem(addr, 0x00, 0, 0);
+	for (uint32_t i = 0; i < CHANGE_SIG_SIZE; i++) {
+		wExtMem(addr + 2U + i, change_sig[i], 0, 0);				// wExtMem_DataSet skips zero bytes
+	}
+	wExtMem(addr + 1U, entries ? (uint8_t)(newest + 1U) : 0U, 0, 0);
+	wExtMem(addr, CHANGE_FRAM_MAGIC, 0, 0);
+}
+
+void ChangeDetect_Clear(void)
+{
+	for (uint8_t s = 0; s < CHANGE_RING_SLOTS; s++) wExtMem(ChangeSlotAddr(s), 0x00, 0, 0);
+	change_last_valid = 0;
+}
+
+// Saves the metadata of the image just written at current_compressed_address
+// and moves the compressed store past it
+static void SaveCompressedMetadata(uint8_t quality, uint8_t format, uint16_t restarts, uint32_t size, uint16_t opcode0, uint16_t opcode1)
+{
+	compressed_metadata[current_compressed_index]->index     = current_compressed_index;
+	compressed_metadata[current_compressed_index]->quality   = quality;
+	compressed_metadata[current_compressed_index]->format    = format;
+	compressed_metadata[current_compressed_index]->restarts  = restarts;
+	compressed_metadata[current_compressed_index]->link      = JPEG_NO_LINK;
+	compressed_metadata[current_compressed_index]->changed   = CHANGE_NOT_SCORED;
+	compressed_metadata[current_compressed_index]->tile      = 0;
+	compressed_metadata[current_compressed_index]->address   = current_compressed_address;
+	compressed_metadata[current_compressed_index]->size      = size;
+	compressed_metadata[current_compressed_index]->timestamp = timestamp;
+	compressed_metadata[current_compressed_index]->opcode[0] = opcode0;	// LSB
+	compressed_metadata[current_compressed_index]->opcode[1] = opcode1;	// MSB
+
+	// Update compressed photo buffer address for next compression
+	current_compressed_address = (uint16_t*)((uint8_t*)current_compressed_address + ((size + 1U) & ~1U));	// size is in bytes, next image 2 byte aligned
+	current_compressed_index += 1;							// increments the memory pointer by one
+}
+
+// Encodes the thumbnail left at JPEG_THUMB_RAW_ADDR by the last compression
+// and stores it right after the image, linked both ways. A thumbnail that
+// doesn't fit is skipped, the image is kept
+static void StoreThumbnail(uint8_t image_index, uint16_t width, uint16_t height, uint16_t opcode0, uint16_t opcode1)
+{
+	uint32_t thumb_size = 0;
+	if (current_compressed_index < MAX_COMPRESSED_PICS &&
+		tje_encode_to_memory_ijg((uint8_t*)current_compressed_address,
+								 END_OF_MEMORY - (uint32_t)current_compressed_address,
+								 &thumb_size,
+								 JPEG_THUMB_QUALITY,
+								 TJE_THUMB_WIDTH(width),
+								 TJE_THUMB_HEIGHT(height),
+								 3,
+								 (const unsigned char *)JPEG_THUMB_RAW_ADDR)) {
+		compressed_metadata[image_index]->link = current_compressed_index;
+		SaveCompressedMetadata(JPEG_THUMB_QUALITY, JPEG_FORMAT_THUMBNAIL, 0, thumb_size, opcode0, opcode1);
+		compressed_metadata[current_compressed_index - 1]->link = image_index;
+	}
+}
+
+// Stores the quick look left at JPEG_HALF_OUT_ADDR by the last compression
+// right after the image, in place of its thumbnail, linked both ways. A quick
+// look that doesn't fit is skipped, the image is kept
+static void StoreHalf(uint8_t image_index, uint16_t restarts, uint32_t half_size, uint16_t opcode0, uint16_t opcode1)
+{
+	if (current_compressed_index < MAX_COMPRESSED_PICS &&
+		half_size <= END_OF_MEMORY - (uint32_t)current_compressed_address) {
+		memcpy((uint8_t*)current_compressed_address, (const uint8_t*)JPEG_HALF_OUT_ADDR, half_size);
+		compressed_metadata[image_index]->link = current_compressed_index;
+		SaveCompressedMetadata(jpeg_config.half_quality, JPEG_FORMAT_THUMBNAIL | JPEG_FORMAT_HALF | (restarts ? JPEG_FORMAT_RESTART : 0),
+							   restarts, half_size, opcode0, opcode1);
+		compressed_metadata[current_compressed_index - 1]->link = image_index;
+	}
+}
+
+// Restart interval in MCUs of a JPEG of the given width: one interval per
+// tile and MCU row when the image is tiled (*tile = tile MCUs), else
+// jpeg_config.restart_rows MCU rows (*tile = 0). Only baseline images whose
+// width is a whole number of tiles are tiled
+static uint32_t JpegRestartInterval(uint16_t width, uint8_t progressive, uint8_t *tile)
+{
+	uint32_t columns = (width + 7U) / 8U;
+
+	*tile = 0;
+	if (jpeg_config.tile_mcus && !progressive && (width & 7U) == 0 && columns % jpeg_config.tile_mcus == 0) {
+		*tile = jpeg_config.tile_mcus;
+		return jpeg_config.tile_mcus;
+	}
+	return (uint32_t)jpeg_config.restart_rows * columns;
+}
+
+static uint32_t JpegTablesFramAddr(uint8_t slot)
+{
+	return JPEG_QT_BASE_ADDR_FRAM + (uint32_t)(slot - 1U) * JPEG_QT_FRAM_SLOT_SIZE;
+}
+
+// Builds the encoder tables of a slot from its quantizers in FRAM
+static HAL_StatusTypeDef JpegTablesBuild(uint8_t slot)
+{
+	uint8_t  values[2U * 64U];
+	uint32_t addr = JpegTablesFramAddr(slot) + 1U;
+
+	for (uint8_t i = 0; i < sizeof(values); i++) {
+		values[i] = (uint8_t)rExtMem(addr + i, 0, 0);
+	}
+	jpeg_qt_valid[slot - 1U] = (uint8_t)tje_build_quant_tables(&jpeg_qt_tables[slot - 1U], values, values + 64U);
+	return jpeg_qt_valid[slot - 1U] ? HAL_OK : HAL_ERROR;
+}
+
+void JpegTables_Load(void)
+{
+	for (uint8_t slot = 1; slot <= JPEG_QT_SLOTS; slot++) {
+		jpeg_qt_valid[slot - 1U] = 0;
+		if ((uint8_t)rExtMem(JpegTablesFramAddr(slot), 0, 0) == JPEG_QT_FRAM_MAGIC) {
+			JpegTablesBuild(slot);
+		}
+	}
+}
+
+HAL_StatusTypeDef JpegTables_Write(uint8_t slot, uint8_t table, uint8_t first, const uint8_t *values, uint8_t count)
+{
+	if (slot == 0 || slot > JPEG_QT_SLOTS || table > 1 || first >= 64U) return HAL_ERROR;
+	if (count > 64U - first) count = 64U - first;				// last chunk of a table is short
+
+	uint32_t addr = JpegTablesFramAddr(slot);
+	jpeg_qt_valid[slot - 1U] = 0;
+	wExtMem(addr, 0x00, 0, 0);									// invalid until committed
+
+	// wExtMem_DataSet skips zero bytes, so quantizers are written byte by byte
+	for (uint8_t i = 0; i < count; i++) {
+		wExtMem(addr + 1U + (uint32_t)table * 64U + first + i, values[i], 0, 0);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef JpegTables_Commit(uint8_t slot)
+{
+	if (slot == 0 || slot > JPEG_QT_SLOTS) return HAL_ERROR;
+	if (JpegTablesBuild(slot) != HAL_OK) return HAL_ERROR;
+
+	wExtMem(JpegTablesFramAddr(slot), JPEG_QT_FRAM_MAGIC, 0, 0);	// slot valid only once complete
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CompressToJPEG(uint8_t buffer_number, uint8_t quality, uint32_t target_size, uint8_t grayscale, uint8_t qt_slot, uint32_t *compressed_size, uint8_t *opcode)
 {
 	// Validate input parameters
-	if (buffer_number >= NUM_BUFFERS || quality < 1 || quality > 3) {
+	if (buffer_number >= NUM_BUFFERS || quality > 3 || qt_slot > JPEG_QT_SLOTS ||
+		(qt_slot && !jpeg_qt_valid[qt_slot - 1U]) || current_compressed_index >= MAX_COMPRESSED_PICS) {
+		return HAL_ERROR;
+	}
+
+	// A frame still being written by DMA can't be compressed
+	if (buffer_state[buffer_number] == BUFFER_CAPTURING || buffer_state[buffer_number] == BUFFER_FREE) {
 		return HAL_ERROR;
 	}
+	buffer_state[buffer_number] = BUFFER_ENCODING;
 
 	// Pointer to raw image in external SRAM (YCbCr 4:2:2 format)
 	p = raw_buffers[buffer_number];
 
 	// Calculate available buffer size for compression
 	// (Total SRAM from compressed photos - space already used)
-	uint32_t available_buffer_size = 2 * (END_OF_MEMORY - (uint32_t)&current_compressed_address); 	// this is in bytes
+	uint32_t available_buffer_size = END_OF_MEMORY - (uint32_t)current_compressed_address; 	// this is in bytes
 
-	// TODO - If available_buffer_size is less than compressed size, we need to handle this. We need to return to start of space (FIFO)
+	// An image that doesn't fit available_buffer_size fails the encode, nothing is stored.
+	// TODO - Return to start of space (FIFO): the encoder can wrap its output (TJEOptions.wrap_*), but the
+	// store still needs to erase the oldest images and the transmit commands to read across the wrap
 
 	// Call JPEG encoder
 	// Note: raw_data is in YCbCr 4:2:2 format, which tje_encode_to_memory expects
-	int result = tje_encode_to_memory(
-		(uint8_t*)current_compressed_address,   // TODO: IMPORTANT! Check this casting
-		available_buffer_size,
-		compressed_size,
-		quality,
-		H,  // width = 640
-		L,  // height = 480
-		3,  // num_components = 3 for YCbCr
-		(const unsigned char *)(p->data)			// TODO: Check this casting
-	);
+	TJEOptions options = { 0 };
+	uint8_t	   tile;
+	options.quality			 = quality;				// 1-3 presets, 0 IJG quality
+	options.ijg_quality		 = jpeg_config.quality;
+	options.target_size		 = target_size;			// rate control picks the IJG quality that fits the budget
+	options.optimize_huffman = jpeg_config.huffman_optimize;
+	options.progressive		 = jpeg_config.progressive;
+	options.restart_interval = JpegRestartInterval(p->width, options.progressive, &tile);	// in MCUs
+	options.restart_offsets	 = restart_index[current_compressed_index];
+	options.restart_max		 = JPEG_MAX_RESTARTS;
+	options.thumbnail		 = (uint8_t*)JPEG_THUMB_RAW_ADDR;
+	options.tables			 = qt_slot ? &jpeg_qt_tables[qt_slot - 1U] : NULL;	// replace quality and rate control
+
+	// Two pass modes keep the coefficients of pass 1 above the output: upper
+	// half of the free compressed space, up to the end of JPEG_SCRATCH
+	uint32_t output_size = available_buffer_size;
+	if (options.optimize_huffman || options.progressive) {
+		output_size = (available_buffer_size / 2U) & ~3U;
+	}
+	uint32_t scratch_addr = ((uint32_t)current_compressed_address + output_size + 3U) & ~3U;
+	options.scratch			 = (uint8_t*)scratch_addr;
+	options.scratch_size	 = JPEG_THUMB_RAW_ADDR - scratch_addr;
+
+	// Quick look from the same read of the frame: one pass baseline only. It
+	// is encoded into JPEG_SCRATCH and copied after the image once both are done
+	uint8_t	   half = jpeg_config.half_quality && (target_size == 0 || qt_slot) && !options.optimize_huffman &&
+					  !options.progressive && current_compressed_index + 1U < MAX_COMPRESSED_PICS;
+	TJEOptions half_options = { 0 };
+	uint32_t   half_size	= 0;
+	uint8_t	   half_tile	= 0;
+
+	uint32_t cycles = DWT->CYCCNT;					// running since FRAM_InitDelay
+	int result;
+	if (half) {
+		half_options.ijg_quality	  = jpeg_config.half_quality;
+		half_options.restart_interval = JpegRestartInterval(TJE_HALF_WIDTH(p->width), 0, &half_tile);
+		half_options.restart_offsets  = restart_index[current_compressed_index + 1U];	// the index it is stored at
+		half_options.restart_max	  = JPEG_MAX_RESTARTS;
+		options.thumbnail = NULL;
+		result = tje_encode_to_memory_dual(
+			(uint8_t*)current_compressed_address,
+			available_buffer_size,
+			compressed_size,
+			&options,
+			(uint8_t*)JPEG_HALF_OUT_ADDR,
+			JPEG_HALF_OUT_SIZE,
+			&half_size,
+			&half_options,
+			(uint8_t*)JPEG_HALF_STRIP_ADDR,
+			p->width,
+			p->height,
+			grayscale ? 1 : 3,
+			(const unsigned char *)(p->data)
+		);
+	}
+	else {
+		result = tje_encode_to_memory_opt(
+			(uint8_t*)current_compressed_address,   // TODO: IMPORTANT! Check this casting
+			output_size,
+			compressed_size,
+			&options,
+			p->width,  // 640 unless cropped
+			p->height, // 480 unless cropped
+			grayscale ? 1 : 3,  // num_components = 3 for YCbCr, 1 reads only Y
+			(const unsigned char *)(p->data)			// TODO: Check this casting
+		);
+	}
+	cycles = DWT->CYCCNT - cycles;
+	int quality_used = qt_slot ? qt_slot : (target_size == 0 && quality != 0) ? quality : options.ijg_quality;
 
 	if (result == 0) {
 		// Compression failed
 		*compressed_size = 0;
+		buffer_state[buffer_number] = BUFFER_CAPTURED;		// raw frame is still valid, can be retried
 		return HAL_ERROR;
 	}
+	buffer_state[buffer_number] = BUFFER_DONE;
+	jpeg_cycles_per_mcu = cycles / (((p->width + 7U) / 8U) * ((p->height + 7U) / 8U));
+	jpeg_flat_blocks	= options.flat_blocks;
 
 	uint16_t opcode0 = (opcode[1] << 8) | opcode[0];
 	uint16_t opcode1 = (opcode[3] << 8) | opcode[2];
+	uint8_t  format  = (options.progressive ? JPEG_FORMAT_PROGRESSIVE : 0) |
+					   (options.restart_count ? JPEG_FORMAT_RESTART : 0) |
+					   (grayscale ? JPEG_FORMAT_GRAYSCALE : 0) |
+					   (qt_slot ? JPEG_FORMAT_CUSTOM_QT : 0);
+	uint8_t  image_index = current_compressed_index;
+	SaveCompressedMetadata((uint8_t)quality_used, format, (uint16_t)options.restart_count, *compressed_size, opcode0, opcode1);
+	compressed_metadata[image_index]->tile = tile;
 
-	// saves metadata before saving raw image
-	compressed_metadata[current_compressed_index]->index     = current_compressed_index;
-	compressed_metadata[current_compressed_index]->address   = current_compressed_address;
-	compressed_metadata[current_compressed_index]->size      = *compressed_size;
-	compressed_metadata[current_compressed_index]->timestamp = timestamp;
-	compressed_metadata[current_compressed_index]->opcode[0] = opcode0;	// LSB
-	compressed_metadata[current_compressed_index]->opcode[1] = opcode1;	// MSB
+	// Quick look or thumbnail, both from the same pass
+	if (half) {
+		StoreHalf(image_index, (uint16_t)half_options.restart_count, half_size, opcode0, opcode1);
+		if (compressed_metadata[image_index]->link != JPEG_NO_LINK) {
+			compressed_metadata[compressed_metadata[image_index]->link]->tile = half_tile;
+		}
+	}
+	else {
+		StoreThumbnail(image_index, p->width, p->height, opcode0, opcode1);
+	}
 
-	// Update compressed photo buffer address for next compression
-	current_compressed_address += *compressed_size; 		// Saves compressed photo in current write address
-	current_compressed_index += 1;							// increments the memory pointer by one
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef JpegTile_Info(uint8_t image_index, uint16_t tile, jpeg_tile_t *info)
+{
+	if (image_index >= current_compressed_index || compressed_metadata[image_index]->tile == 0) {
+		return HAL_ERROR;
+	}
+	const uint8_t *file = (const uint8_t*)compressed_metadata[image_index]->address;
+	const uint32_t *offsets = restart_index[image_index];
+	uint16_t restarts = compressed_metadata[image_index]->restarts;
+	uint16_t tile_mcus = compressed_metadata[image_index]->tile;
+	uint32_t size = compressed_metadata[image_index]->size;
+
+	// Marker segments up to the first interval, for the SOF0 with the image size
+	uint32_t header = offsets[0];
+	uint32_t sof = 0;
+	for (uint32_t pos = 2; pos + 4U <= header && file[pos] == 0xFF; pos += 2U + ((file[pos + 2] << 8) | file[pos + 3])) {
+		if (file[pos + 1] == 0xC0) {
+			sof = pos;
+			break;
+		}
+	}
+	if (sof == 0 || sof + 9U > header || header > 0xFFFF) return HAL_ERROR;
+
+	uint16_t height = (file[sof + 5] << 8) | file[sof + 6];
+	uint16_t width	= (file[sof + 7] << 8) | file[sof + 8];
+	uint16_t mcu_rows = (height + 7U) / 8U;
+	uint16_t tile_px  = tile_mcus * 8U;
+	info->columns = width / tile_px;
+	info->rows	  = (mcu_rows + tile_mcus - 1U) / tile_mcus;
+	if (info->columns == 0 || (uint32_t)mcu_rows * info->columns != restarts || restarts > JPEG_MAX_RESTARTS ||
+		tile >= info->columns * info->rows) {
+		return HAL_ERROR;							// not the intervals of a tiled image, or no such tile
+	}
+
+	uint16_t row = tile / info->columns;
+	info->width		= tile_px;
+	info->height	= (height - row * tile_px < tile_px) ? height - row * tile_px : tile_px;
+	info->first		= row * tile_mcus * info->columns + tile % info->columns;
+	info->intervals = (info->height + 7U) / 8U;
+	info->header	= (uint16_t)header;
+	info->sof		= (uint16_t)sof;
+
+	// Header, then every interval without its RSTn (the image EOI for the
+	// last one) and 2 bytes of marker
+	info->size = header;
+	for (uint16_t j = 0; j < info->intervals; j++) {
+		uint16_t k = info->first + j * info->columns;
+		uint32_t end = (k + 1U < restarts) ? offsets[k + 1] : size;
+		info->size += end - offsets[k];
+	}
+	return HAL_OK;
+}
+
+// Copies what falls in [offset, offset + count) of the bytes at [start,
+// start + length) of the tile file from src. Returns the bytes copied
+static uint32_t JpegTileCopy(uint32_t start, uint32_t length, const uint8_t *src, uint32_t offset, uint8_t *dst, uint32_t count)
+{
+	uint32_t from = (offset > start) ? offset : start;
+	uint32_t to	  = (offset + count < start + length) ? offset + count : start + length;
+	if (from >= to) return 0;
+	memcpy(dst + (from - offset), src + (from - start), to - from);
+	return to - from;
+}
+
+uint32_t JpegTile_Read(uint8_t image_index, const jpeg_tile_t *info, uint32_t offset, uint8_t *dst, uint32_t count)
+{
+	if (offset >= info->size) return 0;
+	if (count > info->size - offset) count = info->size - offset;
+
+	const uint8_t *file = (const uint8_t*)compressed_metadata[image_index]->address;
+	const uint32_t *offsets = restart_index[image_index];
+	uint16_t restarts = compressed_metadata[image_index]->restarts;
+	uint32_t size = compressed_metadata[image_index]->size;
+
+	// Header, with the tile size in the SOF0
+	JpegTileCopy(0, info->header, file, offset, dst, count);
+	uint8_t dimensions[4] = { (uint8_t)(info->height >> 8), (uint8_t)info->height,
+							  (uint8_t)(info->width >> 8), (uint8_t)info->width };
+	JpegTileCopy(info->sof + 5U, sizeof(dimensions), dimensions, offset, dst, count);
+
+	// Intervals, renumbered RSTn between them, EOI after the last
+	uint32_t start = info->header;
+	for (uint16_t j = 0; j < info->intervals && start < offset + count; j++) {
+		uint16_t k = info->first + j * info->columns;
+		uint32_t end = ((k + 1U < restarts) ? offsets[k + 1] : size) - 2U;
+		uint8_t	 marker[2] = { 0xFF, (j + 1U < info->intervals) ? (uint8_t)(0xD0 + (j & 7U)) : 0xD9 };
+		JpegTileCopy(start, end - offsets[k], file + offsets[k], offset, dst, count);
+		start += end - offsets[k];
+		JpegTileCopy(start, sizeof(marker), marker, offset, dst, count);
+		start += sizeof(marker);
+	}
+	return count;
+}
+
+HAL_StatusTypeDef CompressToWavelet(uint8_t buffer_number, uint8_t quality, uint32_t target_size, uint32_t *compressed_size, uint8_t *opcode)
+{
+	static const uint8_t stop_planes[4] = { 0, 3, 2, 1 };	// lowest bit plane coded: lossless, poor, standard, good
+
+	if (buffer_number >= NUM_BUFFERS || quality > 3 || current_compressed_index >= MAX_COMPRESSED_PICS) {
+		return HAL_ERROR;
+	}
+	if (buffer_state[buffer_number] == BUFFER_CAPTURING || buffer_state[buffer_number] == BUFFER_FREE) {
+		return HAL_ERROR;
+	}
+	buffer_state[buffer_number] = BUFFER_ENCODING;
+	p = raw_buffers[buffer_number];
+
+	// One strip of coefficients at a time, in JPEG_SCRATCH
+	wavelet_options_t options = { 0 };
+	options.target_size = target_size;
+	options.stop_plane	= stop_planes[quality];
+	options.work		= (uint8_t*)JPEG_SCRATCH_ADDR;
+	options.work_size	= JPEG_THUMB_RAW_ADDR - JPEG_SCRATCH_ADDR;
+	options.thumbnail	= (uint8_t*)JPEG_THUMB_RAW_ADDR;
+
+	HAL_StatusTypeDef st = Wavelet_Encode((const uint8_t *)(p->data), p->width, p->height,
+										  (uint8_t*)current_compressed_address,
+										  END_OF_MEMORY - (uint32_t)current_compressed_address,
+										  compressed_size, &options);
+	if (st != HAL_OK) {
+		*compressed_size = 0;
+		buffer_state[buffer_number] = BUFFER_CAPTURED;		// raw frame is still valid, can be retried
+		return HAL_ERROR;
+	}
+	buffer_state[buffer_number] = BUFFER_DONE;
+
+	uint16_t opcode0 = (opcode[1] << 8) | opcode[0];
+	uint16_t opcode1 = (opcode[3] << 8) | opcode[2];
+	uint8_t  image_index = current_compressed_index;
+	SaveCompressedMetadata(options.stop_plane, FORMAT_CODEC_WAVELET, 0, *compressed_size, opcode0, opcode1);
+
+	// Thumbnail from LL3, written by the encoder
+	StoreThumbnail(image_index, p->width, p->height, opcode0, opcode1);
 
 	return HAL_OK;
 }
 
+HAL_StatusTypeDef CompressLossless(uint8_t buffer_number, uint32_t *compressed_size, uint8_t *opcode)
+{
+	if (buffer_number >= NUM_BUFFERS || current_compressed_index >= MAX_COMPRESSED_PICS) {
+		return HAL_ERROR;
+	}
+	if (buffer_state[buffer_number] == BUFFER_CAPTURING || buffer_state[buffer_number] == BUFFER_FREE) {
+		return HAL_ERROR;
+	}
+	buffer_state[buffer_number] = BUFFER_ENCODING;
+	p = raw_buffers[buffer_number];
+
+	HAL_StatusTypeDef st = Rice_Encode((const uint8_t *)(p->data), p->width, p->height,
+									   (uint8_t*)current_compressed_address,
+									   END_OF_MEMORY - (uint32_t)current_compressed_address,
+									   compressed_size, (uint8_t*)JPEG_THUMB_RAW_ADDR);
+	if (st != HAL_OK) {
+		*compressed_size = 0;
+		buffer_state[buffer_number] = BUFFER_CAPTURED;		// raw frame is still valid, can be retried
+		return HAL_ERROR;
+	}
+	buffer_state[buffer_number] = BUFFER_DONE;
+
+	uint16_t opcode0 = (opcode[1] << 8) | opcode[0];
+	uint16_t opcode1 = (opcode[3] << 8) | opcode[2];
+	uint8_t  image_index = current_compressed_index;
+	SaveCompressedMetadata(0, FORMAT_CODEC_RICE, 0, *compressed_size, opcode0, opcode1);
+
+	// Thumbnail from the block averages of the same pass
+	StoreThumbnail(image_index, p->width, p->height, opcode0, opcode1);
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef CompressPhoto(uint8_t buffer_number, uint8_t codec, uint8_t quality, uint32_t target_size, uint8_t qt_slot, uint32_t *compressed_size, uint8_t *opcode)
+{
+	if (jpeg_job_status.state == JPEG_JOB_RUNNING) {
+		return HAL_ERROR;								// compressed space and JPEG_SCRATCH belong to the background job
+	}
+	if (current_compressed_index >= MAX_COMPRESSED_PICS) {
+		return HAL_ERROR;								// no metadata / restart index slot left
+	}
+
+	uint8_t image_index = current_compressed_index;
+	HAL_StatusTypeDef st;
+	switch (codec) {
+	case CODEC_JPEG:
+		st = CompressToJPEG(buffer_number, quality, target_size, 0, qt_slot, compressed_size, opcode);
+		break;
+	case CODEC_JPEG_GRAY:
+		st = CompressToJPEG(buffer_number, quality, target_size, 1, qt_slot, compressed_size, opcode);
+		break;
+	case CODEC_WAVELET:
+		st = CompressToWavelet(buffer_number, quality, target_size, compressed_size, opcode);
+		break;
+	case CODEC_RICE:
+		st = CompressLossless(buffer_number, compressed_size, opcode);
+		break;
+	default:
+		return HAL_ERROR;
+	}
+
+	// The raw frame is still there (BUFFER_DONE): scored after the encode
+	if (st == HAL_OK && change_config.enabled) {
+		ChangeDetectStore(buffer_number, image_index);
+	}
+	return st;
+}
+
+// Sum of the output bytes just before the resume point: a checkpoint whose
+// output is gone from SRAM doesn't match it
+static uint16_t JobCheck(const jpeg_job_t *job)
+{
+	uint32_t end   = job->enc.resume.bytes_written;
+	uint32_t start = (end > JPEG_JOB_CHECK_BYTES) ? end - JPEG_JOB_CHECK_BYTES : 0;
+	uint16_t sum   = 0;
+
+	for (uint32_t i = start; i < end; i++) {
+		sum += job->enc.memory_buffer[i];
+	}
+	return sum;
+}
+
+static uint32_t JobSlotAddr(uint8_t sequence)
+{
+	return JPEG_JOB_BASE_ADDR_FRAM + (uint32_t)(sequence & 1U) * JPEG_JOB_FRAM_SLOT_SIZE;
+}
+
+// Slot: magic, then the job. The slot written is the older one and it is
+// invalidated first, so a reset in the middle leaves the previous checkpoint
+static void JobCheckpoint(void)
+{
+	jpeg_job.sequence++;
+	jpeg_job.check = JobCheck(&jpeg_job);
+
+	uint32_t addr = JobSlotAddr(jpeg_job.sequence);
+	const uint8_t *b = (const uint8_t*)&jpeg_job;
+
+	wExtMem(addr, 0x00, 0, 0);
+	for (uint32_t i = 0; i < sizeof(jpeg_job_t); i++) {
+		wExtMem(addr + 1U + i, b[i], 0, 0);							// wExtMem_DataSet skips zero bytes
+	}
+	wExtMem(addr, JPEG_JOB_FRAM_MAGIC, 0, 0);
+}
+
+static void JobClearCheckpoint(void)
+{
+	wExtMem(JobSlotAddr(0), 0x00, 0, 0);
+	wExtMem(JobSlotAddr(1), 0x00, 0, 0);
+}
+
+// Newest valid slot into job. 0 if there is none
+static uint8_t JobLoadCheckpoint(jpeg_job_t *job)
+{
+	jpeg_job_t slot;
+	uint8_t found = 0;
+
+	for (uint8_t s = 0; s < 2; s++) {
+		uint32_t addr = JobSlotAddr(s);
+		if ((uint8_t)rExtMem(addr, 0, 0) != JPEG_JOB_FRAM_MAGIC) continue;
+
+		uint8_t *b = (uint8_t*)&slot;
+		for (uint32_t i = 0; i < sizeof(jpeg_job_t); i++) {
+			b[i] = (uint8_t)rExtMem(addr + 1U + i, 0, 0);
+		}
+		if (!found || (int8_t)(slot.sequence - job->sequence) > 0) {
+			*job = slot;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+HAL_StatusTypeDef CompressToJPEG_Start(uint8_t buffer_number, uint8_t quality, uint8_t grayscale, uint8_t rows_per_step, uint8_t *opcode)
+{
+	if (buffer_number >= NUM_BUFFERS || quality > 3 || jpeg_job_status.state == JPEG_JOB_RUNNING ||
+		current_compressed_index >= MAX_COMPRESSED_PICS) {
+		return HAL_ERROR;
+	}
+	if (buffer_state[buffer_number] == BUFFER_CAPTURING || buffer_state[buffer_number] == BUFFER_FREE) {
+		return HAL_ERROR;
+	}
+	p = raw_buffers[buffer_number];
+
+	TJEOptions options = { 0 };
+	uint8_t	   tile;
+	options.quality			 = quality;				// 1-3 presets, 0 IJG quality
+	options.ijg_quality		 = jpeg_config.quality;
+	options.restart_interval = JpegRestartInterval(p->width, 0, &tile);	// in MCUs
+	options.restart_offsets	 = restart_index[current_compressed_index];
+	options.restart_max		 = JPEG_MAX_RESTARTS;
+	options.thumbnail		 = (uint8_t*)JPEG_THUMB_RAW_ADDR;
+
+	if (!tje_encode_begin(&jpeg_job.enc,
+						  (uint8_t*)current_compressed_address,
+						  END_OF_MEMORY - (uint32_t)current_compressed_address,
+						  &options,
+						  p->width,
+						  p->height,
+						  grayscale ? 1 : 3,
+						  (const unsigned char *)(p->data))) {
+		return HAL_ERROR;
+	}
+	buffer_state[buffer_number] = BUFFER_ENCODING;
+
+	jpeg_job.buffer_number = buffer_number;
+	jpeg_job.image_index   = current_compressed_index;
+	jpeg_job.quality	   = quality ? quality : jpeg_config.quality;
+	jpeg_job.format		   = grayscale ? JPEG_FORMAT_GRAYSCALE : 0;
+	jpeg_job.rows_per_step = rows_per_step ? rows_per_step : JPEG_JOB_DEFAULT_ROWS;
+	jpeg_job.tile		   = tile;
+	memcpy(jpeg_job.opcode, opcode, sizeof(jpeg_job.opcode));
+	jpeg_job.cycles		   = 0;
+
+	jpeg_job_status.state		  = JPEG_JOB_RUNNING;
+	jpeg_job_status.resumed		  = 0;
+	jpeg_job_status.buffer_number = buffer_number;
+	jpeg_job_status.image_index	  = current_compressed_index;
+	jpeg_job_status.rows_done	  = 0;
+	jpeg_job_status.rows_total	  = (uint16_t)((p->height + 7U) / 8U);
+	jpeg_job_status.size		  = jpeg_job.enc.resume.bytes_written;
+
+	JobCheckpoint();
+	return HAL_OK;
+}
+
+void CompressJob_Step(void)
+{
+	if (jpeg_job_status.state != JPEG_JOB_RUNNING) return;
+
+	uint32_t cycles = DWT->CYCCNT;
+	int st = tje_encode_step(&jpeg_job.enc, jpeg_job.rows_per_step);
+	jpeg_job.cycles += DWT->CYCCNT - cycles;
+	jpeg_job_status.rows_done = (uint16_t)jpeg_job.enc.resume.mcu_row;
+	jpeg_job_status.size	  = jpeg_job.enc.resume.bytes_written;
+
+	if (st == TJE_STEP_MORE) {
+		JobCheckpoint();
+		return;
+	}
+	JobClearCheckpoint();
+
+	if (st == TJE_STEP_ERROR) {
+		buffer_state[jpeg_job.buffer_number] = BUFFER_CAPTURED;		// raw frame is still valid, can be retried
+		jpeg_job_status.state = JPEG_JOB_FAILED;
+		jpeg_job_status.size  = 0;
+		Log("Background compression failed: out of compressed space");
+		return;
+	}
+	buffer_state[jpeg_job.buffer_number] = BUFFER_DONE;
+	jpeg_cycles_per_mcu = jpeg_job.cycles / ((uint32_t)jpeg_job_status.rows_total * ((jpeg_job.enc.width + 7U) / 8U));
+	jpeg_flat_blocks	= jpeg_job.enc.resume.flat_blocks;
+
+	uint16_t opcode0 = (jpeg_job.opcode[1] << 8) | jpeg_job.opcode[0];
+	uint16_t opcode1 = (jpeg_job.opcode[3] << 8) | jpeg_job.opcode[2];
+	uint16_t restarts = (uint16_t)jpeg_job.enc.resume.restart_count;
+	uint8_t  format	  = jpeg_job.format | (restarts ? JPEG_FORMAT_RESTART : 0);
+	SaveCompressedMetadata(jpeg_job.quality, format, restarts, jpeg_job.enc.resume.bytes_written, opcode0, opcode1);
+	compressed_metadata[jpeg_job.image_index]->tile = jpeg_job.tile;
+	StoreThumbnail(jpeg_job.image_index, jpeg_job.enc.width, jpeg_job.enc.height, opcode0, opcode1);
+
+	jpeg_job_status.state = JPEG_JOB_DONE;
+}
+
+void CompressJob_Resume(void)
+{
+	jpeg_job_t job;
+	if (!JobLoadCheckpoint(&job)) return;
+
+	uint32_t address = (uint32_t)job.enc.memory_buffer;
+	if (job.buffer_number >= NUM_BUFFERS || job.image_index >= MAX_COMPRESSED_PICS ||
+		address < COMPRESSED_DATA_BASE_ADDR || address >= END_OF_MEMORY ||
+		job.enc.memory_buffer[0] != 0xFF || job.enc.memory_buffer[1] != 0xD8 ||		// SOI
+		JobCheck(&job) != job.check) {
+		JobClearCheckpoint();
+		Log("Background compression checkpoint dropped: SRAM content lost");
+		return;
+	}
+
+	// The compressed store continues from the image being written
+	jpeg_job = job;
+	current_compressed_index   = job.image_index;
+	current_compressed_address = (uint16_t*)job.enc.memory_buffer;
+	buffer_state[job.buffer_number] = BUFFER_ENCODING;
+
+	jpeg_job_status.state		  = JPEG_JOB_RUNNING;
+	jpeg_job_status.resumed		  = 1;
+	jpeg_job_status.buffer_number = job.buffer_number;
+	jpeg_job_status.image_index	  = job.image_index;
+	jpeg_job_status.rows_done	  = (uint16_t)job.enc.resume.mcu_row;
+	jpeg_job_status.rows_total	  = (uint16_t)((job.enc.height + 7U) / 8U);
+	jpeg_job_status.size		  = job.enc.resume.bytes_written;
+
+	char text[60];
+	snprintf(text, sizeof(text), "Background compression resumed at MCU row %u", jpeg_job_status.rows_done);
+	Log(text);
+}
+
 void init_camera_buffers(void)
 {
 	// Raw photo buffers
@@ -230,12 +1651,20 @@ void init_camera_buffers(void)
     raw_buffers[1] = raw_buffer_2;
     raw_buffers[2] = raw_buffer_3;
 
+    for (uint8_t i = 0; i < NUM_BUFFERS; i++) {
+    	buffer_state[i] = BUFFER_FREE;
+    	raw_buffers[i]->width  = H;
+    	raw_buffers[i]->height = L;
+    }
+    frame_done = 1;									// no capture in progress
+
     // compressed metadata buffer - SRAM
     for (int i = 0; i < MAX_COMPRESSED_PICS; i++) {
 		compressed_metadata[i] = (compressed_metadata_t*)(COMPRESSED_METADATA_BASE_ADDR + i * sizeof(compressed_metadata_t));
+		restart_index[i] = (uint32_t*)(RESTART_INDEX_BASE_ADDR + i * JPEG_MAX_RESTARTS * sizeof(uint32_t));
 	}
 
-    compressed_photo_space = (uint16_t*)( COMPRESSED_METADATA_BASE_ADDR + MAX_COMPRESSED_PICS * sizeof(compressed_metadata_t) );
+    compressed_photo_space = (uint16_t*)( COMPRESSED_DATA_BASE_ADDR );
     current_compressed_address = &compressed_photo_space[0];
     current_compressed_index = 0;
 
@@ -0,0 +1,196 @@
+/*
+ * rice.c - CCSDS 121.0 style lossless encoder (unit delay prediction + adaptive Rice coding)
+ *
+ *  Created on: Mar 9, 2026
+ *      Author: finazzi
+ */
+
+#include "rice.h"
+#include "jpeg.h"
+#include <string.h>
+
+typedef struct {
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t pos;
+	uint32_t acc;
+	uint8_t  nbits;					  // bits in acc not written yet, < 8 between calls
+	uint8_t  overflow;
+} rice_writer_t;
+
+// One plane of the 4:2:2 frame: sample (x, y) at base[y * row_bytes + x * step]
+typedef struct {
+	const uint8_t *base;
+	uint32_t row_bytes;
+	uint8_t  step;
+	uint16_t width;
+	uint16_t height;
+	uint8_t  thumb_offset;			  // byte of the thumbnail pair it fills: 0 Y, 1 Cb, 3 Cr
+} rice_plane_t;
+
+// count <= 24, MSB first
+static void PutBits(rice_writer_t *wr, uint32_t value, uint8_t count)
+{
+	wr->acc = (wr->acc << count) | (value & ((1UL << count) - 1U));
+	wr->nbits += count;
+	while (wr->nbits >= 8) {
+		wr->nbits -= 8;
+		if (wr->pos >= wr->size) {
+			wr->overflow = 1;
+			return;
+		}
+		wr->buf[wr->pos++] = (uint8_t)(wr->acc >> wr->nbits);
+	}
+}
+
+// Fundamental sequence codeword: value zeros and a one
+static void PutFS(rice_writer_t *wr, uint32_t value)
+{
+	while (value >= 16U) {
+		PutBits(wr, 0, 16);
+		value -= 16U;
+	}
+	PutBits(wr, 1, (uint8_t)(value + 1U));
+}
+
+// Prediction error mapper (CCSDS 121.0 4.3.2), samples in [0, 255]
+static uint8_t MapResidual(uint8_t x, uint8_t predicted)
+{
+	int16_t delta = (int16_t)x - predicted;
+	int16_t theta = (predicted < 255 - predicted) ? predicted : 255 - predicted;
+
+	if (delta >= 0 && delta <= theta)  return (uint8_t)(2 * delta);
+	if (delta < 0 && delta >= -theta)  return (uint8_t)(-2 * delta - 1);
+	return (uint8_t)(theta + ((delta < 0) ? -delta : delta));
+}
+
+// Codes one block with the option that gives the fewest bits
+static void EncodeBlock(rice_writer_t *wr, const uint8_t *d)
+{
+	uint32_t best_bits = RICE_BLOCK_SIZE * RICE_SAMPLE_BITS;
+	uint8_t  best_id   = RICE_ID_NO_COMPRESSION;
+
+	for (uint8_t k = 0; k <= RICE_K_MAX; k++) {
+		uint32_t bits = (uint32_t)k * RICE_BLOCK_SIZE;
+		for (uint8_t i = 0; i < RICE_BLOCK_SIZE; i++) bits += (uint32_t)(d[i] >> k) + 1U;
+		if (bits < best_bits) {
+			best_bits = bits;
+			best_id   = k + 1U;										// 001 FS, 010-110 split k
+		}
+	}
+
+	uint32_t extension_bits = 1U;									// 4th id bit
+	for (uint8_t i = 0; i < RICE_BLOCK_SIZE; i += 2) {
+		uint32_t sum = (uint32_t)d[i] + d[i + 1];
+		extension_bits += sum * (sum + 1U) / 2U + d[i + 1] + 1U;
+	}
+	if (extension_bits < best_bits) {
+		best_id = RICE_ID_EXTENSION;
+	}
+
+	PutBits(wr, best_id, RICE_ID_BITS);
+	if (best_id == RICE_ID_EXTENSION) {
+		PutBits(wr, 1, 1);
+		for (uint8_t i = 0; i < RICE_BLOCK_SIZE; i += 2) {
+			uint32_t sum = (uint32_t)d[i] + d[i + 1];
+			PutFS(wr, sum * (sum + 1U) / 2U + d[i + 1]);
+		}
+	}
+	else if (best_id == RICE_ID_NO_COMPRESSION) {
+		for (uint8_t i = 0; i < RICE_BLOCK_SIZE; i++) PutBits(wr, d[i], RICE_SAMPLE_BITS);
+	}
+	else {
+		uint8_t k = best_id - 1U;
+		for (uint8_t i = 0; i < RICE_BLOCK_SIZE; i++) PutFS(wr, d[i] >> k);
+		for (uint8_t i = 0; k && i < RICE_BLOCK_SIZE; i++) PutBits(wr, d[i], k);	// k LSBs of every sample
+	}
+}
+
+static void EncodePlane(rice_writer_t *wr, const rice_plane_t *plane, uint16_t thumb_width, uint8_t *thumbnail)
+{
+	uint8_t  block[RICE_BLOCK_SIZE];
+	uint8_t  fill = 0;
+	uint32_t sums[RICE_MAX_WIDTH / 8U];								// 8x8 pixel blocks of the current band
+	uint16_t columns = (plane->width + 7U) / 8U;					// thumbnail pixels (Y) or pairs (chroma)
+
+	memset(sums, 0, sizeof(sums));
+	for (uint16_t y = 0; y < plane->height && !wr->overflow; y++) {
+		const uint8_t *row = plane->base + (uint32_t)y * plane->row_bytes;
+
+		for (uint16_t x = 0; x < plane->width; x++) {
+			uint8_t sample = row[(uint32_t)x * plane->step];
+			uint8_t predicted = (x > 0) ? row[(uint32_t)(x - 1) * plane->step] :
+								(y > 0) ? *(row - plane->row_bytes) : 128;
+
+			block[fill++] = MapResidual(sample, predicted);
+			if (fill == RICE_BLOCK_SIZE) {
+				EncodeBlock(wr, block);
+				fill = 0;
+			}
+			sums[x / 8U] += sample;
+		}
+
+		// End of a band of 8 rows: averages to the thumbnail
+		if (thumbnail && ((y & 7U) == 7U || y == plane->height - 1U)) {
+			uint16_t band_rows = (y & 7U) + 1U;
+			uint8_t *t = thumbnail + (uint32_t)(y / 8U) * thumb_width * 2U;
+			for (uint16_t c = 0; c < columns; c++) {
+				uint16_t band_width = (plane->width - c * 8U < 8U) ? (plane->width - c * 8U) : 8U;
+				uint32_t count = (uint32_t)band_width * band_rows;
+				uint8_t  average = (uint8_t)((sums[c] + count / 2U) / count);
+				if (plane->thumb_offset == 0) t[c * 2U] = average;					// Y of pixel c
+				else						  t[c * 4U + plane->thumb_offset] = average;	// chroma of pair c
+			}
+			if (plane->thumb_offset == 0 && columns < thumb_width) {
+				t[columns * 2U] = t[(columns - 1U) * 2U];			// odd number of blocks
+			}
+			memset(sums, 0, sizeof(sums));
+		}
+	}
+
+	if (fill) {
+		memset(&block[fill], 0, RICE_BLOCK_SIZE - fill);
+		EncodeBlock(wr, block);
+	}
+}
+
+HAL_StatusTypeDef Rice_Encode(const uint8_t *src, uint16_t width, uint16_t height,
+							  uint8_t *dst, uint32_t dst_size, uint32_t *bytes_written,
+							  uint8_t *thumbnail)
+{
+	if (!src || !dst || width == 0 || height == 0 || (width & 1U) || width > RICE_MAX_WIDTH ||
+		dst_size < RICE_HEADER_SIZE) {
+		return HAL_ERROR;
+	}
+
+	uint8_t header[RICE_HEADER_SIZE] = { 'R', '1', '2', '1',
+										 (uint8_t)(width & 0xFF), (uint8_t)(width >> 8),
+										 (uint8_t)(height & 0xFF), (uint8_t)(height >> 8),
+										 RICE_BLOCK_SIZE, RICE_SAMPLE_BITS, 3 };
+	memcpy(dst, header, RICE_HEADER_SIZE);
+
+	rice_writer_t wr = { 0 };
+	wr.buf  = dst + RICE_HEADER_SIZE;
+	wr.size = dst_size - RICE_HEADER_SIZE;
+
+	// [Y0, Cb, Y1, Cr] for every 2 pixels
+	uint32_t row_bytes = (uint32_t)width * 2U;
+	const rice_plane_t planes[3] = {
+		{ src,		row_bytes, 2, width,	  height, 0 },
+		{ src + 1,	row_bytes, 4, width / 2U, height, 1 },
+		{ src + 3,	row_bytes, 4, width / 2U, height, 3 },
+	};
+	uint16_t thumb_width = TJE_THUMB_WIDTH(width);
+	for (uint8_t i = 0; i < 3; i++) {
+		EncodePlane(&wr, &planes[i], thumb_width, thumbnail);
+	}
+	if (wr.nbits) {
+		PutBits(&wr, 0, 8U - wr.nbits);
+	}
+	if (wr.overflow) {
+		return HAL_ERROR;
+	}
+
+	*bytes_written = RICE_HEADER_SIZE + wr.pos;
+	return HAL_OK;
+}
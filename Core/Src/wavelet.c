@@ -0,0 +1,245 @@
+/*
+ * wavelet.c - CCSDS 122.0 style wavelet image encoder (integer 9/7M DWT + bit plane coding)
+ *
+ *  Created on: Mar 2, 2026
+ *      Author: finazzi
+ */
+
+#include "wavelet.h"
+#include "jpeg.h"
+#include <string.h>
+
+typedef struct {
+	uint8_t *buf;
+	uint32_t size;					  // bytes the segment may use
+	uint32_t pos;
+	uint8_t  acc;
+	uint8_t  nbits;
+	uint8_t  full;					  // 1 once a byte was dropped, the rest of the segment is cut
+	uint8_t  k;						  // run length code parameter
+	uint32_t run;					  // zeros not coded yet
+} wavelet_writer_t;
+
+typedef struct {
+	uint16_t x, y, w, h;
+} wavelet_band_t;
+
+// Bits MSB first
+static void PutBits(wavelet_writer_t *wr, uint32_t value, uint8_t count)
+{
+	while (count-- && !wr->full) {
+		wr->acc = (uint8_t)((wr->acc << 1) | ((value >> count) & 1U));
+		if (++wr->nbits == 8) {
+			if (wr->pos >= wr->size) {
+				wr->full = 1;
+				return;
+			}
+			wr->buf[wr->pos++] = wr->acc;
+			wr->nbits = 0;
+		}
+	}
+}
+
+// Adaptive run length code of the significance bits: '0' for 2^k zeros,
+// '1' + k bits for the zeros before a one. k follows the density of ones
+static void PutSignificance(wavelet_writer_t *wr, uint8_t bit)
+{
+	if (!bit) {
+		if (++wr->run == (1UL << wr->k)) {
+			PutBits(wr, 0, 1);
+			wr->run = 0;
+			if (wr->k < WAVELET_RUN_K_MAX) wr->k++;
+		}
+		return;
+	}
+	PutBits(wr, 1, 1);
+	PutBits(wr, wr->run, wr->k);
+	wr->run = 0;
+	if (wr->k > 0) wr->k--;
+}
+
+// Zeros left at the end of a pass: the decoder knows where the pass ends
+static void FlushSignificance(wavelet_writer_t *wr)
+{
+	if (wr->run) {
+		PutBits(wr, 0, 1);
+		wr->run = 0;
+		if (wr->k < WAVELET_RUN_K_MAX) wr->k++;
+	}
+}
+
+static int32_t Mirror(int32_t i, int32_t n)
+{
+	while (i < 0 || i > n - 1) {
+		i = (i < 0) ? -i : 2 * (n - 1) - i;
+	}
+	return i;
+}
+
+// Integer 9/7M (CCSDS 122.0 3.3.2) of n samples (n even) spaced by stride,
+// symmetric extension at both ends. Lowpass to the first half, highpass to
+// the second. The floors are arithmetic shifts
+static void Dwt97M(int16_t *x, uint32_t stride, int32_t n, int32_t *line)
+{
+	int32_t half = n / 2;
+
+	for (int32_t i = 0; i < n; i++) line[i] = x[i * stride];
+
+	for (int32_t j = 0; j < half; j++) {
+		int32_t near = line[2 * j] + line[Mirror(2 * j + 2, n)];
+		int32_t far  = line[Mirror(2 * j - 2, n)] + line[Mirror(2 * j + 4, n)];
+		x[(half + j) * stride] = (int16_t)(line[2 * j + 1] - ((9 * near - far + 8) >> 4));
+	}
+	for (int32_t j = 0; j < half; j++) {
+		int32_t d_prev = x[(half + ((j == 0) ? 0 : j - 1)) * stride];
+		int32_t d	   = x[(half + j) * stride];
+		x[j * stride] = (int16_t)(line[2 * j] - ((2 - (d_prev + d)) >> 2));
+	}
+}
+
+// Subbands in coding order: LL3, then HL, LH, HH from level 3 to 1
+static uint8_t Bands(wavelet_band_t *band, uint16_t width, uint16_t rows)
+{
+	uint8_t n = 0;
+	band[n++] = (wavelet_band_t){ 0, 0, width >> WAVELET_LEVELS, rows >> WAVELET_LEVELS };
+	for (uint8_t level = WAVELET_LEVELS; level > 0; level--) {
+		uint16_t w = width >> level, h = rows >> level;
+		band[n++] = (wavelet_band_t){ w, 0, w, h };
+		band[n++] = (wavelet_band_t){ 0, h, w, h };
+		band[n++] = (wavelet_band_t){ w, h, w, h };
+	}
+	return n;
+}
+
+static void EncodeSegment(wavelet_writer_t *wr, const int16_t *coef, uint16_t width, uint16_t rows, uint8_t stop_plane)
+{
+	wavelet_band_t band[1 + 3 * WAVELET_LEVELS];
+	uint8_t num_bands = Bands(band, width, rows);
+
+	uint16_t max = 0;
+	for (uint32_t i = 0; i < (uint32_t)width * rows; i++) {
+		uint16_t m = (uint16_t)((coef[i] < 0) ? -coef[i] : coef[i]);
+		if (m > max) max = m;
+	}
+	uint8_t planes = 0;
+	while (max >> planes) planes++;
+	PutBits(wr, planes, 8);
+
+	for (int8_t b = (int8_t)planes - 1; b >= (int8_t)stop_plane && !wr->full; b--) {
+		// Significance pass: coefficients still below 2^(b+1)
+		for (uint8_t s = 0; s < num_bands && !wr->full; s++) {
+			for (uint16_t y = 0; y < band[s].h; y++) {
+				const int16_t *c = &coef[(uint32_t)(band[s].y + y) * width + band[s].x];
+				for (uint16_t x = 0; x < band[s].w; x++) {
+					uint16_t m = (uint16_t)((c[x] < 0) ? -c[x] : c[x]);
+					if (m >> (b + 1)) continue;
+					uint8_t bit = (m >> b) & 1U;
+					PutSignificance(wr, bit);
+					if (bit) PutBits(wr, c[x] < 0, 1);
+				}
+			}
+		}
+		FlushSignificance(wr);
+
+		// Refinement pass: one bit of every coefficient found in a higher plane
+		for (uint8_t s = 0; s < num_bands && !wr->full; s++) {
+			for (uint16_t y = 0; y < band[s].h; y++) {
+				const int16_t *c = &coef[(uint32_t)(band[s].y + y) * width + band[s].x];
+				for (uint16_t x = 0; x < band[s].w; x++) {
+					uint16_t m = (uint16_t)((c[x] < 0) ? -c[x] : c[x]);
+					if (m >> (b + 1)) PutBits(wr, (m >> b) & 1U, 1);
+				}
+			}
+		}
+	}
+
+	if (wr->nbits && wr->pos < wr->size) {
+		wr->buf[wr->pos++] = (uint8_t)(wr->acc << (8 - wr->nbits));	// padded with zeros
+	}
+}
+
+HAL_StatusTypeDef Wavelet_Encode(const uint8_t *src, uint16_t width, uint16_t height,
+								 uint8_t *dst, uint32_t dst_size, uint32_t *bytes_written,
+								 const wavelet_options_t *options)
+{
+	uint8_t levels_mask = (1U << WAVELET_LEVELS) - 1U;
+	if (!src || !dst || !options || !options->work || width == 0 || height == 0 ||
+		(width & levels_mask) || (height & levels_mask) ||
+		options->work_size < WAVELET_WORK_SIZE(width) || dst_size < WAVELET_HEADER_SIZE) {
+		return HAL_ERROR;
+	}
+
+	int16_t *coef = (int16_t*)options->work;
+	int32_t *line = (int32_t*)(options->work + (uint32_t)width * WAVELET_STRIP_ROWS * 2U);
+
+	uint8_t header[WAVELET_HEADER_SIZE] = { 'C', '1', '2', '2',
+											(uint8_t)(width & 0xFF), (uint8_t)(width >> 8),
+											(uint8_t)(height & 0xFF), (uint8_t)(height >> 8),
+											WAVELET_LEVELS, WAVELET_STRIP_ROWS, options->stop_plane, 1 };
+	memcpy(dst, header, WAVELET_HEADER_SIZE);
+	uint32_t pos = WAVELET_HEADER_SIZE;
+
+	for (uint16_t row0 = 0; row0 < height; row0 += WAVELET_STRIP_ROWS) {
+		uint32_t left = (uint32_t)height - row0;
+		uint16_t rows = (uint16_t)((left < WAVELET_STRIP_ROWS) ? left : WAVELET_STRIP_ROWS);
+
+		// Y of the strip: every other byte of 4:2:2
+		const uint8_t *s = src + (uint32_t)row0 * width * 2U;
+		for (uint32_t i = 0; i < (uint32_t)width * rows; i++) {
+			coef[i] = s[2 * i];
+		}
+
+		uint16_t w = width, h = rows;
+		for (uint8_t level = 0; level < WAVELET_LEVELS; level++) {
+			for (uint16_t y = 0; y < h; y++) Dwt97M(&coef[(uint32_t)y * width], 1, w, line);
+			for (uint16_t x = 0; x < w; x++) Dwt97M(&coef[x], width, h, line);
+			w /= 2;
+			h /= 2;
+		}
+
+		// LL3 has unity DC gain: one thumbnail pixel per 8x8 block, no chroma
+		if (options->thumbnail) {
+			uint16_t thumb_width = TJE_THUMB_WIDTH(width);
+			for (uint16_t y = 0; y < h; y++) {
+				uint8_t *t = options->thumbnail + ((uint32_t)(row0 / 8U + y) * thumb_width) * 2U;
+				for (uint16_t x = 0; x < thumb_width; x++) {
+					int16_t v = coef[(uint32_t)y * width + ((x < w) ? x : w - 1)];
+					t[2 * x]	 = (uint8_t)((v < 0) ? 0 : (v > 255) ? 255 : v);
+					t[2 * x + 1] = 128;
+				}
+			}
+		}
+
+		if (dst_size - pos < WAVELET_SEGMENT_HEADER_SIZE) {
+			return HAL_ERROR;
+		}
+		uint32_t limit  = dst_size - pos - 4U;
+		uint8_t  budget = 0;										// 1: segment cut by the target size
+		if (options->target_size) {
+			uint32_t share = (options->target_size > WAVELET_HEADER_SIZE) ?
+							 (uint32_t)(((uint64_t)(options->target_size - WAVELET_HEADER_SIZE) * rows) / height) : 0;
+			share = (share > WAVELET_SEGMENT_HEADER_SIZE) ? share - 4U : 1U;		// bit planes byte at least
+			if (share <= limit) {
+				limit  = share;
+				budget = 1;
+			}
+		}
+
+		wavelet_writer_t wr = { 0 };
+		wr.buf  = dst + pos + 4U;
+		wr.size = limit;
+		EncodeSegment(&wr, coef, width, rows, options->stop_plane);
+		if (wr.full && !budget) {
+			return HAL_ERROR;										// dst too small for the stream
+		}
+
+		dst[pos]	  = (uint8_t)((wr.pos      ) & 0xFF);
+		dst[pos + 1U] = (uint8_t)((wr.pos >> 8 ) & 0xFF);
+		dst[pos + 2U] = (uint8_t)((wr.pos >> 16) & 0xFF);
+		dst[pos + 3U] = (uint8_t)((wr.pos >> 24) & 0xFF);
+		pos += 4U + wr.pos;
+	}
+
+	*bytes_written = pos;
+	return HAL_OK;
+}
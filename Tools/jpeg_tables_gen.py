@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+"""
+jpeg_tables_gen.py - generates Core/Inc/jpeg_tables.h for the JPEG encoder
+
+Everything the encoder used to derive at the start of each image is built
+here once and stored in flash:
+    - extended Huffman tables (code length and code for every symbol),
+      JPEG spec C.2 / K.3
+    - DQT tables for every quality preset, as written to the file
+    - AAN scaled reciprocal quantization tables for the float DCT
+
+Reciprocals are computed in float32, one rounding per operation in the same
+order as the C code did, so the encoder output is bit identical. Python floats
+are doubles, and 53 >= 2 * 24 + 2 bits makes rounding each double product or
+quotient to float32 the same as a native float32 operation.
+
+Usage: python3 Tools/jpeg_tables_gen.py > Core/Inc/jpeg_tables.h
+"""
+
+import struct
+
+# K.1 - suggested luminance QT
+QT_LUMA_FROM_SPEC = [
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99,
+]
+
+# Example QT from JPEG paper
+QT_CHROMA_FROM_PAPER = [
+    16, 12, 14, 14, 18, 24, 49, 72,
+    11, 10, 16, 24, 40, 51, 61, 12,
+    13, 17, 22, 35, 64, 92, 14, 16,
+    22, 37, 55, 78, 95, 19, 24, 29,
+    56, 64, 87, 98, 26, 40, 51, 68,
+    81, 103, 112, 58, 57, 87, 109, 104,
+    121, 100, 60, 69, 80, 103, 113, 120,
+    103, 55, 56, 62, 77, 92, 101, 99,
+]
+
+ZIG_ZAG = [
+    0, 1, 5, 6, 14, 15, 27, 28,
+    2, 4, 7, 13, 16, 26, 29, 42,
+    3, 8, 12, 17, 25, 30, 41, 43,
+    9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54,
+    20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63,
+]
+
+# K.3 - typical Huffman tables: (BITS, HUFFVAL)
+HT_LUMA_DC = ([0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0], list(range(12)))
+HT_CHROMA_DC = ([0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0], list(range(12)))
+HT_LUMA_AC = ([0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d], [
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA])
+HT_CHROMA_AC = ([0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77], [
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA])
+
+# order matches TJEI_LUMA_DC, TJEI_LUMA_AC, TJEI_CHROMA_DC, TJEI_CHROMA_AC
+HUFFMAN_TABLES = [("LUMA_DC", HT_LUMA_DC), ("LUMA_AC", HT_LUMA_AC),
+                  ("CHROMA_DC", HT_CHROMA_DC), ("CHROMA_AC", HT_CHROMA_AC)]
+
+AAN_SCALES = ["1.0", "1.387039845", "1.306562965", "1.175875602",
+              "1.0", "0.785694958", "0.541196100", "0.275899379"]
+
+NUM_QUALITY_PRESETS = 3
+
+
+def huffman_extend(bits, vals):
+    """Code length and code of every symbol (JPEG spec C.1, C.2)."""
+    sizes = [i + 1 for i in range(16) for _ in range(bits[i])]
+    codes = []
+    code = 0
+    size = sizes[0]
+    for s in sizes:
+        code <<= (s - size)
+        size = s
+        codes.append(code)
+        code += 1
+    ehuffsize = [0] * 256
+    ehuffcode = [0] * 256
+    for v, s, c in zip(vals, sizes, codes):
+        ehuffsize[v] = s
+        ehuffcode[v] = c
+    return ehuffsize, ehuffcode
+
+
+def quality_dqt(quality):
+    """DQT tables of a quality preset (1-3), stored in zig-zag order."""
+    if quality == 3:
+        return [1] * 64, [1] * 64
+    factor = 10 if quality == 2 else 1
+    luma = [max(q // factor, 1) for q in QT_LUMA_FROM_SPEC]
+    chroma = [max(q // factor, 1) for q in QT_CHROMA_FROM_PAPER]
+    return luma, chroma
+
+
+def f32(v):
+    """Rounds a double to the nearest float32."""
+    return struct.unpack("<f", struct.pack("<f", v))[0]
+
+
+def aan_reciprocal(dqt):
+    """1 / (8 * scale[x] * scale[y] * q), natural order, float32 arithmetic."""
+    aan = [f32(float(s)) for s in AAN_SCALES]
+    out = []
+    for y in range(8):
+        for x in range(8):
+            q = float(dqt[ZIG_ZAG[y * 8 + x]])
+            d = f32(f32(f32(8.0 * aan[x]) * aan[y]) * q)
+            out.append(f32(1.0 / d))
+    return out
+
+
+def c_rows(values, fmt, per_row):
+    rows = []
+    for i in range(0, len(values), per_row):
+        rows.append("    " + ", ".join(fmt(v) for v in values[i:i + per_row]) + ",")
+    return "\n".join(rows)
+
+
+def c_float(v):
+    """Exact C99 hex float literal."""
+    mantissa, exponent = v.hex().split("p")
+    return "%sp%sf" % (mantissa.rstrip("0").rstrip("."), exponent)
+
+
+def main():
+    out = []
+    out.append("/*")
+    out.append(" * jpeg_tables.h - constant tables for the JPEG encoder (jpeg.h)")
+    out.append(" *")
+    out.append(" * GENERATED by Tools/jpeg_tables_gen.py - do not edit by hand")
+    out.append(" */")
+    out.append("")
+    out.append("#ifndef __JPEG_TABLES_H__")
+    out.append("#define __JPEG_TABLES_H__")
+    out.append("")
+    out.append("#include <stdint.h>")
+    out.append("")
+    out.append("#define TJEI_NUM_QUALITY_PRESETS (%dU)" % NUM_QUALITY_PRESETS)
+    out.append("")
+
+    sizes, codes = zip(*(huffman_extend(*t) for _, t in HUFFMAN_TABLES))
+    out.append("// Code length of every symbol, 0 if not in the table")
+    out.append("// [LUMA_DC, LUMA_AC, CHROMA_DC, CHROMA_AC][symbol]")
+    out.append("static const uint8_t tjei_ehuffsize[4][256] =")
+    out.append("{")
+    for (name, _), table in zip(HUFFMAN_TABLES, sizes):
+        out.append("  { // %s" % name)
+        out.append(c_rows(table, str, 16))
+        out.append("  },")
+    out.append("};")
+    out.append("")
+    out.append("// Code of every symbol, right aligned")
+    out.append("static const uint16_t tjei_ehuffcode[4][256] =")
+    out.append("{")
+    for (name, _), table in zip(HUFFMAN_TABLES, codes):
+        out.append("  { // %s" % name)
+        out.append(c_rows(table, lambda v: "0x%04x" % v, 12))
+        out.append("  },")
+    out.append("};")
+    out.append("")
+
+    presets = [quality_dqt(q) for q in range(1, NUM_QUALITY_PRESETS + 1)]
+    for comp, idx in (("luma", 0), ("chroma", 1)):
+        out.append("// DQT %s tables as written to the file (zig-zag order), [quality - 1]" % comp)
+        out.append("static const uint8_t tjei_dqt_%s[TJEI_NUM_QUALITY_PRESETS][64] =" % comp)
+        out.append("{")
+        for q, p in enumerate(presets, 1):
+            out.append("  { // quality %d" % q)
+            out.append(c_rows(p[idx], str, 16))
+            out.append("  },")
+        out.append("};")
+        out.append("")
+
+    for comp, idx in (("luma", 0), ("chroma", 1)):
+        out.append("// AAN scaled reciprocal %s quantization (natural order), [quality - 1]" % comp)
+        out.append("static const float tjei_pqt_%s[TJEI_NUM_QUALITY_PRESETS][64] =" % comp)
+        out.append("{")
+        for q, p in enumerate(presets, 1):
+            out.append("  { // quality %d" % q)
+            out.append(c_rows(aan_reciprocal(p[idx]), c_float, 4))
+            out.append("  },")
+        out.append("};")
+        out.append("")
+
+    out.append("#endif /* __JPEG_TABLES_H__ */")
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+rice_decode.py - decodes the lossless images of Core/Src/rice.c
+
+The stream follows CCSDS 121.0 (unit delay prediction, adaptive Rice coding
+of blocks of 16 mapped residuals) without the zero block option and reference
+samples, see Core/Inc/rice.h. The output is the raw frame as the camera wrote
+it: YCbCr 4:2:2, [Y0, Cb, Y1, Cr] for every 2 pixels, width * 2 bytes a row.
+
+With --check, the decoded frame is compared byte by byte with a raw frame
+(e.g. downloaded with TRANSMIT_FRAME_RAW, or the source of a host encode):
+that is the round trip test of the encoder. Exit status 1 on mismatch.
+
+Usage: python3 Tools/rice_decode.py image.r121 frame.yuv [--check raw.yuv]
+"""
+
+import struct
+import sys
+
+HEADER_SIZE = 11
+ID_BITS = 3
+ID_EXTENSION = 0
+ID_NO_COMPRESSION = 7
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0            # in bits
+
+    def bits(self, count):
+        value = 0
+        for _ in range(count):
+            if self.pos >= 8 * len(self.data):
+                raise ValueError("stream ends in the middle of a block")
+            value = (value << 1) | ((self.data[self.pos >> 3] >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+    def fs(self):
+        zeros = 0
+        while self.bits(1) == 0:
+            zeros += 1
+        return zeros
+
+
+def read_block(r, block_size, sample_bits):
+    option = r.bits(ID_BITS)
+    if option == ID_EXTENSION:
+        if r.bits(1) != 1:
+            raise ValueError("zero block option is not used by the encoder")
+        d = []
+        for _ in range(block_size // 2):
+            gamma = r.fs()
+            # gamma = s (s + 1) / 2 + d1 with s = d0 + d1, d1 <= s
+            s = 0
+            while (s + 1) * (s + 2) // 2 <= gamma:
+                s += 1
+            d1 = gamma - s * (s + 1) // 2
+            d.extend((s - d1, d1))
+        return d
+    if option == ID_NO_COMPRESSION:
+        return [r.bits(sample_bits) for _ in range(block_size)]
+    k = option - 1
+    d = [r.fs() << k for _ in range(block_size)]
+    if k:
+        d = [v | r.bits(k) for v in d]
+    return d
+
+
+def unmap(mapped, predicted, max_value):
+    """Inverse of MapResidual"""
+    theta = min(predicted, max_value - predicted)
+    if mapped <= 2 * theta:
+        delta = mapped // 2 if mapped % 2 == 0 else -(mapped + 1) // 2
+    else:
+        delta = mapped - theta if predicted < max_value - predicted else theta - mapped
+    return predicted + delta
+
+
+def decode(stream):
+    if len(stream) < HEADER_SIZE or stream[:4] != b"R121":
+        raise ValueError("not a lossless image")
+    width, height, block_size, sample_bits, components = struct.unpack_from("<HHBBB", stream, 4)
+    max_value = (1 << sample_bits) - 1
+    frame = bytearray(width * height * 2)
+    r = BitReader(stream[HEADER_SIZE:])
+
+    # (first byte, step, width) of Y, Cb, Cr in the 4:2:2 frame
+    for offset, step, plane_width in ((0, 2, width), (1, 4, width // 2), (3, 4, width // 2)):
+        mapped = []
+        for y in range(height):
+            row = y * width * 2
+            for x in range(plane_width):
+                if not mapped:
+                    mapped = read_block(r, block_size, sample_bits)[::-1]
+                if x > 0:
+                    predicted = frame[row + offset + (x - 1) * step]
+                elif y > 0:
+                    predicted = frame[row - width * 2 + offset]
+                else:
+                    predicted = 128
+                frame[row + offset + x * step] = unmap(mapped.pop(), predicted, max_value)
+        # the rest of the last block is padding
+    return width, height, bytes(frame)
+
+
+def main():
+    args = sys.argv[1:]
+    check = None
+    if len(args) == 4 and args[2] == "--check":
+        check = args[3]
+        args = args[:2]
+    if len(args) != 2:
+        sys.exit(__doc__.strip().splitlines()[-1])
+
+    with open(args[0], "rb") as f:
+        width, height, frame = decode(f.read())
+    with open(args[1], "wb") as f:
+        f.write(frame)
+
+    if check:
+        with open(check, "rb") as f:
+            raw = f.read()[:len(frame)]
+        if raw != frame:
+            first = next((i for i, (a, b) in enumerate(zip(raw, frame)) if a != b), min(len(raw), len(frame)))
+            print("round trip FAILED: %dx%d, first difference at byte %d" % (width, height, first))
+            sys.exit(1)
+        print("round trip OK: %dx%d, %d bytes identical" % (width, height, len(frame)))
+
+
+if __name__ == "__main__":
+    main()
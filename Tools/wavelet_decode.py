@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""
+wavelet_decode.py - decodes the wavelet images of Core/Src/wavelet.c to PGM
+
+The stream follows the structure of CCSDS 122.0 (integer 9/7M DWT, 3 levels,
+embedded bit plane segments) but is not compliant, see Core/Inc/wavelet.h.
+Every segment can be cut at any byte: whatever was received of it is decoded,
+coefficients whose lower bit planes are missing are set to the middle of
+their interval. A missing or short file still gives an image, blurrier where
+segments are short.
+
+Usage: python3 Tools/wavelet_decode.py image.c122 image.pgm
+"""
+
+import struct
+import sys
+
+HEADER_SIZE = 12
+RUN_K_MAX = 15
+
+
+class Truncated(Exception):
+    pass
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0            # in bits
+
+    def bit(self):
+        if self.pos >= 8 * len(self.data):
+            raise Truncated()
+        b = (self.data[self.pos >> 3] >> (7 - (self.pos & 7))) & 1
+        self.pos += 1
+        return b
+
+    def bits(self, count):
+        value = 0
+        for _ in range(count):
+            value = (value << 1) | self.bit()
+        return value
+
+
+class SignificanceReader:
+    """Mirror of PutSignificance / FlushSignificance"""
+
+    def __init__(self, reader):
+        self.r = reader
+        self.k = 0
+        self.zeros = 0          # zeros still to hand out
+        self.one = False        # a one follows them
+
+    def next(self):
+        if self.zeros == 0 and not self.one:
+            if self.r.bit() == 0:
+                self.zeros = 1 << self.k
+                self.k = min(self.k + 1, RUN_K_MAX)
+            else:
+                self.zeros = self.r.bits(self.k)
+                self.one = True
+                self.k = max(self.k - 1, 0)
+        if self.zeros:
+            self.zeros -= 1
+            return 0
+        self.one = False
+        return 1
+
+    def end_pass(self):
+        # zeros of a flushed run that go past the end of the pass
+        self.zeros = 0
+
+
+def mirror(i, n):
+    while i < 0 or i > n - 1:
+        i = -i if i < 0 else 2 * (n - 1) - i
+    return i
+
+
+def idwt97m(v):
+    """Inverse of Dwt97M: v holds lowpass then highpass, returns the samples"""
+    n = len(v)
+    half = n // 2
+    c, d = v[:half], v[half:]
+    x = [0] * n
+    for j in range(half):
+        d_prev = d[j - 1] if j > 0 else d[0]
+        x[2 * j] = c[j] + ((2 - (d_prev + d[j])) >> 2)
+    for j in range(half):
+        near = x[2 * j] + x[mirror(2 * j + 2, n)]
+        far = x[mirror(2 * j - 2, n)] + x[mirror(2 * j + 4, n)]
+        x[2 * j + 1] = d[j] + ((9 * near - far + 8) >> 4)
+    return x
+
+
+def bands(width, rows, levels):
+    out = [(0, 0, width >> levels, rows >> levels)]
+    for level in range(levels, 0, -1):
+        w, h = width >> level, rows >> level
+        out += [(w, 0, w, h), (0, h, w, h), (w, h, w, h)]
+    return out
+
+
+def decode_segment(data, width, rows, levels, stop_plane):
+    n = width * rows
+    mag = [0] * n
+    neg = [False] * n
+    low = [0] * n                  # lowest bit plane known of each coefficient
+    order = []
+    for bx, by, bw, bh in bands(width, rows, levels):
+        for y in range(bh):
+            base = (by + y) * width + bx
+            order.extend(range(base, base + bw))
+
+    r = BitReader(data)
+    try:
+        planes = r.bits(8)
+        low = [planes] * n
+        sig = SignificanceReader(r)
+        for b in range(planes - 1, stop_plane - 1, -1):
+            for i in order:
+                if mag[i] >> (b + 1):
+                    continue
+                if sig.next():
+                    neg[i] = r.bit() == 1
+                    mag[i] |= 1 << b
+                low[i] = b
+            sig.end_pass()
+            for i in order:
+                if mag[i] >> (b + 1):
+                    mag[i] |= r.bit() << b
+                    low[i] = b
+    except Truncated:
+        pass
+
+    coef = [0] * n
+    for i in range(n):
+        if mag[i]:
+            m = mag[i] + ((1 << low[i]) >> 1)
+            coef[i] = -m if neg[i] else m
+    return coef
+
+
+def inverse_strip(coef, width, rows, levels):
+    for level in range(levels - 1, -1, -1):
+        w, h = width >> level, rows >> level
+        for x in range(w):
+            col = idwt97m([coef[y * width + x] for y in range(h)])
+            for y in range(h):
+                coef[y * width + x] = col[y]
+        for y in range(h):
+            base = y * width
+            coef[base:base + w] = idwt97m(coef[base:base + w])
+    return coef
+
+
+def decode(stream):
+    if len(stream) < HEADER_SIZE or stream[:4] != b"C122":
+        raise ValueError("not a wavelet image")
+    width, height, levels, strip_rows, stop_plane, components = struct.unpack_from("<HHBBBB", stream, 4)
+    image = bytearray(width * height)
+    pos = HEADER_SIZE
+    for row0 in range(0, height, strip_rows):
+        rows = min(strip_rows, height - row0)
+        if pos + 4 <= len(stream):
+            (length,) = struct.unpack_from("<I", stream, pos)
+            data = stream[pos + 4:pos + 4 + length]
+            pos += 4 + length
+        else:
+            data = b""
+        strip = inverse_strip(decode_segment(data, width, rows, levels, stop_plane), width, rows, levels)
+        for i, v in enumerate(strip):
+            image[row0 * width + i] = 0 if v < 0 else 255 if v > 255 else v
+    return width, height, bytes(image)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__.strip().splitlines()[-1])
+    with open(sys.argv[1], "rb") as f:
+        width, height, image = decode(f.read())
+    with open(sys.argv[2], "wb") as f:
+        f.write(b"P5\n%d %d\n255\n" % (width, height))
+        f.write(image)
+
+
+if __name__ == "__main__":
+    main()